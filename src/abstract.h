@@ -3,23 +3,28 @@
 #ifdef __KERNEL__
 
 #define ALLOCMEM(size, flags) kmalloc(size, flags)
+#define ALLOCMEM_NODE(size, flags, node) kmalloc_node(size, flags, node)
 #define REALLOCMEM(ptr, size, flags) krealloc(ptr, size, flags)
 #define FREEMEM(ptr) kfree(ptr)
 #define PRINT(msg) printk(msg)
 #define PRINTARGS(msg, ...) printk(msg, __VA_ARGS__)
-#define STRNICMP(...) strnicmp(__VA_ARGS__)
+#define STRNICMP(...) strncasecmp(__VA_ARGS__)
 #define UNLIKELY(arg) unlikely(arg)
+#define PREFETCH(addr) prefetch(addr)
 
 #else
 /* following are just for flags in kmalloc calls so we have a definition of something */
 #define GFP_KERNEL 0
+#define GFP_ATOMIC 0
 
 #define ALLOCMEM(size, flags) malloc(size)
+#define ALLOCMEM_NODE(size, flags, node) malloc(size)
 #define REALLOCMEM(ptr, size, flags) realloc(ptr, size)
 #define FREEMEM(ptr) free(ptr)
 #define PRINT(msg) printf(msg)
 #define PRINTARGS(msg, ...) printf(msg, __VA_ARGS__)
 #define STRNICMP(...) strncasecmp(__VA_ARGS__)
 #define UNLIKELY(arg) arg
+#define PREFETCH(addr) __builtin_prefetch(addr)
 
 #endif
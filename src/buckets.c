@@ -11,9 +11,13 @@
 	A set of one or more buckets is maintained. Memory requirements are split into
 	discrete, disjoint blocks based on an initial size and a growth factor (this 
 	is inspired by memcached, and was chosen to allow for direct comparisons more
-	fairly). Each bucket maintains a set of pointers to one or more "pages" of 
-	memory (this is an internal page concept, and is not a 1:1 correspondence with
-	pages of memory at the level of the hardware/elsewhere in the kernel).
+	fairly). The smallest and largest sizes, the growth factor and the page size
+	can all be set with ub_buckets_set_geometry() before the allocator starts; 
+	sizes are rounded up to UB_CLASS_ALIGN bytes, and the bucket for a given 
+	size is then found from a table built at startup. Each bucket maintains a
+	set of pointers to one or more "pages" of memory (this is an internal page
+	concept, and is not a 1:1 correspondence with pages of memory at the level
+	of the hardware/elsewhere in the kernel).
 
 	Allocating an object in the cache then involves:
 
@@ -29,31 +33,161 @@
 
 	4. Repeat, ad infinitum.
 
+	If no page can be assigned because the memory limit has been reached, the 
+	least recently used item in the bucket is evicted and its chunk reused. Each
+	bucket keeps a doubly linked LRU list of the items stored in it; new items go
+	on the head, and hits merely flag an item as active. When looking for a 
+	victim, active items found at the tail are given a second chance by moving
+	them back to the head (up to UB_LRU_SEARCH_MAX of them) before the tail item 
+	is evicted through the callback registered with ub_buckets_set_evictor().
+
+	Lookups take no locks and rely on RCU alone (epochs in userland, see 
+	user/epoch.c), so an evicted chunk can't be reused until every reader 
+	which might have found it has finished. In the kernel, once a bucket is 
+	out of pages it evicts ahead of need, UB_EVICT_BATCH items at a time, 
+	handing them to call_rcu, whose callback runs the release callback on 
+	them and puts their chunks in the depot; nobody waits for the grace 
+	period. This keeps a reserve of chunks free or on their way back, which 
+	grows whenever an allocation finds the depot empty nonetheless. Such an 
+	allocation doesn't fail while there is anything to evict: it evicts a 
+	batch itself and waits out the grace period (outside every lock) for 
+	one of their chunks. Userland always does just that, for one item at a
+	time, so that a single thread never defers reclaiming anything.
+
+	Pages are not tied to a bucket for ever. ub_buckets_rebalance_due() is 
+	called periodically (from a background thread in the kernel) and compares
+	the number of evictions each bucket has suffered since the last call. A 
+	bucket which has had the most evictions for UB_REBALANCE_WINDOWS calls in a
+	row is given the oldest page of a bucket which has evicted nothing, 
+	preferring the one with the most free chunks; anything still living on 
+	that page is evicted first. This is much the same as memcached's 
+	slab_automove.
+
+	Chunks handed back through ub_buckets_free() are threaded onto a free list
+	kept per bucket, using the first word of the dead chunk as the link pointer.
+	The free list is always consulted before carving a fresh chunk from the
+	current page, so a workload which overwrites the same keys over and over
+	recycles its chunks rather than eating through the memory limit.
+
+	Allocation and freeing do not go to the bucket directly in the common case.
+	Each CPU keeps a small "magazine" of chunks for every bucket, and allocations
+	are served from and frees returned to the local magazine with nothing more
+	than interrupts disabled (this is the same idea as the per-CPU array caches
+	in the kernel's SLAB allocator). Only when a magazine runs empty or full is 
+	the bucket itself (the "depot") locked, and chunks are then moved in batches
+	of UB_MAGAZINE_BATCH. In userland, where a thread can't keep others off 
+	its CPU, each thread has magazines of its own instead, behind a lock which
+	nothing else takes but the rebalancer draining them. Each node's page pool
+	is protected by a separate mutex as getting hold of new pages may sleep; it
+	is never taken with a depot locked.
+
+	On NUMA machines, the buckets, page pool and rebalancer state are kept per
+	memory node (struct node_state) and pages are allocated on the node whose
+	pool they go in. A CPU normally allocates from its own node's buckets, so 
+	RX workers store items in memory local to them. In the interleave policy, 
+	successive magazine refills rotate around the nodes instead, which spreads
+	read-mostly hot items over all the memory controllers. A chunk always goes
+	back to the depot of the node its page is on, wherever it was freed.
+
+	Values too large for the biggest bucket are stored by the caller as a head
+	chunk from that bucket followed by a chain of chunks from 
+	ub_buckets_alloc_chain(): all but the last of these also come from the 
+	biggest bucket, and the last from whichever bucket fits what is left. Only
+	the head goes on an LRU list, so evicting it has to free the chain too. 
+	Chained chunks can't be found to be evicted when their page is taken by the
+	rebalancer, so a bucket with any out is never used as a donor.
+
+	Pages are carved out of 2 MiB huge pages where these can be had (from the 
+	buddy allocator in the kernel, and hugetlbfs or transparent huge pages in 
+	userland), falling back to allocating each page on its own. With 
+	ub_buckets_prealloc() the whole memory limit is taken up front, with one 
+	thread per node doing the work in parallel in the kernel.
+
 	*/
 
 #include <abstract.h>
 #include <buckets.h>
 
 #ifdef __KERNEL__
+#include <kernel/compat.h>
+
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/gfp.h>
+#include <linux/irqflags.h>
+#include <linux/kthread.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/nodemask.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/topology.h>
 #include <linux/types.h>
 #else
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <user/sync.h>
 #endif
 
-#define UB_PAGE_SIZE 1048576
-#define UB_MAX_BUCKETS 16
+#define UB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define UB_MAX_BUCKETS 64
 #define UB_MAX_PAGES 32
-#define UB_BUCKET_MIN_SIZE 512
-#define UB_GROWTH_FACTOR 1.25
+#define UB_CLASS_ALIGN 8
+#define UB_LRU_SEARCH_MAX 5
+#define UB_REBALANCE_WINDOWS 3
+#define UB_MAGAZINE_SIZE 32
+#define UB_MAGAZINE_BATCH (UB_MAGAZINE_SIZE / 2)
+
+/* waiting for a grace period is slow, so make it worth it in the kernel */
+#define UB_EVICT_BATCH UB_MAGAZINE_BATCH
+#ifdef __KERNEL__
+#define UB_EVICT_NOW UB_EVICT_BATCH
+#else
+#define UB_EVICT_NOW 1
+#endif
+/* chunks a bucket tries to keep free or on their way back from eviction 
+   once it is out of pages, to begin with, and at most as a share of all its
+   chunks (1/UB_EVICT_RESERVE_SHARE) */
+#define UB_EVICT_RESERVE_MIN (2 * UB_EVICT_BATCH)
+#define UB_EVICT_RESERVE_SHARE 32
+
+#ifdef __KERNEL__
+#define UB_MAX_NODES MAX_NUMNODES
+#else
+#define UB_MAX_NODES 1
+#endif
 
 static size_t memory_limit;
 static size_t memory_used = 0;
 
+/* the bucket geometry, see ub_buckets_set_geometry() */
+static size_t page_size = UB_PAGE_SIZE;
+static size_t class_min = UB_CLASS_MIN_SIZE;
+static size_t class_max = UB_CLASS_MAX_SIZE;
+static unsigned int class_growth = UB_CLASS_GROWTH;
+
+#define CLASS_ALIGN(x) \
+	(((x) + UB_CLASS_ALIGN - 1) & ~((size_t) UB_CLASS_ALIGN - 1))
+
+/* the item size of each bucket, and the bucket for each multiple of 
+   UB_CLASS_ALIGN bytes up to class_max */
+static size_t class_size[UB_MAX_BUCKETS];
+static int bucket_count;
+static unsigned char* class_lookup;
+
 struct bucket
 {
 	size_t itemsize;    /* size of the items to go into this bucket <= itemsize  */
+	void*  page_moving; /* page being taken by the rebalancer, if any            */
 
 	int    items_max;   /* the maximum number of items per page                  */
 	int page_items_cur; /* how many items in the current page?                   */
@@ -62,14 +196,213 @@ struct bucket
 	void*  page_cur;    /* which location should be written to next? */
 	int    pages_space; /* how much space is in void** pages array for pointers? */
 	int    pages_alloc; /* how many pages do we have in the void** pages array?  */
+
+	void*  free_head;   /* singly linked list of chunks returned by ub_buckets_free */
+	int    free_count;  /* how many chunks are sitting on the free list?         */
+
+	struct ub_lru_link* lru_head; /* most recently stored item               */
+	struct ub_lru_link* lru_tail; /* next candidate for eviction             */
+	unsigned long evictions;      /* items evicted to make room in this bucket */
+	unsigned long evictions_prev; /* evictions at the last rebalancing pass    */
+	int    chained;     /* chunks out as part of chained values (not on the LRU) */
+	int    evicting;    /* chunks of evicted items waiting out a grace period    */
+	int    evict_reserve; /* free and evicting chunks to keep when out of pages  */
+
+	int    id;          /* index of this bucket within its node                  */
+	int    node;        /* memory node which all of the bucket's pages are on    */
+
+	spinlock_t lock;    /* protects all of the above (the depot)                 */
+};
+
+/* how a region of memory backing some pages was obtained, so that it can be 
+   freed in the same way */
+enum region_kind {
+	region_malloc,  /* ALLOCMEM, or posix_memalign in userland */
+	region_pages,   /* alloc_pages in the kernel               */
+	region_hugetlb  /* mmap with MAP_HUGETLB in userland        */
+};
+
+struct page_region
+{
+	struct page_region* next;
+	void*  addr;
+	size_t size;
+	enum region_kind kind;
+};
+
+/* everything kept per memory node */
+struct node_state
+{
+	struct bucket buckets[UB_MAX_BUCKETS];
+	int node;
+
+	/* pages are kept on this list (linked through their first word) until they
+	   are assigned to a bucket */
+	void* pages_free;
+	int   pages_avail;
+
+	/* the memory the node's pages were carved from, and how much of it */
+	struct page_region* regions;
+	size_t memory;
+
+	struct mutex pool_lock; /* protects the above; may sleep allocating pages */
+
+	/* state for the rebalancer, which looks for the same bucket starving for
+	   several passes in a row before moving a page to it */
+	int rebalance_starved;
+	int rebalance_windows;
+
+	/* a page on its way between buckets, and the items evicted from it */
+	struct bucket* move_from;
+	struct bucket* move_to;
+	void* move_page;
+	struct ub_lru_link* move_victims;
+};
+
+/* a batch of evicted items on their way through a grace period */
+struct evict_batch
+{
+	struct rcu_head rcu;
+	struct bucket* b;
+	int n;
+	struct ub_lru_link* victims[UB_EVICT_BATCH];
+	void* chunks[UB_EVICT_BATCH];
+};
+
+/* a CPU's cache of free chunks for one bucket */
+struct magazine
+{
+	int   count;
+	void* chunks[UB_MAGAZINE_SIZE];
+};
+
+struct cpu_magazines
+{
+	struct magazine bucket[UB_MAX_BUCKETS];
+#ifndef __KERNEL__
+	spinlock_t lock;
+	struct cpu_magazines* next;
+#endif
 };
 
-/* pointers to pages are stored in this array until they are assigned to a bucket */
-static void* pages[UB_MAX_PAGES];
-static int pages_avail = 0;
+static DEFINE_SPINLOCK(memory_lock);
+
+#define POOL_LOCK(ns)   mutex_lock(&(ns)->pool_lock)
+#define POOL_UNLOCK(ns) mutex_unlock(&(ns)->pool_lock)
+#define MEMORY_LOCK()   spin_lock(&memory_lock)
+#define MEMORY_UNLOCK() spin_unlock(&memory_lock)
+#define DEPOT_LOCK(b, flags)   spin_lock_irqsave(&(b)->lock, flags)
+#define DEPOT_UNLOCK(b, flags) spin_unlock_irqrestore(&(b)->lock, flags)
+
+#ifdef __KERNEL__
+/* allocated at startup, being too large for a module's static per-CPU area */
+static struct cpu_magazines __percpu* magazines;
+
+/* the running CPU's magazines, which are ours alone until MAGAZINES_PUT */
+#define MAGAZINES_GET(flags) \
+	({ local_irq_save(flags); this_cpu_ptr(magazines); })
+#define MAGAZINES_PUT(flags) local_irq_restore(flags)
+#else
+/* Every thread's magazines, on a list headed by a set allocated at startup
+   which is shared by any thread which can't have its own. */
+static struct cpu_magazines* magazines;
+static DEFINE_SPINLOCK(magazines_lock); /* protects the list */
+static __thread struct cpu_magazines* thread_magazines;
+
+/* the calling thread's magazines, locked */
+static struct cpu_magazines* magazines_get(void)
+{
+	struct cpu_magazines* m = thread_magazines;
+
+	if (UNLIKELY(!m))
+	{
+		m = ALLOCMEM(sizeof(struct cpu_magazines), GFP_KERNEL);
+		if (m)
+		{
+			memset(m, 0, sizeof(struct cpu_magazines));
+			spin_lock_init(&m->lock);
+
+			spin_lock(&magazines_lock);
+			m->next = magazines->next;
+			magazines->next = m;
+			spin_unlock(&magazines_lock);
+		}
+		else
+			m = magazines;
+		thread_magazines = m;
+	}
+
+	spin_lock(&m->lock);
+	return m;
+}
+
+#define MAGAZINES_GET(flags) ((flags) = 0, magazines_get())
+#define MAGAZINES_PUT(flags) ((void) (flags), spin_unlock(&thread_magazines->lock))
+#endif
+
+/* per node state, NULL for nodes which have no memory */
+static struct node_state* nodes[UB_MAX_NODES];
+/* how many buckets have a page_moving */
+static int pages_moving;
+
+#define BUCKET(node, id) (&nodes[node]->buckets[id])
+
+static int numa_policy = UB_NUMA_LOCAL;
+static int use_hugepages = 1;
+
+#ifdef __KERNEL__
+/* next node to refill from under the interleave policy (races are harmless) */
+static unsigned int interleave_next = 0;
+#endif
+
+/* invoked to evict an item when a bucket is out of memory, and to finish the
+   job once it is safe to reuse its chunk */
+static ub_buckets_evict_fn evictor = NULL;
+static ub_buckets_release_fn releaser = NULL;
+
+#ifdef NUMA_STATS
+#ifdef __KERNEL__
+static DEFINE_PER_CPU(unsigned long, accesses_local);
+static DEFINE_PER_CPU(unsigned long, accesses_remote);
+#else
+static unsigned long accesses_local;
+#endif
+#endif
+
+/* the node whose depots this CPU should use */
+static inline int node_local(void)
+{
+#ifdef __KERNEL__
+	if (numa_policy != UB_NUMA_OFF)
+		return numa_mem_id();
+#endif
+	return 0;
+}
+
+/* the node whose depot a chunk belongs to */
+static inline int chunk_node(void* location)
+{
+#ifdef __KERNEL__
+	if (numa_policy != UB_NUMA_OFF)
+		return page_to_nid(virt_to_page(location));
+#endif
+	return 0;
+}
 
-/* Array of buckets */
-static struct bucket buckets[UB_MAX_BUCKETS];
+/* the node to take a fresh batch of chunks from */
+static int node_for_refill(void)
+{
+#ifdef __KERNEL__
+	if (numa_policy == UB_NUMA_INTERLEAVE)
+	{
+		int node = interleave_next++ % nr_node_ids;
+		while (!nodes[node])
+			node = (node + 1) % nr_node_ids;
+		return node;
+	}
+#endif
+	return node_local();
+}
 
 /* determine whether the pages allocated so far consume the memory budget */
 static inline int pages_out_of_memory(void)
@@ -77,199 +410,1404 @@ static inline int pages_out_of_memory(void)
 	return (memory_used >= memory_limit) ? -1 : 0;
 }
 
-/* add more pages to the pages[] array if it is empty */
-static int pages_add(void)
+/* whether a bucket on the node would find no page to take (read without the
+   pool locked, so only a hint) */
+static inline int node_out_of_pages(int node)
 {
-	int pagecount;
-
-	/* don't allocate if there's still pages to be allocated */
-	if (pages_avail > 0)
-		return 0;
+	return pages_out_of_memory() && READ_ONCE(nodes[node]->pages_avail) == 0;
+}
 
-	/* don't allocate if the system has consumed the memory quota */
-	if (pages_out_of_memory())
-		return -ENOMEM;
+/* Get a region of memory to carve pages from on a node, preferably a 2 MiB 
+   huge page (split into several of our pages) so that lookups touching items
+   on it share a single TLB entry. Falls back to a single ordinary page of our
+   own if no huge page can be had. */
+static void* region_alloc(int node, size_t* size, enum region_kind* kind)
+{
+	void* addr;
 
-	for (pagecount = 0; pagecount < UB_MAX_PAGES; pagecount++)
-	{
-		void* page = ALLOCMEM(UB_PAGE_SIZE, GFP_KERNEL);
 #ifdef __KERNEL__
-		/* ksize(...)-esque checks have no analogue in userspace */
-		if (ksize(page) < UB_PAGE_SIZE)
+	if (use_hugepages)
+	{
+		gfp_t gfp = GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY;
+		struct page* p;
+
+		if (numa_policy != UB_NUMA_OFF)
+			p = alloc_pages_node(node, gfp | __GFP_THISNODE, 
+				get_order(UB_HUGE_PAGE_SIZE));
+		else
+			p = alloc_pages(gfp, get_order(UB_HUGE_PAGE_SIZE));
+
+		if (p)
 		{
+			*size = UB_HUGE_PAGE_SIZE;
+			*kind = region_pages;
+			return page_address(p);
+		}
+	}
+
+	if (numa_policy != UB_NUMA_OFF)
+		addr = kmalloc_node(page_size, 
+			GFP_KERNEL | __GFP_THISNODE | __GFP_NOWARN, node);
+	else
+		addr = kmalloc(page_size, GFP_KERNEL);
+
+	/* ksize(...)-esque checks have no analogue in userspace */
+	if (addr && ksize(addr) < page_size)
+	{
 #ifdef DEBUG
-			PRINTARGS(KERN_WARNING "[Unbuckle] Asked for pages of size %lu, "
-				"but got %lu.", UB_PAGE_SIZE, ksize(page));
+		PRINTARGS(KERN_WARNING "[Unbuckle] Asked for pages of size %lu, "
+			"but got %lu.", page_size, ksize(addr));
 #endif
-			return -EFAULT;
+		kfree(addr);
+		addr = NULL;
+	}
+#else
+	if (use_hugepages)
+	{
+#ifdef MAP_HUGETLB
+		/* reserved huge pages from hugetlbfs first... */
+		addr = mmap(NULL, UB_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, 
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr != MAP_FAILED)
+		{
+			*size = UB_HUGE_PAGE_SIZE;
+			*kind = region_hugetlb;
+			return addr;
+		}
+#endif
+		/* ...then ask for a transparent huge page */
+		if (!posix_memalign(&addr, UB_HUGE_PAGE_SIZE, UB_HUGE_PAGE_SIZE))
+		{
+#ifdef MADV_HUGEPAGE
+			madvise(addr, UB_HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+#endif
+			*size = UB_HUGE_PAGE_SIZE;
+			*kind = region_malloc;
+			return addr;
 		}
+	}
+
+	addr = ALLOCMEM(page_size, GFP_KERNEL);
+#endif
+
+	*size = page_size;
+	*kind = region_malloc;
+	return addr;
+}
+
+/* give a region back in the same way as it was obtained */
+static void region_free(struct page_region* r)
+{
+	switch (r->kind)
+	{
+#ifdef __KERNEL__
+	case region_pages:
+		free_pages((unsigned long) r->addr, get_order(r->size));
+		break;
+#else
+	case region_hugetlb:
+		munmap(r->addr, r->size);
+		break;
 #endif
-		pages[pagecount] = page;
+	default:
+		FREEMEM(r->addr);
+		break;
+	}
+}
+
+/* put a page on a node's free pool. Called with the pool locked. */
+static inline void pool_put(struct node_state* ns, void* page)
+{
+	*((void**) page) = ns->pages_free;
+	ns->pages_free = page;
+	ns->pages_avail++;
+}
+
+/* Add one region's worth of pages to a node's free pool. Called with the pool 
+   locked. */
+static int pages_grow(struct node_state* ns)
+{
+	struct page_region* r;
+	size_t offset;
+
+	/* don't allocate if the system has consumed the memory quota */
+	if (pages_out_of_memory())
+		return -ENOMEM;
+
+	r = ALLOCMEM(sizeof(struct page_region), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
 
-		memory_used += UB_PAGE_SIZE;
-		pages_avail++;
+	r->addr = region_alloc(ns->node, &r->size, &r->kind);
+	if (!r->addr)
+	{
+		FREEMEM(r);
+		return -ENOMEM;
 	}
 
+	r->next = ns->regions;
+	ns->regions = r;
+	ns->memory += r->size;
+
+	for (offset = 0; offset < r->size; offset += page_size)
+		pool_put(ns, (char*) r->addr + offset);
+
+	MEMORY_LOCK();
+	memory_used += r->size;
+	MEMORY_UNLOCK();
+
 	return 0;
 }
 
-/* get a page from the back of the free pool, and add more if we're all out */
-static void* page_get(void)
+/* add more pages to a node's pool if it is empty. Called with the pool 
+   locked. */
+static int pages_add(struct node_state* ns)
+{
+	/* don't allocate if there's still pages to be allocated */
+	if (ns->pages_avail > 0)
+		return 0;
+
+	while (ns->pages_avail < UB_MAX_PAGES)
+		if (pages_grow(ns) < 0)
+			break;
+
+	return ns->pages_avail > 0 ? 0 : -ENOMEM;
+}
+
+/* get a page from a node's free pool, and add more if we're all out. This may
+   sleep, so must not be called with a depot locked. */
+static void* page_get(int node)
 {
-	if (pages_avail == 0)
-		if (pages_add() < 0)
-			return NULL;
-	return pages[--pages_avail];
+	struct node_state* ns = nodes[node];
+	void* page = NULL;
+
+	POOL_LOCK(ns);
+	if (pages_add(ns) == 0)
+	{
+		page = ns->pages_free;
+		ns->pages_free = *((void**) page);
+		ns->pages_avail--;
+	}
+	POOL_UNLOCK(ns);
+
+	return page;
 }
 
-/* free the pool of scratch pages which have not yet been assigned */
-static void pages_free_scratch(void)
+/* give back a page which turned out not to be needed */
+static void page_put(int node, void* page)
 {
-	int page;
+	struct node_state* ns = nodes[node];
+
+	POOL_LOCK(ns);
+	pool_put(ns, page);
+	POOL_UNLOCK(ns);
+}
 
-	for (page = 0; page < pages_avail; page++)
+/* free every region of memory the node's pages were carved from */
+static void regions_free(struct node_state* ns)
+{
+	while (ns->regions)
 	{
-		FREEMEM(pages[page]);
-		pages[page] = NULL;
+		struct page_region* r = ns->regions;
+		ns->regions = r->next;
+		region_free(r);
+		FREEMEM(r);
 	}
 
+	ns->pages_free = NULL;
+	ns->pages_avail = 0;
+	ns->memory = 0;
+
 	return;
 }
 
-/* adds a page to a bucket, possibly because it has used up all of its current
-   allocations */
-static int bucket_add_page(int bucket)
+/* make sure there's enough space in the bucket for another page pointer. This
+   happens with the depot locked, hence the atomic allocation; it is only needed
+   each time the number of pages in the bucket doubles. */
+static int bucket_grow_pages(struct bucket* b)
 {
-	void* page;
+	void** grown;
 
-	if (bucket < 0 || bucket > UB_MAX_BUCKETS)
-		return -EFBIG;
-	
-	/* can't do it if we've used the memory quota and have no spare pages */
-	if (pages_out_of_memory() && pages_avail == 0)
+	if (b->pages_space > b->pages_alloc)
+		return 0;
+
+	grown = REALLOCMEM(b->pages, b->pages_space * sizeof(void*) * 2, GFP_ATOMIC);
+	if (!grown)
 		return -ENOMEM;
-	
-	/* enough space in the bucket for another page pointer? */
-	if (buckets[bucket].pages_space == buckets[bucket].pages_alloc)
+
+	b->pages = grown;
+	b->pages_space *= 2;
+	return 0;
+}
+
+/* Adds a page to a bucket, possibly because it has used up all of its current
+   allocations, or because the page has been moved from another bucket. If the
+   bucket's current page is used up the new page becomes the current page. 
+   Otherwise it is slotted in before the current page, so that the current page 
+   stays last in the pages array, and all of its chunks go onto the free list. 
+   Called with the depot locked. */
+static int bucket_attach_page(struct bucket* b, void* page)
+{
+	int i;
+
+	if (bucket_grow_pages(b) < 0)
+		return -ENOMEM;
+
+	if (b->pages_alloc == 0 || b->page_items_cur == b->items_max)
+	{
+		b->pages[b->pages_alloc] = page;
+		b->pages_alloc++;
+		b->page_cur = page;
+		b->page_items_cur = 0;
+		return 0;
+	}
+
+	b->pages[b->pages_alloc] = b->pages[b->pages_alloc - 1];
+	b->pages[b->pages_alloc - 1] = page;
+	b->pages_alloc++;
+
+	for (i = 0; i < b->items_max; i++)
 	{
-		buckets[bucket].pages = REALLOCMEM(buckets[bucket].pages, 
-			buckets[bucket].pages_space * sizeof(void*) * 2, GFP_KERNEL);
-		buckets[bucket].pages_space *= 2;
+		void* location = (char*) page + i * b->itemsize;
+		*((void**) location) = b->free_head;
+		b->free_head = location;
+		b->free_count++;
 	}
 
-	/* add a page to the next position available in the bucket */
-	page = page_get();
+	return 0;
+}
+
+/* adds a new page from the node's pool to a bucket */
+static int bucket_add_page(struct bucket* b)
+{
+	unsigned long flags;
+	void* page;
+	int err;
 
+	page = page_get(b->node);
 	if (!page)
 		return -ENOMEM;
+
+	DEPOT_LOCK(b, flags);
+	err = bucket_attach_page(b, page);
+	DEPOT_UNLOCK(b, flags);
+
+	if (err < 0)
+		page_put(b->node, page);
+
+	return err;
+}
 	
-	buckets[bucket].pages[buckets[bucket].pages_alloc] = page;
-	buckets[bucket].pages_alloc++;
-	buckets[bucket].page_cur = page;
-	buckets[bucket].page_items_cur = 0;
+/* Work out the item size of every bucket from the geometry, and fill in the 
+   lookup table from sizes to buckets. The sizes grow by class_growth percent 
+   each time (at least UB_CLASS_ALIGN bytes), and the last bucket always holds
+   items of class_max. */
+static int classes_init(void)
+{
+	size_t size = class_min;
+	size_t slot;
+	int bucket = 0;
+
+	while (bucket < UB_MAX_BUCKETS - 1 && size < class_max)
+	{
+		size_t next = CLASS_ALIGN(size * class_growth / 100);
+
+		class_size[bucket++] = size;
+		size = (next > size) ? next : size + UB_CLASS_ALIGN;
+	}
+	class_size[bucket++] = class_max;
+	bucket_count = bucket;
+
+	class_lookup = ALLOCMEM(class_max / UB_CLASS_ALIGN + 1, GFP_KERNEL);
+	if (!class_lookup)
+		return -ENOMEM;
+
+	for (slot = 0, bucket = 0; slot <= class_max / UB_CLASS_ALIGN; slot++)
+	{
+		while (class_size[bucket] < slot * UB_CLASS_ALIGN)
+			bucket++;
+		class_lookup[slot] = bucket;
+	}
 
 	return 0;
 }
-	
-static int buckets_init(void)
+
+static int buckets_init(int node)
 {
 	int bucket;
-	size_t bucket_size = UB_BUCKET_MIN_SIZE;
 
-	for (bucket = 0; bucket < UB_MAX_BUCKETS; bucket++)
+	for (bucket = 0; bucket < bucket_count; bucket++)
 	{
-		buckets[bucket].itemsize = bucket_size;
+		struct bucket* b = BUCKET(node, bucket);
+		size_t bucket_size = class_size[bucket];
+
+		b->itemsize = bucket_size;
 
 		/* the maximum number of items which can be stored in a single page is 
 		   the integer part of the following division */
-		buckets[bucket].items_max = UB_PAGE_SIZE / bucket_size;
+		b->items_max = page_size / bucket_size;
+
+		b->page_items_cur = 0;
+
+		b->free_head = NULL;
+		b->free_count = 0;
+
+		b->lru_head = NULL;
+		b->lru_tail = NULL;
+		b->evictions = 0;
+		b->evictions_prev = 0;
+		b->chained = 0;
+		b->evicting = 0;
+		b->evict_reserve = UB_EVICT_RESERVE_MIN;
+
+		b->id = bucket;
+		b->node = node;
 
-		buckets[bucket].page_items_cur = 0;
+		spin_lock_init(&b->lock);
 		
 		/* pointer to an array of pointers to pages, initially allow 8 pages to
 		   be tracked in this array*/
-		buckets[bucket].pages_space = 8;
-		buckets[bucket].pages_alloc = 0;
-		buckets[bucket].pages = 
-			ALLOCMEM(sizeof(void*) * buckets[bucket].pages_space, GFP_KERNEL);
+		b->pages_space = 8;
+		b->pages_alloc = 0;
+		b->pages = ALLOCMEM_NODE(sizeof(void*) * b->pages_space, GFP_KERNEL, node);
 
-		/* assign a single page to this bucket to begin with to optimise the 
-		   first case */
-		bucket_add_page(bucket);
-
-		bucket_size *= UB_GROWTH_FACTOR;
+		/* pages are only assigned when the first item arrives; with many small
+		   buckets, most of which may never be used, a page each up front would 
+		   tie up a good part of the memory limit */
 	}
 	return 0;
 }
 
-/* get the index of the bucket which should store some data of a given size */
-static int bucket_get_id(size_t len_data)
+/* set up the state for every node which has memory of its own */
+static int nodes_init(void)
 {
-	int bucket;
-	size_t bucket_size = UB_BUCKET_MIN_SIZE;
+	int node;
 
-	for (bucket = 0; bucket < UB_MAX_BUCKETS; bucket++)
+#ifdef __KERNEL__
+	if (numa_policy != UB_NUMA_OFF)
+	{
+		for_each_node_state(node, N_MEMORY)
+		{
+			nodes[node] = ALLOCMEM_NODE(sizeof(struct node_state), 
+				GFP_KERNEL, node);
+			if (!nodes[node])
+				return -ENOMEM;
+			memset(nodes[node], 0, sizeof(struct node_state));
+		}
+	}
+	else
+#endif
 	{
-		if (bucket_size >= len_data)
-			return bucket;
+		nodes[0] = ALLOCMEM(sizeof(struct node_state), GFP_KERNEL);
+		if (!nodes[0])
+			return -ENOMEM;
+		memset(nodes[0], 0, sizeof(struct node_state));
+	}
 
-		bucket_size *= UB_GROWTH_FACTOR;
+	for (node = 0; node < UB_MAX_NODES; node++)
+	{
+		if (!nodes[node])
+			continue;
+		nodes[node]->node = node;
+		nodes[node]->rebalance_starved = -1;
+		mutex_init(&nodes[node]->pool_lock);
+		buckets_init(node);
 	}
-	return -1;
+
+	return 0;
+}
+
+/* get the index of the bucket which should store some data of a given size */
+static inline int bucket_get_id(size_t len_data)
+{
+	if (UNLIKELY(len_data > class_max))
+		return -1;
+
+	return class_lookup[(len_data + UB_CLASS_ALIGN - 1) / UB_CLASS_ALIGN];
 }
 
-/* free all the bucket data, including assigned pages and the pages array */
-static void buckets_free_all(void)
+/* forget whatever is in the magazines -- only for when the pages are going */
+static void magazines_reset(void)
 {
+#ifdef __KERNEL__
+	int cpu;
+#else
+	struct cpu_magazines* m;
 	int bucket;
-	for (bucket = 0; bucket < UB_MAX_BUCKETS; bucket++)
-	{
-		int page;
-		for (page = 0; page < buckets[bucket].pages_alloc; page++)
-		{
-			FREEMEM(buckets[bucket].pages[page]);
-			buckets[bucket].pages[page] = NULL;
-		}
+#endif
 
-		FREEMEM(buckets[bucket].pages);
-		buckets[bucket].pages = NULL;
+	if (!magazines)
+		return;
 
-		buckets[bucket].pages_space = 0;
-		buckets[bucket].pages_alloc = 0;
-		buckets[bucket].page_cur = NULL;
-		buckets[bucket].page_items_cur = 0;
-	}
-	return;
+#ifdef __KERNEL__
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(magazines, cpu), 0, sizeof(struct cpu_magazines));
+#else
+	for (m = magazines; m; m = m->next)
+		for (bucket = 0; bucket < UB_MAX_BUCKETS; bucket++)
+			m->bucket[bucket].count = 0;
+#endif
 }
 
-/* External interface to the bucket allocator, which returns a pointer to a 
-   location into which data may be written provided the size of data written
-   does not exceed the value specified in the function call. (Behaviour undefined
-   if this is not respected, but your data will most likely get lost at best,
-   and the kernel will panic at worst) */
-int ub_buckets_alloc(size_t len_buffer, void** location)
+/* free all the bucket data; the pages themselves go back with the node's 
+   regions */
+static void buckets_free_all(struct node_state* ns)
 {
-	int bucket = bucket_get_id(len_buffer);
+	int bucket;
 
-	if (bucket < 0)
-		return -EFBIG;
-	
-	/* The bucket must have free space, or we must be able to expand it by 
-	   adding another page. Otherwise, the cache is out of space. */
-	if (buckets[bucket].items_max == buckets[bucket].page_items_cur)
+	for (bucket = 0; bucket < bucket_count; bucket++)
 	{
-		int err = bucket_add_page(bucket);
-		if (err < 0)
-			return err;
-	}
-	
-	*location = buckets[bucket].page_cur;
-	buckets[bucket].page_items_cur++;
-	buckets[bucket].page_cur += buckets[bucket].itemsize;
+		struct bucket* b = &ns->buckets[bucket];
 
-	return 0;
+		FREEMEM(b->pages);
+		b->pages = NULL;
+
+		b->pages_space = 0;
+		b->pages_alloc = 0;
+		b->page_cur = NULL;
+		b->page_items_cur = 0;
+		b->free_head = NULL;
+		b->free_count = 0;
+		b->lru_head = NULL;
+		b->lru_tail = NULL;
+	}
+	return;
 }
 
+/* is the chunk at location within the page starting at page? */
+static inline int chunk_in_page(void* location, void* page)
+{
+	return (char*) location >= (char*) page && 
+		(char*) location < (char*) page + page_size;
+}
+
+/* Whether a chunk being given back is on a page the rebalancer is taking from
+   its bucket. Such chunks (of items freed before the page was taken) are 
+   dropped, as the whole page is about to go to another bucket. */
+static inline int chunk_moving(struct bucket* b, void* location)
+{
+	return b->page_moving && chunk_in_page(location, b->page_moving);
+}
+
+/* total number of chunks the bucket could hand out without a new page (give
+   or take whatever is in the magazines) */
+static inline int bucket_free_chunks(struct bucket* b)
+{
+	return b->free_count + (b->items_max - b->page_items_cur);
+}
+
+/* Take up to max chunks out of the depot, from the free list first and then by
+   carving them from the current page. Called with the depot locked. */
+static int depot_take(struct bucket* b, void** chunks, int max)
+{
+	int n = 0;
+
+	while (n < max && b->free_head)
+	{
+		chunks[n++] = b->free_head;
+		b->free_head = *((void**) b->free_head);
+		b->free_count--;
+	}
+
+	while (n < max && b->page_cur && b->page_items_cur < b->items_max)
+	{
+		chunks[n++] = b->page_cur;
+		b->page_items_cur++;
+		b->page_cur = (char*) b->page_cur + b->itemsize;
+	}
+
+	return n;
+}
+
+/* put a chunk back on the free list. Called with the depot locked. */
+static inline void depot_put(struct bucket* b, void* location)
+{
+	if (UNLIKELY(chunk_moving(b, location)))
+		return;
+	*((void**) location) = b->free_head;
+	b->free_head = location;
+	b->free_count++;
+}
+
+/* send chunks back to the depots of the nodes they came from, locking each
+   depot once for each run of chunks from the same node */
+static void chunks_return(int bucket, void** chunks, int n)
+{
+	unsigned long flags;
+
+	while (n > 0)
+	{
+		int node = chunk_node(chunks[n - 1]);
+		struct bucket* b = BUCKET(node, bucket);
+
+		DEPOT_LOCK(b, flags);
+		while (n > 0 && chunk_node(chunks[n - 1]) == node)
+			depot_put(b, chunks[--n]);
+		DEPOT_UNLOCK(b, flags);
+	}
+}
+
+/* get a chunk from this CPU's magazine for the bucket, if it has one */
+static int magazine_pop(int bucket, void** location)
+{
+	unsigned long flags;
+	struct magazine* m = &MAGAZINES_GET(flags)->bucket[bucket];
+	int found = 0;
+
+	if (m->count > 0)
+	{
+		*location = m->chunks[--m->count];
+		found = 1;
+	}
+
+	MAGAZINES_PUT(flags);
+	return found;
+}
+
+/* stock this CPU's magazine for the bucket with a batch of chunks from the 
+   depot, sending back any which don't fit (possible if we changed CPU) */
+static void magazine_fill(int bucket, void** chunks, int n)
+{
+	unsigned long flags;
+	struct magazine* m = &MAGAZINES_GET(flags)->bucket[bucket];
+
+	while (n > 0 && m->count < UB_MAGAZINE_SIZE)
+		m->chunks[m->count++] = chunks[--n];
+
+	MAGAZINES_PUT(flags);
+
+	if (n > 0)
+		chunks_return(bucket, chunks, n);
+}
+
+#ifdef __KERNEL__
+/* runs on each CPU (with interrupts off) to send its magazine for a bucket 
+   back to the depots */
+static void magazine_drain_local(void* info)
+{
+	int bucket = *((int*) info);
+	struct magazine* m = &this_cpu_ptr(magazines)->bucket[bucket];
+
+	chunks_return(bucket, m->chunks, m->count);
+	m->count = 0;
+}
+#endif
+
+/* send every CPU's magazine for the bucket back to the depots */
+static void magazines_drain(int bucket)
+{
+#ifdef __KERNEL__
+	on_each_cpu(magazine_drain_local, &bucket, 1);
+#else
+	struct cpu_magazines* m;
+
+	spin_lock(&magazines_lock);
+	for (m = magazines; m; m = m->next)
+	{
+		spin_lock(&m->lock);
+		chunks_return(bucket, m->bucket[bucket].chunks, 
+			m->bucket[bucket].count);
+		m->bucket[bucket].count = 0;
+		spin_unlock(&m->lock);
+	}
+	spin_unlock(&magazines_lock);
+#endif
+}
+
+static void lru_unlink(struct bucket* b, struct ub_lru_link* link)
+{
+	if (link->prev)
+		link->prev->next = link->next;
+	else
+		b->lru_head = link->next;
+
+	if (link->next)
+		link->next->prev = link->prev;
+	else
+		b->lru_tail = link->prev;
+
+	link->prev = NULL;
+	link->next = NULL;
+	link->bucket = -1;
+}
+
+static void lru_push_head(struct bucket* b, struct ub_lru_link* link)
+{
+	link->bucket = b->id;
+	link->prev = NULL;
+	link->next = b->lru_head;
+
+	if (b->lru_head)
+		b->lru_head->prev = link;
+	else
+		b->lru_tail = link;
+
+	b->lru_head = link;
+}
+
+/* Take up to max of the least recently used items in the bucket off its LRU
+   list, returning how many. */
+static int bucket_take_victims(struct bucket* b, struct ub_lru_link** victims,
+	int max)
+{
+	struct ub_lru_link* victim;
+	unsigned long flags;
+	int tries;
+	int n = 0;
+
+	DEPOT_LOCK(b, flags);
+	if (!b->lru_tail)
+	{
+		/* nothing to evict, most likely because the bucket never got a page;
+		   count the failure all the same so the rebalancer sees it starving */
+		b->evictions++;
+		DEPOT_UNLOCK(b, flags);
+		return 0;
+	}
+
+	while (n < max && b->lru_tail)
+	{
+		/* second chance for anything which has been hit since it was last 
+		   looked at, but don't walk forever if the whole bucket is hot */
+		for (tries = 0; tries < UB_LRU_SEARCH_MAX && b->lru_tail->active; 
+			tries++)
+		{
+			victim = b->lru_tail;
+			victim->active = 0;
+			lru_unlink(b, victim);
+			lru_push_head(b, victim);
+		}
+
+		victim = b->lru_tail;
+		lru_unlink(b, victim);
+		b->evictions++;
+		victims[n++] = victim;
+	}
+	DEPOT_UNLOCK(b, flags);
+
+	return n;
+}
+
+/* Evict up to UB_EVICT_NOW of the least recently used items in the bucket,
+   wait until nothing can be looking at them any more and hand back the chunk
+   of one (the rest go in the magazine). Returns -ENOMEM if there was nothing
+   to evict. The caller mustn't hold any lock, nor be reading under RCU. */
+static int bucket_evict_now(struct bucket* b, void** location)
+{
+	struct ub_lru_link* victims[UB_EVICT_NOW];
+	void* chunks[UB_EVICT_NOW];
+	int n;
+	int i;
+
+	if (!evictor)
+		return -ENOMEM;
+
+	n = bucket_take_victims(b, victims, UB_EVICT_NOW);
+	if (n == 0)
+		return -ENOMEM;
+
+	/* the victims are off the LRU list and so are ours alone; the evictor is 
+	   run without the depot locked as it may need to free things */
+	for (i = 0; i < n; i++)
+		chunks[i] = evictor(victims[i]);
+
+	synchronize_rcu();
+	if (releaser)
+		for (i = 0; i < n; i++)
+			releaser(victims[i]);
+
+	*location = chunks[0];
+	if (n > 1)
+		magazine_fill(b->id, chunks + 1, n - 1);
+
+	return 0;
+}
+
+#ifdef __KERNEL__
+/* Once nothing can be looking at a batch of evicted items any more, let go of
+   whatever else they hold and put their chunks in the depot. Runs from an RCU
+   callback (in softirq context). */
+static void evict_release_rcu(struct rcu_head* head)
+{
+	struct evict_batch* batch = container_of(head, struct evict_batch, rcu);
+	struct bucket* b = batch->b;
+	unsigned long flags;
+	int i;
+
+	if (releaser)
+		for (i = 0; i < batch->n; i++)
+			releaser(batch->victims[i]);
+
+	DEPOT_LOCK(b, flags);
+	for (i = 0; i < batch->n; i++)
+		depot_put(b, batch->chunks[i]);
+	b->evicting -= batch->n;
+	DEPOT_UNLOCK(b, flags);
+
+	FREEMEM(batch);
+}
+
+/* Evict a batch of the least recently used items in the bucket ahead of 
+   need. Their chunks can't be reused until every reader which might have 
+   found them has finished, so they are handed to call_rcu and come back to 
+   the depot from there, without anyone waiting for the grace period. Returns
+   nonzero if anything was evicted. */
+static int bucket_evict(struct bucket* b)
+{
+	struct evict_batch* batch;
+	unsigned long flags;
+	int n;
+	int i;
+
+	if (!evictor)
+		return 0;
+
+	batch = ALLOCMEM(sizeof(struct evict_batch), GFP_KERNEL);
+	if (!batch)
+		return 0;
+
+	n = bucket_take_victims(b, batch->victims, UB_EVICT_BATCH);
+	if (n == 0)
+	{
+		FREEMEM(batch);
+		return 0;
+	}
+
+	DEPOT_LOCK(b, flags);
+	b->evicting += n;
+	DEPOT_UNLOCK(b, flags);
+
+	for (i = 0; i < n; i++)
+		batch->chunks[i] = evictor(batch->victims[i]);
+
+	batch->b = b;
+	batch->n = n;
+	call_rcu(&batch->rcu, evict_release_rcu);
+
+	return 1;
+}
+
+/* Once the bucket is out of pages, evict ahead of need: keep enough chunks 
+   free or on their way back that allocations never find the depot empty for
+   want of a grace period to end. Every time one does, the bucket's reserve 
+   doubles (the rate of SETs has outrun it), up to a small share of the 
+   bucket so that it doesn't keep too much of the cache empty. */
+static void bucket_evict_ahead(struct bucket* b, int ran_dry)
+{
+	unsigned long flags;
+	int batches;
+
+	DEPOT_LOCK(b, flags);
+	if (ran_dry && b->evicting && b->evict_reserve < 
+		b->pages_alloc * b->items_max / UB_EVICT_RESERVE_SHARE)
+		b->evict_reserve *= 2;
+	batches = (b->evict_reserve - b->free_count - b->evicting) / UB_EVICT_BATCH;
+	DEPOT_UNLOCK(b, flags);
+
+	/* the reserve is only topped up a little at a time, spreading the cost of
+	   evicting over the allocations */
+	if (batches > 2)
+		batches = 2;
+
+	while (batches-- > 0)
+		if (!bucket_evict(b))
+			break;
+}
+#endif
+
+/* External interface to the bucket allocator, which returns a pointer to a 
+   location into which data may be written provided the size of data written
+   does not exceed the value specified in the function call. (Behaviour undefined
+   if this is not respected, but your data will most likely get lost at best,
+   and the kernel will panic at worst) */
+int ub_buckets_alloc(size_t len_buffer, void** location)
+{
+	int bucket = bucket_get_id(len_buffer);
+	void* chunks[UB_MAGAZINE_BATCH];
+	unsigned long flags;
+	struct bucket* b;
+	int n;
+
+	if (bucket < 0)
+		return -EFBIG;
+
+	if (magazine_pop(bucket, location))
+		return 0;
+
+	/* The magazine is empty, so refill it with a batch from the depot. The 
+	   depot must have free chunks, or we must be able to expand it by adding
+	   another page. Otherwise, the cache is out of space. */
+	b = BUCKET(node_for_refill(), bucket);
+
+	DEPOT_LOCK(b, flags);
+	n = depot_take(b, chunks, UB_MAGAZINE_BATCH);
+	DEPOT_UNLOCK(b, flags);
+
+	if (n == 0 && bucket_add_page(b) == 0)
+	{
+		DEPOT_LOCK(b, flags);
+		n = depot_take(b, chunks, UB_MAGAZINE_BATCH);
+		DEPOT_UNLOCK(b, flags);
+	}
+
+	/* Out of pages, so make space by throwing out old items. In the kernel 
+	   what they free only comes back after a grace period, so that is done
+	   ahead of need; if nothing was left even so, the reserve grows so that
+	   the next allocation won't find the same, and this one waits. */
+#ifdef __KERNEL__
+	/* the free count is read unlocked, as a hint; evicting ahead checks it */
+	if (n == 0 || (bucket_free_chunks(b) < UB_EVICT_BATCH && 
+		node_out_of_pages(b->node)))
+		bucket_evict_ahead(b, n == 0);
+#endif
+	if (n == 0)
+		return bucket_evict_now(b, location);
+
+	*location = chunks[--n];
+	if (n > 0)
+		magazine_fill(bucket, chunks, n);
+
+	return 0;
+}
+
+/* Returns a chunk previously handed out by ub_buckets_alloc to its bucket so
+   that it can be reused. len_buffer must be the same size that was passed to
+   ub_buckets_alloc when the chunk was obtained, so that the same bucket is 
+   found again. The chunk must not be touched by the caller after this returns. */
+int ub_buckets_free(size_t len_buffer, void* location)
+{
+	int bucket = bucket_get_id(len_buffer);
+	void* chunks[UB_MAGAZINE_BATCH];
+	unsigned long flags;
+	struct magazine* m;
+	int n = 0;
+
+	if (UNLIKELY(bucket < 0 || !location))
+		return -EINVAL;
+
+	m = &MAGAZINES_GET(flags)->bucket[bucket];
+
+	/* checked with the magazine held, so that the rebalancer's drain of the
+	   magazines comes after any chunk of a page it is taking goes in */
+	if (UNLIKELY(READ_ONCE(pages_moving)) &&
+		chunk_moving(BUCKET(chunk_node(location), bucket), location))
+	{
+		MAGAZINES_PUT(flags);
+		return 0;
+	}
+
+	if (m->count == UB_MAGAZINE_SIZE)
+	{
+		/* full, so the oldest half of the magazine goes back to the depots */
+		n = UB_MAGAZINE_BATCH;
+		memcpy(chunks, m->chunks, n * sizeof(void*));
+		memmove(m->chunks, m->chunks + n, (m->count - n) * sizeof(void*));
+		m->count -= n;
+	}
+	m->chunks[m->count++] = location;
+	MAGAZINES_PUT(flags);
+
+	if (n > 0)
+		chunks_return(bucket, chunks, n);
+
+	return 0;
+}
+
+/* the largest chunk which may be asked for */
+size_t ub_buckets_max_item(void)
+{
+	return class_max;
+}
+
+/* The most items a memory limit (in MiB, as for ub_buckets_init) could hold,
+   were they all in the smallest bucket, for sizing the hash table. May be 
+   called before ub_buckets_init, once the geometry is set. */
+size_t ub_buckets_capacity(size_t memlim)
+{
+	return memlim * 1024 * 1024 / class_min;
+}
+
+/* keep track of how many chunks of a bucket are tied up in chains */
+static void chain_account(struct ub_chunk* c, int delta)
+{
+	struct bucket* b = BUCKET(chunk_node(c), 
+		bucket_get_id(sizeof(struct ub_chunk) + c->len));
+	unsigned long flags;
+
+	DEPOT_LOCK(b, flags);
+	b->chained += delta;
+	DEPOT_UNLOCK(b, flags);
+}
+
+/* Allocate a chain of chunks with room for len bytes of data between them. 
+   Every chunk but the last is the largest there is, and the last is only as 
+   big as it needs to be. The data in each chunk follows its header (see 
+   ub_chunk_data), and each header records how much of the data is used. */
+int ub_buckets_alloc_chain(size_t len, struct ub_chunk** chain)
+{
+	size_t room = class_max - sizeof(struct ub_chunk);
+	struct ub_chunk** tail = chain;
+
+	*chain = NULL;
+	while (len > 0)
+	{
+		size_t used = (len < room) ? len : room;
+		struct ub_chunk* c;
+		int err = ub_buckets_alloc(sizeof(struct ub_chunk) + used, (void**) &c);
+
+		if (err)
+		{
+			ub_buckets_free_chain(*chain);
+			*chain = NULL;
+			return err;
+		}
+
+		c->next = NULL;
+		c->len = used;
+		chain_account(c, 1);
+
+		*tail = c;
+		tail = &c->next;
+		len -= used;
+	}
+
+	return 0;
+}
+
+/* give back every chunk of a chain from ub_buckets_alloc_chain */
+void ub_buckets_free_chain(struct ub_chunk* chain)
+{
+	while (chain)
+	{
+		struct ub_chunk* next = chain->next;
+
+		chain_account(chain, -1);
+		ub_buckets_free(sizeof(struct ub_chunk) + chain->len, chain);
+		chain = next;
+	}
+}
+
+/* drop any chunks on the page from the bucket's free list. Called with the 
+   depot locked. */
+static void depot_forget_page(struct bucket* b, void* page)
+{
+	void** chunk = &b->free_head;
+
+	while (*chunk)
+	{
+		if (chunk_in_page(*chunk, page))
+		{
+			*chunk = *((void**) *chunk);
+			b->free_count--;
+		}
+		else
+			chunk = (void**) *chunk;
+	}
+}
+
+/* Take the oldest page away from a bucket, evicting every item which lives on
+   it and dropping its chunks from the free list and the magazines. The 
+   bucket's current page (always the last in the pages array) is never taken.
+   Until the page is handed on, any of its chunks on their way back from 
+   call_rcu are dropped rather than reused (see chunk_moving). Returns the 
+   page, with the evicted items linked through their LRU links in *victims. */
+static void* bucket_take_page(struct bucket* b, struct ub_lru_link** victims)
+{
+	struct ub_lru_link* link;
+	unsigned long flags;
+	void* page;
+	int i;
+
+	*victims = NULL;
+
+	DEPOT_LOCK(b, flags);
+	if (b->pages_alloc < 2)
+	{
+		DEPOT_UNLOCK(b, flags);
+		return NULL;
+	}
+
+	page = b->pages[0];
+	for (i = 1; i < b->pages_alloc; i++)
+		b->pages[i - 1] = b->pages[i];
+	b->pages_alloc--;
+	b->pages[b->pages_alloc] = NULL;
+
+	b->page_moving = page;
+	pages_moving++;
+	depot_forget_page(b, page);
+	DEPOT_UNLOCK(b, flags);
+
+	/* chunks from the page may be sitting in magazines; bring them back and 
+	   forget about them too */
+	magazines_drain(b->id);
+
+	DEPOT_LOCK(b, flags);
+	depot_forget_page(b, page);
+
+	/* gather the live items on the page so they can be evicted once the depot
+	   is unlocked */
+	link = b->lru_head;
+	while (link)
+	{
+		struct ub_lru_link* next = link->next;
+		if (chunk_in_page(link, page))
+		{
+			lru_unlink(b, link);
+			link->next = *victims;
+			*victims = link;
+		}
+		link = next;
+	}
+	DEPOT_UNLOCK(b, flags);
+
+	for (link = *victims; link; link = link->next)
+		evictor(link);
+
+	return page;
+}
+
+/* decide whether a page is to move between buckets on a node, which only ever
+   moves pages between buckets on the same node */
+static int rebalance_node_due(struct node_state* ns)
+{
+	int bucket;
+	struct bucket* starved = NULL;
+	struct bucket* donor = NULL;
+	unsigned long most_evictions = 0;
+
+	/* the bucket which evicted the most since last time is starved, and the 
+	   best donor is one which evicted nothing and has the most free chunks */
+	for (bucket = 0; bucket < bucket_count; bucket++)
+	{
+		struct bucket* b = &ns->buckets[bucket];
+		unsigned long evictions = b->evictions - b->evictions_prev;
+		b->evictions_prev = b->evictions;
+
+		if (evictions > most_evictions)
+		{
+			most_evictions = evictions;
+			starved = b;
+		}
+		else if (evictions == 0 && b->pages_alloc > 1 && !b->chained &&
+			(!donor || bucket_free_chunks(b) > bucket_free_chunks(donor)))
+		{
+			donor = b;
+		}
+	}
+
+	if (!starved || starved->id != ns->rebalance_starved)
+	{
+		ns->rebalance_starved = starved ? starved->id : -1;
+		ns->rebalance_windows = starved ? 1 : 0;
+		return 0;
+	}
+
+	if (++ns->rebalance_windows < UB_REBALANCE_WINDOWS || !donor)
+		return 0;
+
+	ns->move_from = donor;
+	ns->move_to = starved;
+	return 1;
+}
+
+/* Moving pages between buckets as the mix of item sizes changes is done in 
+   three steps, from one thread, the pages due to move being taken from their
+   buckets and then, once a grace period has passed and every RCU callback 
+   then pending has run, given to their new ones:
+
+     if (ub_buckets_rebalance_due())
+     {
+         (hold off every update to the cache)
+         ub_buckets_rebalance_take();
+         (let updates go on)
+         synchronize_rcu();
+         rcu_barrier();
+         ub_buckets_rebalance_give();
+     }
+
+   Only taking the pages needs updates held off, since nothing may be 
+   allocated from or freed to a page while its items are found and evicted,
+   and that is only done when some page is actually to move.
+
+   ub_buckets_rebalance_due() compares the evictions each bucket has suffered
+   since it was last called, and returns the number of pages to move. */
+int ub_buckets_rebalance_due(void)
+{
+	int node;
+	int due = 0;
+
+	if (!evictor)
+		return 0;
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+		if (nodes[node])
+			due += rebalance_node_due(nodes[node]);
+
+	return due;
+}
+
+/* with every update to the cache held off */
+void ub_buckets_rebalance_take(void)
+{
+	int node;
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+	{
+		struct node_state* ns = nodes[node];
+
+		if (!ns || !ns->move_from)
+			continue;
+
+		ns->move_page = bucket_take_page(ns->move_from, &ns->move_victims);
+		if (!ns->move_page)
+			ns->move_from = ns->move_to = NULL;
+	}
+}
+
+/* Once nothing can be looking at the items evicted from the pages and none of
+   their chunks can still come back from call_rcu. Returns the number of pages
+   moved. */
+int ub_buckets_rebalance_give(void)
+{
+	int node;
+	int moved = 0;
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+	{
+		struct node_state* ns = nodes[node];
+		struct bucket* donor;
+		struct bucket* starved;
+		struct ub_lru_link* link;
+		unsigned long flags;
+		void* page;
+		int err;
+
+		if (!ns || !ns->move_page)
+			continue;
+
+		donor = ns->move_from;
+		starved = ns->move_to;
+		page = ns->move_page;
+
+		if (releaser)
+			for (link = ns->move_victims; link; link = link->next)
+				releaser(link);
+
+		DEPOT_LOCK(donor, flags);
+		donor->page_moving = NULL;
+		pages_moving--;
+		DEPOT_UNLOCK(donor, flags);
+
+		ns->move_from = ns->move_to = NULL;
+		ns->move_page = NULL;
+		ns->move_victims = NULL;
+
+		DEPOT_LOCK(starved, flags);
+		err = bucket_attach_page(starved, page);
+		DEPOT_UNLOCK(starved, flags);
+
+		if (err < 0)
+		{
+			/* can't track it in the starved bucket, so give it back (there is
+			   certainly room for the pointer as the donor has just lost a page) */
+			DEPOT_LOCK(donor, flags);
+			bucket_attach_page(donor, page);
+			DEPOT_UNLOCK(donor, flags);
+			continue;
+		}
+
+#ifdef DEBUG
+		PRINTARGS("[Unbuckle] Moved a page from bucket %d to bucket %d on node %d\n", 
+			donor->id, starved->id, starved->node);
+#endif
+
+		ns->rebalance_windows = 0;
+		moved++;
+	}
+
+	return moved;
+}
+
+/* register the functions which evict an item when its bucket is full, and 
+   release what it holds once its chunk can be reused (which may be NULL) */
+void ub_buckets_set_evictor(ub_buckets_evict_fn evict, 
+	ub_buckets_release_fn release)
+{
+	evictor = evict;
+	releaser = release;
+}
+
+/* choose how pages are placed on NUMA machines; must be called before 
+   ub_buckets_init */
+void ub_buckets_set_numa(int policy)
+{
+	numa_policy = policy;
+}
+
+/* choose whether pages are carved from huge pages; must be called before
+   ub_buckets_init */
+void ub_buckets_set_hugepages(int enable)
+{
+	use_hugepages = enable;
+}
+
+/* how much of the memory limit each node should take when preallocating */
+static size_t prealloc_share;
+
+/* fill a node's pool with its share of the memory limit */
+static void prealloc_node(struct node_state* ns)
+{
+	POOL_LOCK(ns);
+	while (ns->memory < prealloc_share)
+		if (pages_grow(ns) < 0)
+			break;
+	POOL_UNLOCK(ns);
+}
+
+#ifdef __KERNEL__
+static atomic_t prealloc_remaining;
+static DECLARE_COMPLETION(prealloc_done);
+
+static int prealloc_run(void* data)
+{
+	prealloc_node(data);
+	if (atomic_dec_and_test(&prealloc_remaining))
+		complete(&prealloc_done);
+	return 0;
+}
+#endif
+
+/* Allocate pages for the whole memory limit now, rather than as items arrive,
+   shared evenly between the nodes. In the kernel each node is filled by a 
+   thread of its own, which also keeps the page zeroing local to the node. 
+   Returns -ENOMEM if the limit could not be reached. */
+int ub_buckets_prealloc(void)
+{
+	int node;
+	int count = 0;
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+		if (nodes[node])
+			count++;
+
+	if (!count)
+		return -ENOMEM;
+	prealloc_share = memory_limit / count;
+
+#ifdef __KERNEL__
+	atomic_set(&prealloc_remaining, count);
+	reinit_completion(&prealloc_done);
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+	{
+		struct task_struct* t;
+
+		if (!nodes[node])
+			continue;
+
+		t = kthread_create_on_node(prealloc_run, nodes[node], node, 
+			"unbucklealloc%d", node);
+		if (IS_ERR(t))
+			prealloc_run(nodes[node]);
+		else
+		{
+			if (numa_policy != UB_NUMA_OFF)
+				set_cpus_allowed_ptr(t, cpumask_of_node(node));
+			wake_up_process(t);
+		}
+	}
+
+	wait_for_completion(&prealloc_done);
+#else
+	for (node = 0; node < UB_MAX_NODES; node++)
+		if (nodes[node])
+			prealloc_node(nodes[node]);
+#endif
+
+	return pages_out_of_memory() ? 0 : -ENOMEM;
+}
+
+/* put a newly stored item at the head of the LRU list of the bucket its chunk
+   came from (len_buffer is as passed to ub_buckets_alloc) */
+void ub_buckets_lru_add(size_t len_buffer, struct ub_lru_link* link)
+{
+	int bucket = bucket_get_id(len_buffer);
+	unsigned long flags;
+	struct bucket* b;
+
+	if (UNLIKELY(bucket < 0))
+		return;
+
+	link->bucket = bucket;
+	link->active = 0;
+
+	b = BUCKET(chunk_node(link), bucket);
+	DEPOT_LOCK(b, flags);
+	lru_push_head(b, link);
+	DEPOT_UNLOCK(b, flags);
+}
+
+/* Take an item off its LRU list, e.g. because it has been deleted. Returns 0
+   if the allocator had already taken it off to evict it, in which case the 
+   evictor now owns the chunk and the caller must not free it. */
+int ub_buckets_lru_del(struct ub_lru_link* link)
+{
+	int bucket = link->bucket;
+	unsigned long flags;
+	struct bucket* b;
+
+	/* already taken off to be evicted */
+	if (bucket < 0)
+		return 0;
+
+	b = BUCKET(chunk_node(link), bucket);
+	DEPOT_LOCK(b, flags);
+	if (link->bucket != bucket)
+	{
+		DEPOT_UNLOCK(b, flags);
+		return 0;
+	}
+	lru_unlink(b, link);
+	DEPOT_UNLOCK(b, flags);
+
+	return 1;
+}
+
+#ifdef NUMA_STATS
+/* count whether an item being read lives on the reader's node */
+void ub_buckets_note_access(void* location)
+{
+#ifdef __KERNEL__
+	if (page_to_nid(virt_to_page(location)) == numa_node_id())
+		this_cpu_inc(accesses_local);
+	else
+		this_cpu_inc(accesses_remote);
+#else
+	__atomic_add_fetch(&accesses_local, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+static void numa_stats_report(void)
+{
+	unsigned long local = 0;
+	unsigned long remote = 0;
+#ifdef __KERNEL__
+	int cpu;
+	for_each_possible_cpu(cpu)
+	{
+		local += per_cpu(accesses_local, cpu);
+		remote += per_cpu(accesses_remote, cpu);
+	}
+#else
+	local = accesses_local;
+#endif
+	PRINTARGS("[Unbuckle] NUMA policy %d: %lu local and %lu remote item "
+		"accesses (%lu%% remote)\n", numa_policy, local, remote,
+		(local + remote) ? remote * 100 / (local + remote) : 0);
+}
+#endif
+
 /* initialises buckets and pages at startup, limiting memory to somewhere 
    approximately around memory_limit */
 int ub_buckets_init(size_t memlim)
@@ -277,15 +1815,115 @@ int ub_buckets_init(size_t memlim)
 	/* note that the module takes this size in MiB for convenience purposes, but
 	   it needs to be in bytes internally within the bucket allocator */
 	memory_limit = memlim * 1024 * 1024;
-	buckets_init();
+
+	if (classes_init())
+		return -ENOMEM;
+
+#ifdef __KERNEL__
+	magazines = alloc_percpu(struct cpu_magazines);
+#else
+	magazines = ALLOCMEM(sizeof(struct cpu_magazines), GFP_KERNEL);
+	if (magazines)
+	{
+		memset(magazines, 0, sizeof(struct cpu_magazines));
+		spin_lock_init(&magazines->lock);
+	}
+#endif
+	if (!magazines)
+		return -ENOMEM;
+
+	return nodes_init();
+}
+
+/* Set the bucket geometry; must be called before ub_buckets_init. Items of 
+   min_size bytes or less go in the first bucket, and each bucket after that 
+   holds items growth percent the size of the last, up to items of max_size. 
+   Pages of page_size are carved up into chunks for the buckets. Returns 
+   -EINVAL (leaving the geometry alone) if the arguments don't make sense. */
+int ub_buckets_set_geometry(size_t min_size, unsigned int growth, 
+	size_t max_size, size_t page_size_new)
+{
+	min_size = CLASS_ALIGN(min_size);
+	max_size = CLASS_ALIGN(max_size);
+
+	/* pages must divide a huge page evenly so they can be carved from one */
+	if (page_size_new < UB_MIN_PAGE_SIZE || page_size_new > UB_HUGE_PAGE_SIZE ||
+		(page_size_new & (page_size_new - 1)))
+		return -EINVAL;
+
+	if (min_size < UB_CLASS_MIN_SIZE || max_size < min_size || 
+		max_size > page_size_new || growth <= 100)
+		return -EINVAL;
+
+	class_min = min_size;
+	class_max = max_size;
+	class_growth = growth;
+	page_size = page_size_new;
 	return 0;
 }
 
+#ifndef __KERNEL__
+/* send the calling thread's magazines back to the depots and free them */
+void ub_buckets_thread_exit(void)
+{
+	struct cpu_magazines* m = thread_magazines;
+	struct cpu_magazines** p;
+	int bucket;
+
+	thread_magazines = NULL;
+	if (!m || m == magazines)
+		return;
+
+	spin_lock(&magazines_lock);
+	for (p = &magazines->next; *p != m; p = &(*p)->next)
+		;
+	*p = m->next;
+	spin_unlock(&magazines_lock);
+
+	for (bucket = 0; bucket < bucket_count; bucket++)
+		chunks_return(bucket, m->bucket[bucket].chunks, 
+			m->bucket[bucket].count);
+	FREEMEM(m);
+}
+#endif
+
 /* deallocate pages and buckets which were allocated throughout the running of the 
    cache -- called on exit and might take a while */
 void ub_buckets_exit(void)
 {
-	buckets_free_all();
-	pages_free_scratch();
+	int node;
+
+#ifdef NUMA_STATS
+	numa_stats_report();
+#endif
+
+	magazines_reset();
+#ifdef __KERNEL__
+	free_percpu(magazines);
+#else
+	while (magazines)
+	{
+		struct cpu_magazines* next = magazines->next;
+
+		FREEMEM(magazines);
+		magazines = next;
+	}
+	thread_magazines = NULL;
+#endif
+	magazines = NULL;
+
+	for (node = 0; node < UB_MAX_NODES; node++)
+	{
+		if (!nodes[node])
+			continue;
+
+		buckets_free_all(nodes[node]);
+		regions_free(nodes[node]);
+		FREEMEM(nodes[node]);
+		nodes[node] = NULL;
+	}
+
+	FREEMEM(class_lookup);
+	class_lookup = NULL;
 	return;
 }
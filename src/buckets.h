@@ -7,8 +7,94 @@
 #include <stdlib.h>
 #endif
 
+/* the default bucket geometry, see ub_buckets_set_geometry */
+#define UB_PAGE_SIZE       1048576 /* bytes carved into chunks at a time         */
+#define UB_MIN_PAGE_SIZE   65536   /* smallest page size which may be configured */
+#define UB_CLASS_MIN_SIZE  64      /* smallest bucket item size allowed          */
+#define UB_CLASS_MAX_SIZE  16384   /* largest item which may be stored           */
+#define UB_CLASS_GROWTH    125     /* percentage growth from one bucket to next  */
+
+/* NUMA placement policies for ub_buckets_set_numa */
+#define UB_NUMA_OFF        0 /* one set of buckets, pages from anywhere       */
+#define UB_NUMA_LOCAL      1 /* buckets per node, allocate on the local node  */
+#define UB_NUMA_INTERLEAVE 2 /* buckets per node, allocate round-robin        */
+
+/* per-bucket LRU linkage, embedded in whatever is stored in a chunk so that
+   the allocator can find the least recently used item in a bucket when it 
+   runs out of memory */
+struct ub_lru_link {
+	struct ub_lru_link* prev;
+	struct ub_lru_link* next;
+	int bucket;          /* which bucket's list this link is on            */
+	volatile int active; /* set on a hit; gives the item a second chance   */
+};
+
+/* one piece of a value which is too large to fit in any bucket; the data 
+   follows the header */
+struct ub_chunk {
+	struct ub_chunk* next;
+	size_t len;          /* bytes of data in this chunk                    */
+};
+
+#define ub_chunk_data(c) ((char*) ((c) + 1))
+
+/* called by the allocator to evict the item owning a link which has been 
+   taken off the tail of an LRU list. The callback must unlink the item from
+   anywhere else it is referenced and return the start of its chunk, which is 
+   then reused for the new allocation. */
+typedef void* (*ub_buckets_evict_fn)(struct ub_lru_link* link);
+
+/* Optionally called once nothing can still be looking at an evicted item (in 
+   the kernel, after an RCU grace period), to free anything else it holds. The
+   link is as passed to the evictor, which must not have touched it. */
+typedef void (*ub_buckets_release_fn)(struct ub_lru_link* link);
+
 int ub_buckets_alloc(size_t len_buffer, void** location);
+int ub_buckets_free(size_t len_buffer, void* location);
 int  ub_buckets_init(size_t memory_limit);
 void ub_buckets_exit(void);
+int  ub_buckets_rebalance_due(void);
+void ub_buckets_rebalance_take(void);
+int  ub_buckets_rebalance_give(void);
+size_t ub_buckets_max_item(void);
+size_t ub_buckets_capacity(size_t memory_limit);
+int  ub_buckets_alloc_chain(size_t len, struct ub_chunk** chain);
+void ub_buckets_free_chain(struct ub_chunk* chain);
+
+void ub_buckets_set_evictor(ub_buckets_evict_fn evict, 
+	ub_buckets_release_fn release);
+int  ub_buckets_set_geometry(size_t min_size, unsigned int growth, 
+	size_t max_size, size_t page_size);
+void ub_buckets_set_numa(int policy);
+void ub_buckets_set_hugepages(int enable);
+int  ub_buckets_prealloc(void);
+void ub_buckets_lru_add(size_t len_buffer, struct ub_lru_link* link);
+int  ub_buckets_lru_del(struct ub_lru_link* link);
+#ifndef __KERNEL__
+/* each userland thread which has allocated or freed must call this before it
+   exits (after ub_epoch_thread_exit, which may free things) */
+void ub_buckets_thread_exit(void);
+#endif
+
+/* Mark an item as recently used. This is deliberately just a flag store rather
+   than a move to the head of the list, so that it may be called on the GET path
+   without holding any lock; the flag is only written if not already set
+   so that hot items don't keep dirtying their cache line. Items are actually
+   moved when the allocator finds them active at the tail of the list. */
+static inline void ub_buckets_lru_touch(struct ub_lru_link* link)
+{
+	if (!link->active)
+		link->active = 1;
+}
+
+/* With NUMA_STATS, item reads are counted as local or remote to the reading 
+   CPU's node and the totals are reported when the allocator exits. */
+#ifdef NUMA_STATS
+void ub_buckets_note_access(void* location);
+#else
+static inline void ub_buckets_note_access(void* location)
+{
+}
+#endif
 
 #endif /* UNBUCKLE_BUCKETS_H */
@@ -1,5 +1,6 @@
 
 #ifdef __KERNEL__
+#include <linux/kernel.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
 #include <linux/socket.h>
@@ -7,10 +8,12 @@
 #include <net/sock.h>
 #include <linux/types.h>
 #include <linux/byteorder/generic.h>
+#include <linux/string.h>
 #include <kernel/net/udpserver_low.h>
 #else
 #include <arpa/inet.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,6 +23,9 @@
 #include <abstract.h>
 #include <core.h>
 #include <entry.h>
+#ifdef STORE_HASHTABLE
+#include <db/hashtable.h>
+#endif
 #include <net/udpserver.h>
 #include <request.h>
 #include <unbuckle.h>
@@ -29,6 +35,41 @@
 #ifdef __KERNEL__
 #endif
 
+/* The request is parsed where it lies, which in the kernel is usually in the
+   packet itself, so the parsers only ever read from it: tokens are told apart
+   by their lengths rather than by writing terminators after them, and numbers
+   are read straight out of the buffer. */
+
+/* whether the len bytes at token are the command cmd, in any case */
+static inline int token_is(const unsigned char* token, size_t len, 
+	const char* cmd)
+{
+	return len == strlen(cmd) && !STRNICMP((const char*) token, cmd, len);
+}
+
+/* Read a decimal number of no more than INT_MAX from the len bytes at 
+   token. Returns nonzero if they aren't one. */
+static int token_to_int(const unsigned char* token, size_t len, int* value)
+{
+	int n = 0;
+	size_t i;
+
+	if (len == 0)
+		return -1;
+
+	for (i = 0; i < len; i++)
+	{
+		if (token[i] < '0' || token[i] > '9')
+			return -1;
+		if (n > (INT_MAX - (token[i] - '0')) / 10)
+			return -1;
+		n = n * 10 + (token[i] - '0');
+	}
+
+	*value = n;
+	return 0;
+}
+
 static int parse_ascii_request(struct request_state* req)
 {
 	int err;
@@ -43,18 +84,19 @@ static int parse_ascii_request(struct request_state* req)
 	{
 		if (req->recvbuf_cur[0] == ' ' || req->recvbuf_cur[0] == '\r')
 		{
-			// Found a token
-			req->recvbuf_cur[0] = '\0';
+			// Found a token, which runs from start up to recvbuf_cur
+			size_t len_token = req->recvbuf_cur - start;
 
 			switch (tokens)
 			{
 			case 0:
-				// This is the command - note strnicmp will corrupt the value of the
-				// "start" pointer by advancing it -- assume it needs resetting.
-				if (!STRNICMP(start, "get", (req->recvbuf_cur - start)))
+				// This is the command
+				if (token_is(start, len_token, "get"))
 					req->cmd = cmd_get;
-				else if (!STRNICMP(start, "set", (req->recvbuf_cur - start)))
+				else if (token_is(start, len_token, "set"))
 					req->cmd = cmd_set;
+				else if (token_is(start, len_token, "delete"))
+					req->cmd = cmd_delete;
 				else
 					return MEMCACHE_UNSUPPORTED_CMD;
 				
@@ -64,7 +106,7 @@ static int parse_ascii_request(struct request_state* req)
 				// This is the key. Just set up a pointer from here and compute the
 				// length of the key by pointer arithmetic to next space delimiter.
 				req->key = start;
-				req->len_key = req->recvbuf_cur - start;
+				req->len_key = len_token;
 
 				break;
 
@@ -77,12 +119,7 @@ static int parse_ascii_request(struct request_state* req)
 			case 4:
 				// This is the number of bytes in the request. It needs to be 
 				// converted from its req->recvbuf_current char representation to an int.
-#ifdef __KERNEL__
-				err = kstrtoint(start, 0, &req->len_data);
-#else
-				req->len_data = strtol(start, NULL, 0);
-				err = 0;
-#endif
+				err = token_to_int(start, len_token, &req->len_data);
 				if (!err)
 				{
 #ifdef DEBUG
@@ -111,7 +148,8 @@ static int parse_ascii_request(struct request_state* req)
 
 	// The memcached protocol requires us to have seen at least 5 tokens. Something
 	// went wrong if this was not the case.
-	if (UNLIKELY( (tokens < 5 && req->cmd == cmd_set) || (tokens < 2 && req->cmd == cmd_get) ))
+	if (UNLIKELY( (tokens < 5 && req->cmd == cmd_set) || 
+		(tokens < 2 && (req->cmd == cmd_get || req->cmd == cmd_delete)) ))
 		return MEMCACHE_PROT_ERROR;
 	
 	// Consume the final \n assuming there is still data to consume
@@ -121,9 +159,14 @@ static int parse_ascii_request(struct request_state* req)
 		req->len_rdata--;
 	}
 
-	// The next position is the starting point of the data value (if it exists)
+	// The next position is the starting point of the data value (if it exists),
+	// which must all have arrived
 	if (req->len_rdata > 0)
+	{
+		if (UNLIKELY(req->cmd == cmd_set && req->len_data > req->len_rdata))
+			return MEMCACHE_PROT_ERROR;
 		req->data = req->recvbuf_cur;
+	}
 	else
 	{
 		// Ensure the data pointer is flushed
@@ -135,8 +178,12 @@ static int parse_ascii_request(struct request_state* req)
 	return MEMCACHE_PROT_OK;
 }
 
+/* The header is read in place and left as it is, in network byte order. */
 static int parse_binary_request(struct request_state* req)
 {
+	const struct memcache_hdr_req* hdr;
+	size_t len_key, len_extras, len_body;
+
 	if (binary != req->prot)
 		return MEMCACHE_PROT_ERROR;
 
@@ -149,20 +196,27 @@ static int parse_binary_request(struct request_state* req)
 	}
 
 	req->bin_hdr_request = (struct memcache_hdr_req*) req->recvbuf_cur;
+	hdr = req->bin_hdr_request;
 
 	// consume header
 	req->recvbuf_cur += MEMCACHED_PKT_HDR_REQ_LEN;
 	req->len_rdata -= MEMCACHED_PKT_HDR_REQ_LEN;
 
 	// deal with byte ordering
-	req->bin_hdr_request->len_key = ntohs(req->bin_hdr_request->len_key);
-	req->bin_hdr_request->len_body = ntohl(req->bin_hdr_request->len_body);
+	len_key = ntohs(hdr->len_key);
+	len_extras = hdr->len_extras;
+	len_body = ntohl(hdr->len_body);
 	// not dealing with byte order of opaque / cas etc. as these unimplemented
 	
 	// don't need to check magic is request as Unbuckle will only
 	// consider an inbound packet binary if magic signals REQ.
 
-	switch (req->bin_hdr_request->opcode)
+	// the extras and the key must have arrived, and be no more than the body
+	if (UNLIKELY(len_extras + len_key > req->len_rdata || 
+		len_extras + len_key > len_body))
+		return MEMCACHE_PROT_ERROR;
+
+	switch (hdr->opcode)
 	{
 	case MEMCACHED_OPCODE_GET:
 		req->cmd = cmd_get;
@@ -170,15 +224,21 @@ static int parse_binary_request(struct request_state* req)
 	case MEMCACHED_OPCODE_SET:
 		req->cmd = cmd_set;
 		break;
+	case MEMCACHED_OPCODE_DELETE:
+		req->cmd = cmd_delete;
+		break;
+	default:
+		// req is reused, so don't fall through to the last one's command
+		return MEMCACHE_UNSUPPORTED_CMD;
 	}
 
 	// flags unimplemented but if some extras were sent, need to
 	// consume them from the recvbuffer as they will be before
 	// the key and the value data
-	if (req->bin_hdr_request->len_extras > 0)
+	if (len_extras > 0)
 	{
-		req->recvbuf_cur += req->bin_hdr_request->len_extras;
-		req->len_rdata -= req->bin_hdr_request->len_extras;
+		req->recvbuf_cur += len_extras;
+		req->len_rdata -= len_extras;
 	}
 	
 	// expiry would be sent as an extra but is unimplemented
@@ -186,12 +246,15 @@ static int parse_binary_request(struct request_state* req)
 	// length of the key and the value data
 	// set up the lengths and the pointers to them
 	req->key = req->recvbuf_cur;
-	req->len_key = req->bin_hdr_request->len_key;
+	req->len_key = len_key;
 	
 	req->recvbuf_cur += req->len_key;
 	req->len_rdata -= req->len_key;
 	
-	req->len_data = MEMCACHED_LEN_VAL(req->bin_hdr_request);
+	req->len_data = len_body - (len_key + len_extras);
+
+	if (UNLIKELY(req->len_data > req->len_rdata))
+		return MEMCACHE_PROT_ERROR;
 
 	if (req->len_rdata > 0 && req->len_data > 0)
 	{
@@ -216,6 +279,9 @@ static int parse_request(struct request_state* req)
 {
 	int err;
 
+	if (UNLIKELY(req->len_rdata == 0))
+		return MEMCACHE_PROT_ERROR;
+
 	// determine whether ASCII or binary protocol data -- the first byte
 	// of the receive buffer should be the appropriate magic if the binary
 	// protocol is in use
@@ -303,16 +369,20 @@ static void request_reset(struct request_state* req)
 	req->udpheaders = (struct memcache_udp_header*) req->sendbuf_cur;
 	req->sendbuf_cur = req->sendbuf + sizeof(struct memcache_udp_header);
 	req->len_sendbuf_cur = sizeof(struct memcache_udp_header);
+#ifndef __KERNEL__
+	req->val_iovcnt = 0;
+#endif
 
 	return;
 }
 
-int process_fastpath(struct request_state* req)
+/* Runs the state machine from wherever the request is up to, until it is done
+   or reaches the state stop_at. */
+static void run_request(struct request_state* req, enum conn_states stop_at)
 {
 	int res;
-	req->state = conn_proc_udp;
 	
-	while (req->state != conn_done)
+	while (req->state != conn_done && req->state != stop_at)
 	{
 		switch (req->state)
 		{
@@ -395,17 +465,49 @@ int process_fastpath(struct request_state* req)
 			break;
 
 		case conn_done:
-			return 0;
+			return;
 			break;
 		case conn_quit:
 			ub_sys_running = 0;
 			break;
 		}
 	};
+}
+
+int process_fastpath(struct request_state* req)
+{
+	if (!process_fastpath_parse(req))
+	{
+#ifdef STORE_HASHTABLE
+		req->key_hash = ub_hashtbl_hash((char*) req->key, req->len_key);
+#endif
+		process_fastpath_finish(req);
+	}
 
 	return 0;
 }	
 
+/* The fast path in two halves, for requests handled in batches: the first 
+   takes a request as far as having parsed it, returning nonzero if it was 
+   dropped on the way, and the second processes it and sends the reply. In
+   between, the caller sets req->key_hash, having hashed the keys of the 
+   whole batch together and started their part of the hash table on its way
+   into the cache. */
+int process_fastpath_parse(struct request_state* req)
+{
+	req->state = conn_proc_udp;
+	run_request(req, conn_proc_cmd);
+
+	return req->state != conn_proc_cmd;
+}
+
+int process_fastpath_finish(struct request_state* req)
+{
+	run_request(req, conn_done);
+
+	return 0;
+}
+
 int process_slowpath(struct request_state* req)
 {
 	/* This is the slow receive and processing path using the socket interface */
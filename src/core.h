@@ -11,6 +11,8 @@ struct request_state;
 int ub_core_run(void);
 int process_request(struct request_state*);
 int process_fastpath(struct request_state* req);
+int process_fastpath_parse(struct request_state* req);
+int process_fastpath_finish(struct request_state* req);
 int process_slowpath(struct request_state* req);
 
 #endif
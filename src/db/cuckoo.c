@@ -0,0 +1,442 @@
+/* A bucketised cuckoo hash table after MemC3 (Fan, Andersen and Kaminsky,
+   NSDI 2013), shared by the kernel and userland builds.
+
+   Each key may live in one of four slots in either of two buckets. The first
+   bucket comes from its hash and the second from the first and a one byte tag
+   of the hash, so an item can be moved to its other bucket without looking at
+   its key. Lookups only compare keys whose tags match.
+
+   An item goes in an empty slot in one of its buckets if there is one, and
+   otherwise a breadth first search finds the shortest chain of items, each of
+   which can move to its other bucket, ending at an empty slot. The chain is
+   then moved along from the empty end, one item at a time. This keeps the
+   table working above 90% full.
+
+   Writers take short locks on the (stripes of the) two buckets an item moves
+   between, and bump those stripes' version counts around every move. Readers
+   take no lock at all: they note the versions of the stripes of a key's two
+   buckets, look in both, and look again if either changed, as an item may 
+   have been moving out of the way. Entries are freed under RCU (epochs in
+   userland), so lookups need only rcu_read_lock(). The table doesn't grow, so
+   it is sized when it is set up for as many items as the store could hold,
+   were every one of them in the smallest bucket. */
+
+#include <abstract.h>
+#include <db/hashtable.h>
+#include <entry.h>
+#include <uberrors.h>
+
+#ifdef __KERNEL__
+#include <kernel/compat.h>
+
+#include <linux/compiler.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/prefetch.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/vmalloc.h>
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <user/sync.h>
+#endif
+
+#define CUCKOO_SLOTS 4
+
+/* the table is kept below this percentage full when every item is in the 
+   smallest bucket, where the searches for room are still short */
+#define CUCKOO_LOAD 90
+
+/* how many buckets a search for somewhere to put an item may look at, and how
+   many times an insertion is retried when others move things meanwhile */
+#define CUCKOO_BFS_NODES 256
+#define CUCKOO_TRIES 8
+
+struct cuckoo_bucket {
+	uint8_t tags[CUCKOO_SLOTS];
+	struct ub_entry* slots[CUCKOO_SLOTS];
+};
+
+static struct cuckoo_bucket* table;
+static unsigned long bucket_mask;
+
+/* Writers' locks and version counts are striped over the buckets. The key
+   locks handed out by ub_hashtbl_lock are separate and always taken first:
+   they stop two requests for the same key interleaving, while the bucket
+   locks stop items moving while they are being changed. */
+#define CUCKOO_LOCK_BITS HASHTABLE_SHARD_BITS
+
+struct cuckoo_stripe {
+	spinlock_t key_lock;
+	spinlock_t lock;
+	seqcount_t seq;
+} ____cacheline_aligned_in_smp;
+
+static struct cuckoo_stripe stripes[1 << CUCKOO_LOCK_BITS];
+
+static inline struct cuckoo_stripe* stripe_of(unsigned long bkt)
+{
+	return &stripes[bkt & ((1 << CUCKOO_LOCK_BITS) - 1)];
+}
+
+/* lock the stripes of two buckets (which may be the same one) in a fixed
+   order */
+static inline void buckets_lock(unsigned long b1, unsigned long b2)
+{
+	struct cuckoo_stripe* s1 = stripe_of(b1);
+	struct cuckoo_stripe* s2 = stripe_of(b2);
+
+	if (s1 > s2)
+		swap(s1, s2);
+	spin_lock(&s1->lock);
+	if (s2 != s1)
+		spin_lock_nested(&s2->lock, SINGLE_DEPTH_NESTING);
+}
+
+static inline void buckets_unlock(unsigned long b1, unsigned long b2)
+{
+	struct cuckoo_stripe* s1 = stripe_of(b1);
+	struct cuckoo_stripe* s2 = stripe_of(b2);
+
+	if (s2 != s1)
+		spin_unlock(&s2->lock);
+	spin_unlock(&s1->lock);
+}
+
+/* zero marks an empty slot, so isn't a tag */
+static inline uint8_t tag_of(uint64_t key_hash)
+{
+	uint8_t tag = key_hash >> 56;
+	return tag ? tag : 1;
+}
+
+/* an item's other bucket, from either one of them (this is its own inverse) */
+static inline unsigned long alt_bucket(unsigned long bkt, uint8_t tag)
+{
+	return (bkt ^ (tag * 0x5bd1e995UL)) & bucket_mask;
+}
+
+static inline struct ub_entry* bucket_find(unsigned long bkt,
+	uint64_t key_hash, char* key, size_t len_key)
+{
+	struct cuckoo_bucket* b = &table[bkt];
+	uint8_t tag = tag_of(key_hash);
+	int i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i++)
+	{
+		struct ub_entry* e;
+
+		if (READ_ONCE(b->tags[i]) != tag)
+			continue;
+
+		e = READ_ONCE(b->slots[i]);
+		if (e && e->key_hash == key_hash && e->len_key == len_key &&
+			!memcmp(key, ub_entry_loc_key(e), len_key))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* with the bucket's stripe locked */
+static inline int bucket_insert(unsigned long bkt, uint8_t tag,
+	struct ub_entry* e)
+{
+	struct cuckoo_bucket* b = &table[bkt];
+	int i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i++)
+	{
+		if (!b->slots[i])
+		{
+			WRITE_ONCE(b->slots[i], e);
+			WRITE_ONCE(b->tags[i], tag);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* with the bucket's stripe locked */
+static inline int bucket_remove(unsigned long bkt, struct ub_entry* e)
+{
+	struct cuckoo_bucket* b = &table[bkt];
+	int i;
+
+	for (i = 0; i < CUCKOO_SLOTS; i++)
+	{
+		if (b->slots[i] == e)
+		{
+			WRITE_ONCE(b->tags[i], 0);
+			WRITE_ONCE(b->slots[i], NULL);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Move the item in a slot of one bucket to an empty slot in its other bucket,
+   if nothing has changed since the search found them. */
+static int slot_move(unsigned long from, int from_slot, unsigned long to,
+	int to_slot)
+{
+	struct cuckoo_bucket* src = &table[from];
+	struct cuckoo_bucket* dst = &table[to];
+	int err = -EAGAIN;
+
+	buckets_lock(from, to);
+
+	if (src->slots[from_slot] && !dst->slots[to_slot] &&
+		alt_bucket(from, src->tags[from_slot]) == to)
+	{
+		struct cuckoo_stripe* s1 = stripe_of(from);
+		struct cuckoo_stripe* s2 = stripe_of(to);
+
+		write_seqcount_begin(&s1->seq);
+		if (s2 != s1)
+			write_seqcount_begin_nested(&s2->seq, SINGLE_DEPTH_NESTING);
+		WRITE_ONCE(dst->slots[to_slot], src->slots[from_slot]);
+		WRITE_ONCE(dst->tags[to_slot], src->tags[from_slot]);
+		WRITE_ONCE(src->tags[from_slot], 0);
+		WRITE_ONCE(src->slots[from_slot], NULL);
+		if (s2 != s1)
+			write_seqcount_end(&s2->seq);
+		write_seqcount_end(&s1->seq);
+		err = 0;
+	}
+
+	buckets_unlock(from, to);
+	return err;
+}
+
+/* a bucket reached by the search, with how it was reached: the item in slot
+   of the parent's bucket would move here */
+struct bfs_node {
+	uint32_t bkt;
+	short parent;
+	uint8_t slot;
+};
+
+/* Search breadth first from an item's two buckets for the nearest empty slot,
+   then move the items on the way to it along one at a time, starting at the
+   empty end, to leave an empty slot in one of the item's buckets. The search
+   takes no locks, and each move checks the search's view of things is still
+   right. Returns 0 if there should now be room, -EAGAIN if things changed
+   underneath and -ENOMEM if nowhere was found. */
+static int make_room(unsigned long b1, unsigned long b2)
+{
+	struct bfs_node queue[CUCKOO_BFS_NODES];
+	int head, tail = 0, n, i;
+
+	queue[tail++] = (struct bfs_node) { .bkt = b1, .parent = -1 };
+	if (b2 != b1)
+		queue[tail++] = (struct bfs_node) { .bkt = b2, .parent = -1 };
+
+	for (head = 0; head < tail; head++)
+	{
+		struct cuckoo_bucket* b = &table[queue[head].bkt];
+
+		for (i = 0; i < CUCKOO_SLOTS; i++)
+			if (!READ_ONCE(b->slots[i]))
+				goto found;
+
+		for (i = 0; i < CUCKOO_SLOTS && tail < CUCKOO_BFS_NODES; i++)
+		{
+			uint8_t tag = READ_ONCE(b->tags[i]);
+
+			if (!tag)
+				continue;
+
+			queue[tail++] = (struct bfs_node) {
+				.bkt = alt_bucket(queue[head].bkt, tag),
+				.parent = head,
+				.slot = i,
+			};
+		}
+	}
+
+	return -ENOMEM;
+
+found:
+	/* slot i of the node at head is empty: fill it from the parent, leaving a
+	   gap there to fill from its parent, and so on up to one of b1 and b2 */
+	for (n = head; queue[n].parent >= 0; n = queue[n].parent)
+	{
+		struct bfs_node* p = &queue[queue[n].parent];
+		int err = slot_move(p->bkt, queue[n].slot, queue[n].bkt, i);
+
+		if (err)
+			return err;
+		i = queue[n].slot;
+	}
+
+	return 0;
+}
+
+/* the key lock of the stripe of the key's first bucket, which like the other
+   engines' locks is picked by the low bits of the hash (see 
+   ub_hashtbl_shard) */
+spinlock_t* ub_hashtbl_lock(char* key, size_t len_key)
+{
+	uint64_t key_hash = ub_hashtbl_hash(key, len_key);
+	spinlock_t* lock = &stripe_of(key_hash & bucket_mask)->key_lock;
+
+	spin_lock(lock);
+	return lock;
+}
+
+int ub_hashtbl_init(size_t max_items)
+{
+	unsigned long nbuckets = 1UL << CUCKOO_LOCK_BITS;
+	size_t size;
+	int i;
+
+	while (nbuckets * CUCKOO_SLOTS * CUCKOO_LOAD / 100 < max_items)
+		nbuckets <<= 1;
+	bucket_mask = nbuckets - 1;
+	size = nbuckets * sizeof(struct cuckoo_bucket);
+
+	for (i = 0; i < (1 << CUCKOO_LOCK_BITS); i++)
+	{
+		spin_lock_init(&stripes[i].key_lock);
+		spin_lock_init(&stripes[i].lock);
+		seqcount_init(&stripes[i].seq);
+	}
+
+#ifdef __KERNEL__
+	table = vzalloc(size);
+#else
+	table = calloc(1, size);
+#endif
+
+	return table ? 0 : -ENOMEM;
+}
+
+void ub_hashtbl_exit(void)
+{
+#ifdef __KERNEL__
+	unsigned long bkt;
+	int i;
+
+	for (bkt = 0; bkt <= bucket_mask; bkt++)
+		for (i = 0; i < CUCKOO_SLOTS; i++)
+			if (table[bkt].slots[i])
+				kfree_skb(table[bkt].slots[i]->skb);
+
+	vfree(table);
+#else
+	free(table);
+#endif
+	table = NULL;
+}
+
+struct ub_entry* ub_hashtbl_find(char* key, size_t len_key)
+{
+	return ub_hashtbl_find_hashed(key, len_key, ub_hashtbl_hash(key, len_key));
+}
+
+struct ub_entry* ub_hashtbl_find_hashed(char* key, size_t len_key, 
+	uint64_t key_hash)
+{
+	uint8_t tag = tag_of(key_hash);
+	unsigned long b1 = key_hash & bucket_mask;
+	unsigned long b2 = alt_bucket(b1, tag);
+	struct cuckoo_stripe* s1 = stripe_of(b1);
+	struct cuckoo_stripe* s2 = stripe_of(b2);
+	struct ub_entry* e;
+	unsigned int v1, v2;
+
+	rcu_read_lock();
+	do
+	{
+		v1 = read_seqcount_begin(&s1->seq);
+		v2 = read_seqcount_begin(&s2->seq);
+		e = bucket_find(b1, key_hash, key, len_key);
+		if (!e)
+			e = bucket_find(b2, key_hash, key, len_key);
+	} while (read_seqcount_retry(&s1->seq, v1) ||
+		read_seqcount_retry(&s2->seq, v2));
+	rcu_read_unlock();
+
+	return e;
+}
+
+/* both of the key's buckets, as a miss reads both (and so does a hit in the
+   second) */
+void ub_hashtbl_prefetch(uint64_t key_hash)
+{
+	unsigned long b1 = key_hash & bucket_mask;
+
+	PREFETCH(&table[b1]);
+	PREFETCH(&table[alt_bucket(b1, tag_of(key_hash))]);
+}
+
+/* Returns -ENOMEM if the table is too full to take the entry. */
+int ub_hashtbl_add(struct ub_entry* e)
+{
+	uint64_t key_hash = e->key_hash;
+	uint8_t tag = tag_of(key_hash);
+	unsigned long b1 = key_hash & bucket_mask;
+	unsigned long b2 = alt_bucket(b1, tag);
+	int tries, done;
+
+	for (tries = 0; tries < CUCKOO_TRIES; tries++)
+	{
+		buckets_lock(b1, b2);
+		done = bucket_insert(b1, tag, e) || bucket_insert(b2, tag, e);
+		buckets_unlock(b1, b2);
+
+		if (done)
+			return 0;
+
+		if (make_room(b1, b2) == -ENOMEM)
+			break;
+	}
+
+	return -ENOMEM;
+}
+
+void ub_hashtbl_del(struct ub_entry* e)
+{
+	uint64_t key_hash = e->key_hash;
+	unsigned long b1 = key_hash & bucket_mask;
+	unsigned long b2 = alt_bucket(b1, tag_of(key_hash));
+
+	buckets_lock(b1, b2);
+	if (!bucket_remove(b1, e))
+		bucket_remove(b2, e);
+	buckets_unlock(b1, b2);
+}
+
+/* the new entry has the same key, so the same tag and buckets, and takes the
+   old one's slot without anything having to move */
+void ub_hashtbl_replace(struct ub_entry* old, struct ub_entry* e)
+{
+	uint64_t key_hash = e->key_hash;
+	unsigned long b1 = key_hash & bucket_mask;
+	unsigned long b2 = alt_bucket(b1, tag_of(key_hash));
+	int i;
+
+	buckets_lock(b1, b2);
+	for (i = 0; i < 2 * CUCKOO_SLOTS; i++)
+	{
+		struct cuckoo_bucket* b = &table[i < CUCKOO_SLOTS ? b1 : b2];
+
+		if (b->slots[i % CUCKOO_SLOTS] == old)
+		{
+			WRITE_ONCE(b->slots[i % CUCKOO_SLOTS], e);
+			break;
+		}
+	}
+	buckets_unlock(b1, b2);
+}
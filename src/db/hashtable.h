@@ -3,20 +3,101 @@
 #define UNBUCKLE_HASHTABLE_H
 
 #ifdef __KERNEL__
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #else
 #include <stdlib.h>
+
+#include <user/sync.h>
 #endif
 
+#include <db/keyhash.h>
 #include <entry.h>
 
-#define HASHTABLE_SIZE_BITS 24
+/* the kernel hash table grows and shrinks between these many list heads */
+#define HASHTABLE_MIN_BITS 16
+#define HASHTABLE_MAX_BITS 32
+
+/* Every engine picks the lock covering a key (its stripe or partition) by
+   the low HASHTABLE_SHARD_BITS bits of the key's hash, so that keys can be
+   split between RX workers with ub_hashtbl_shard without any two workers 
+   taking the same lock. */
+#define HASHTABLE_SHARD_BITS 10
+
+/* the kernel hash table's chains are RCU lists, and the cuckoo table's 
+   readers retry if anything moves underneath them, so both may be searched 
+   with only rcu_read_lock() held */
+#if defined(HASHTABLE_KHASH) || defined(HASHTABLE_CUCKOO)
+#define HASHTABLE_RCU_LOOKUP 1
+#endif
+
+/* The hash table engines place keys by this hash (whichever function
+   ub_keyhash_select picked). Whoever fills in an entry keeps the hash of its
+   key in e->key_hash, so that it is never worked out again once the entry is
+   in the table (to move it, say) and can rule out most other keys before 
+   their bytes are compared. */
+static inline uint64_t ub_hashtbl_hash(char* key, size_t len_key)
+{
+	return ub_keyhash(key, len_key);
+}
+static inline void ub_hashtbl_hash_many(const char* const* keys, 
+	const size_t* lens, uint64_t* hashes, int n)
+{
+	ub_keyhash_many(keys, lens, hashes, n);
+}
 
-int ub_hashtbl_init(void);
+/* Which of nshards a key belongs to. Each is given a contiguous run of the
+   locks, which (as the locks are picked by the low bits of the hash, as are 
+   the heads or groups of the tables) keeps what a shard writes in the table
+   off the cache lines of other shards' keys as far as possible. */
+static inline unsigned int ub_hashtbl_shard(uint64_t key_hash, 
+	unsigned int nshards)
+{
+	return ((key_hash & ((1 << HASHTABLE_SHARD_BITS) - 1)) * nshards) >>
+		HASHTABLE_SHARD_BITS;
+}
+
+/* max_items is the most the store could ever hold (see ub_buckets_capacity);
+   the cuckoo table, which can't grow, is sized for it, and the others start
+   small and grow as they need to */
+int ub_hashtbl_init(size_t max_items);
 void ub_hashtbl_exit(void);
 struct ub_entry* ub_hashtbl_find(char* key, size_t len_key);
+/* as ub_hashtbl_find, for a key whose hash is already known */
+struct ub_entry* ub_hashtbl_find_hashed(char* key, size_t len_key, 
+	uint64_t key_hash);
+/* start the cache lines a lookup of a key with this hash would read on their 
+   way in, so that a lookup a little later doesn't wait on memory. Nothing is 
+   locked, and the table may change in the meantime, so this is only ever a
+   hint. */
+void ub_hashtbl_prefetch(uint64_t key_hash);
 
 int ub_hashtbl_add(struct ub_entry*);
 void ub_hashtbl_del(struct ub_entry*);
+/* Make room for a key about to be added, before its lock is taken: the 
+   Swiss table grows its partitions here, so that the new groups can be 
+   allocated without the lock held (in the kernel, by sleeping if need be). 
+   The other engines have nothing to do. */
+#ifdef HASHTABLE_SWISS
+void ub_hashtbl_reserve(uint64_t key_hash);
+#else
+static inline void ub_hashtbl_reserve(uint64_t key_hash)
+{
+}
+#endif
+/* put e in the place of old, which is in the table under the same key, so 
+   that a lookup finds one or the other; this needs no room, so can't fail */
+void ub_hashtbl_replace(struct ub_entry* old, struct ub_entry* e);
+
+/* Lock (and return) the lock covering the part of the table a key hashes to.
+   This must be held around adding or deleting a key, and around finding one 
+   and using what is found unless HASHTABLE_RCU_LOOKUP is defined, in which 
+   case rcu_read_lock() is enough for that. No more than one may be held at a 
+   time. (In userland, rcu_read_lock() is an epoch; see user/sync.h.) */
+spinlock_t* ub_hashtbl_lock(char* key, size_t len_key);
+static inline void ub_hashtbl_unlock(spinlock_t* lock)
+{
+	spin_unlock(lock);
+}
 
 #endif /* UNBUCKLE_HASHTABLE_H */ 
@@ -0,0 +1,225 @@
+/* Key hash functions. Keys are mostly 10 to 40 bytes, for which SpookyHash's
+   set up costs more than the hashing, so there are two others built for short
+   inputs: one on the CRC32C instruction which x86 has had since SSE4.2 (and
+   which works on general purpose registers, so needs no kernel_fpu_begin),
+   and a multiply and fold hash in the style of the short input paths of XXH3
+   and wyhash for anything else. */
+
+#include <db/keyhash.h>
+#include <db/spooky/spooky_hash.h>
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#ifdef __x86_64__
+#include <asm/cpufeature.h>
+#endif
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+int ub_keyhash_fn = UB_HASH_SPOOKY;
+
+#define FOLD_P0 0xa0761d6478bd642fULL
+#define FOLD_P1 0xe7037ed1a0b428dbULL
+#define FOLD_P2 0x8ebc6af09c88c6e3ULL
+
+static inline uint64_t load64(const char* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t load32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* multiply to 128 bits and fold the halves together */
+static inline uint64_t mulfold(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = (unsigned __int128) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t r = a * b;
+	return r ^ (r >> 29) ^ ((a ^ b) >> 32) * FOLD_P2;
+#endif
+}
+
+/* MurmurHash3's finaliser, to spread the CRC lanes over all 64 bits */
+static inline uint64_t fmix64(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+uint64_t ub_keyhash_spooky(const char* key, size_t len_key)
+{
+	return spooky_Hash64(key, len_key, UB_HASH_SEED);
+}
+
+uint64_t ub_keyhash_fold(const char* key, size_t len_key)
+{
+	uint64_t seed = UB_HASH_SEED ^ (len_key * FOLD_P0);
+	uint64_t a, b;
+
+	if (len_key <= 16)
+	{
+		if (len_key >= 4)
+		{
+			/* two overlapping pairs of 32 bit words cover 4 to 16 bytes */
+			size_t mid = (len_key >> 3) << 2;
+
+			a = (load32(key) << 32) | load32(key + mid);
+			b = (load32(key + len_key - 4) << 32) |
+				load32(key + len_key - 4 - mid);
+		}
+		else if (len_key > 0)
+		{
+			a = ((uint64_t) (unsigned char) key[0] << 16) |
+				((uint64_t) (unsigned char) key[len_key >> 1] << 8) |
+				(unsigned char) key[len_key - 1];
+			b = 0;
+		}
+		else
+			a = b = 0;
+	}
+	else
+	{
+		const char* p = key;
+		size_t left = len_key;
+
+		while (left > 16)
+		{
+			seed = mulfold(load64(p) ^ FOLD_P1, load64(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+
+		/* the last 16 bytes, which may overlap ones already done */
+		a = load64(p + left - 16);
+		b = load64(p + left - 8);
+	}
+
+	return mulfold(FOLD_P1 ^ len_key, mulfold(a ^ FOLD_P1, b ^ seed));
+}
+
+#if defined(__x86_64__)
+static inline uint64_t crc32c_u64(uint64_t crc, uint64_t v)
+{
+	asm("crc32q %1, %0" : "+r" (crc) : "rm" (v));
+	return crc;
+}
+
+/* CRC32C only has 32 bits of state, so alternate words go to two lanes with
+   different seeds, which are put together and mixed at the end. The tail is
+   read with overlapping loads, as in fold, rather than a byte at a time. */
+uint64_t ub_keyhash_crc32c(const char* key, size_t len_key)
+{
+	uint64_t lo = (uint32_t) UB_HASH_SEED;
+	uint64_t hi = UB_HASH_SEED >> 32;
+	size_t i = 0;
+
+	if (len_key >= 8)
+	{
+		for (; i + 16 < len_key; i += 16)
+		{
+			lo = crc32c_u64(lo, load64(key + i));
+			hi = crc32c_u64(hi, load64(key + i + 8));
+		}
+
+		/* 1 to 16 bytes are left */
+		if (len_key - i > 8)
+			lo = crc32c_u64(lo, load64(key + i));
+		hi = crc32c_u64(hi, load64(key + len_key - 8));
+	}
+	else if (len_key >= 4)
+		hi = crc32c_u64(hi, (load32(key) << 32) | load32(key + len_key - 4));
+	else if (len_key > 0)
+		hi = crc32c_u64(hi, ((uint64_t) (unsigned char) key[0] << 16) |
+			((uint64_t) (unsigned char) key[len_key >> 1] << 8) |
+			(unsigned char) key[len_key - 1]);
+
+	return fmix64(((hi << 32) | lo) ^ len_key);
+}
+#else
+/* never picked, as ub_keyhash_supported says no */
+uint64_t ub_keyhash_crc32c(const char* key, size_t len_key)
+{
+	return ub_keyhash_fold(key, len_key);
+}
+#endif
+
+/* CRC32C and fold have no SIMD form worth having for keys this short (there
+   is no vector crc32 or 64x64->128 bit multiply), so only SpookyHash is 
+   done four at a time */
+void ub_keyhash_many(const char* const* keys, const size_t* lens, 
+	uint64_t* hashes, int n)
+{
+	int i = 0;
+
+	if (ub_keyhash_fn == UB_HASH_SPOOKY && spooky_Hash64_x4_supported())
+		for (; i + 4 <= n; i += 4)
+			spooky_Hash64_x4((const void* const*) keys + i, lens + i,
+				UB_HASH_SEED, hashes + i);
+
+	for (; i < n; i++)
+		hashes[i] = ub_keyhash(keys[i], lens[i]);
+}
+
+int ub_keyhash_supported(int which)
+{
+	switch (which)
+	{
+	case UB_HASH_SPOOKY:
+	case UB_HASH_FOLD:
+		return 1;
+	case UB_HASH_CRC32C:
+#if defined(__x86_64__) && defined(__KERNEL__)
+		return boot_cpu_has(X86_FEATURE_XMM4_2);
+#elif defined(__x86_64__)
+		return __builtin_cpu_supports("sse4.2");
+#else
+		return 0;
+#endif
+	default:
+		return 0;
+	}
+}
+
+const char* ub_keyhash_name(int which)
+{
+	switch (which)
+	{
+	case UB_HASH_SPOOKY:
+		return "spooky";
+	case UB_HASH_CRC32C:
+		return "crc32c";
+	case UB_HASH_FOLD:
+		return "fold";
+	default:
+		return "unknown";
+	}
+}
+
+int ub_keyhash_select(int which)
+{
+	if (which == UB_HASH_AUTO)
+		which = ub_keyhash_supported(UB_HASH_CRC32C) ?
+			UB_HASH_CRC32C : UB_HASH_FOLD;
+
+	if (!ub_keyhash_supported(which))
+		return -EINVAL;
+
+	ub_keyhash_fn = which;
+	return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef UNBUCKLE_KEYHASH_H
+#define UNBUCKLE_KEYHASH_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+/* Hash functions for keys, one of which is picked when starting up (before
+   anything is put in the hash table) and used by every hash table engine. */
+#define UB_HASH_AUTO   0 /* CRC32C if the CPU has it, otherwise fold          */
+#define UB_HASH_SPOOKY 1 /* Bob Jenkins' SpookyHash, best for long keys       */
+#define UB_HASH_CRC32C 2 /* two lanes of the SSE4.2 crc32 instruction, mixed  */
+#define UB_HASH_FOLD   3 /* 64x64->128 bit multiply and fold, as XXH3/wyhash  */
+
+#define UB_HASH_SEED 0xDEADBEEFFEEDCAFELL
+
+uint64_t ub_keyhash_spooky(const char* key, size_t len_key);
+uint64_t ub_keyhash_crc32c(const char* key, size_t len_key);
+uint64_t ub_keyhash_fold(const char* key, size_t len_key);
+
+/* pick the hash function, returning -EINVAL if the CPU can't do it (in which
+   case the one in use stays as it was) */
+int ub_keyhash_select(int which);
+int ub_keyhash_supported(int which);
+const char* ub_keyhash_name(int which);
+
+/* hash n keys at once with the function in use, giving the same hashes as n
+   calls to ub_keyhash but faster where the function can hash several keys
+   side by side (SpookyHash with AVX2) */
+void ub_keyhash_many(const char* const* keys, const size_t* lens, 
+	uint64_t* hashes, int n);
+
+/* which one is in use: a switch on this is cheaper than an indirect call */
+extern int ub_keyhash_fn;
+
+static inline uint64_t ub_keyhash(const char* key, size_t len_key)
+{
+	switch (ub_keyhash_fn)
+	{
+	case UB_HASH_CRC32C:
+		return ub_keyhash_crc32c(key, len_key);
+	case UB_HASH_FOLD:
+		return ub_keyhash_fold(key, len_key);
+	default:
+		return ub_keyhash_spooky(key, len_key);
+	}
+}
+
+#endif /* UNBUCKLE_KEYHASH_H */
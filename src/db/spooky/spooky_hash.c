@@ -5,7 +5,11 @@
  *      Author: mgrosvenor
  */
 #include <db/spooky/spooky_hash.h>
+#ifdef __KERNEL__
 #include <linux/string.h>
+#else
+#include <string.h>
+#endif
 
 //
 // left rotate a 64-bit value by k bytes
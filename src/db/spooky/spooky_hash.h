@@ -40,7 +40,12 @@
 // slower than MD5.
 //
 
+#ifdef __KERNEL__
 #include <linux/types.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
 
 #define INLINE inline
 typedef  uint64_t  uint64;
@@ -76,6 +81,14 @@ void spooky_Hash128( const void *message, size_t length, uint64 *hash1, uint64 *
 uint64 spooky_Hash64( const void *message, size_t length, uint64 seed);
 uint32 spooky_Hash32( const void *message,  size_t length,  uint32 seed);
 
+//
+// Hash64_x4: spooky_Hash64 of four messages at once (see spooky_hash_x4.c),
+// with AVX2 if Hash64_x4_supported says the CPU has it
+//
+void spooky_Hash64_x4(const void* const message[4], const size_t length[4],
+	uint64 seed, uint64 hash[4]);
+int spooky_Hash64_x4_supported(void);
+
 //
 // Init: initialize the context of a SpookyHash
 //
@@ -0,0 +1,210 @@
+/* spooky_Hash64 of four messages at once, giving exactly what four calls to
+   spooky_Hash64 would.
+
+   Anything under sc_bufSize (192) bytes goes through SpookyHash's short hash,
+   whose state is four 64 bit words updated only by adds, xors and rotates,
+   so four messages can be hashed side by side, one in each 64 bit lane of an
+   AVX2 register. Messages of different lengths take different numbers of
+   32 byte blocks, so each block is mixed into every lane and then kept only
+   in the lanes whose message is that long (the others are fed zeroes, and
+   their state is put back as it was). What is left after the whole blocks is
+   read with masked loads and zero padded, which adds the same to the state 
+   as the short hash's byte by byte tail does, without a branch on each 
+   message's length.
+
+   Userland picks this when the CPU has AVX2. The kernel could only use it
+   between kernel_fpu_begin() and kernel_fpu_end(), which for one batch of
+   keys would cost more than it saves, so there (and for any message too long
+   for the short hash) the messages are hashed one after another. */
+
+#include <db/spooky/spooky_hash.h>
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#if defined(__x86_64__) && !defined(__KERNEL__)
+#define SPOOKY_X4_AVX2 1
+#include <immintrin.h>
+#endif
+
+#ifdef SPOOKY_X4_AVX2
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define ROT(x, k) \
+	_mm256_or_si256(_mm256_slli_epi64(x, k), _mm256_srli_epi64(x, 64 - (k)))
+
+/* one step of spooky_ShortMix and of spooky_ShortEnd respectively */
+#define MIX(x, k, y, z) do {                                                 \
+	x = ROT(x, k); x = _mm256_add_epi64(x, y); z = _mm256_xor_si256(z, x);   \
+} while (0)
+#define END(x, y, k) do {                                                    \
+	y = _mm256_xor_si256(y, x); x = ROT(x, k); y = _mm256_add_epi64(y, x);   \
+} while (0)
+
+static AVX2 inline void short_mix_x4(__m256i* h0, __m256i* h1, __m256i* h2,
+	__m256i* h3)
+{
+	__m256i a = *h0, b = *h1, c = *h2, d = *h3;
+
+	MIX(c, 50, d, a); MIX(d, 52, a, b); MIX(a, 30, b, c); MIX(b, 41, c, d);
+	MIX(c, 54, d, a); MIX(d, 48, a, b); MIX(a, 38, b, c); MIX(b, 37, c, d);
+	MIX(c, 62, d, a); MIX(d, 34, a, b); MIX(a, 5, b, c);  MIX(b, 36, c, d);
+
+	*h0 = a; *h1 = b; *h2 = c; *h3 = d;
+}
+
+static AVX2 inline void short_end_x4(__m256i* h0, __m256i* h1, __m256i* h2,
+	__m256i* h3)
+{
+	__m256i a = *h0, b = *h1, c = *h2, d = *h3;
+
+	END(c, d, 15); END(d, a, 52); END(a, b, 26); END(b, c, 51);
+	END(c, d, 28); END(d, a, 9);  END(a, b, 47); END(b, c, 54);
+	END(c, d, 32); END(d, a, 25); END(a, b, 63);
+
+	*h0 = a; *h1 = b; *h2 = c; *h3 = d;
+}
+
+/* keep the new state only in the lanes set in mask */
+#define KEEP(old, new, mask) (old) = _mm256_blendv_epi8(old, new, mask)
+
+/* Windows onto these give masks for the first n dwords and first n bytes of
+   32: a masked load reads only the dwords it is asked for (so can't fault 
+   past the end of a message), and the bytes past the end of the message in
+   the last dword it reads are cleared afterwards. */
+static const int dword_window[16] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+static const uint8 byte_window[64] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/* the n (under 32) bytes at p, zero padded to 32 */
+static AVX2 inline __m256i load_partial(const uint8* p, size_t n)
+{
+	__m256i dwords = _mm256_loadu_si256((const __m256i*) 
+		(dword_window + 8 - (n + 3) / 4));
+	__m256i bytes = _mm256_loadu_si256((const __m256i*) 
+		(byte_window + 32 - n));
+
+	return _mm256_and_si256(bytes,
+		_mm256_maskload_epi32((const int*) p, dwords));
+}
+
+/* the four registers' 64 bit words, transposed: word i of all four lanes
+   ends up in w[i] */
+static AVX2 inline void transpose(__m256i r[4], __m256i w[4])
+{
+	__m256i t0 = _mm256_unpacklo_epi64(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi64(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi64(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi64(r[2], r[3]);
+
+	w[0] = _mm256_permute2x128_si256(t0, t2, 0x20);
+	w[1] = _mm256_permute2x128_si256(t1, t3, 0x20);
+	w[2] = _mm256_permute2x128_si256(t0, t2, 0x31);
+	w[3] = _mm256_permute2x128_si256(t1, t3, 0x31);
+}
+
+static AVX2 void short_x4(const uint8* const msg[4], const size_t len[4],
+	uint64 seed, uint64 hash[4])
+{
+	__m256i a = _mm256_set1_epi64x(seed);
+	__m256i b = a;
+	__m256i c = _mm256_set1_epi64x(sc_const);
+	__m256i d = c;
+	__m256i lens = _mm256_set_epi64x(len[3], len[2], len[1], len[0]);
+	__m256i blocks = _mm256_srli_epi64(lens, 5);
+	__m256i left = _mm256_and_si256(lens, _mm256_set1_epi64x(31));
+	__m256i halves, empty, r[4], w[4], na, nb, nc, nd;
+	size_t k, most = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		if (len[i] / 32 > most)
+			most = len[i] / 32;
+
+	for (k = 0; k < most; k++)
+	{
+		__m256i active = _mm256_cmpgt_epi64(blocks, _mm256_set1_epi64x(k));
+
+		/* a block from each message (zeroes for those without one) */
+		for (i = 0; i < 4; i++)
+			r[i] = _mm256_loadu_si256((const __m256i*)
+				(k < len[i] / 32 ? msg[i] + k * 32 : byte_window + 32));
+		transpose(r, w);
+
+		na = a; nb = b;
+		nc = _mm256_add_epi64(c, w[0]);
+		nd = _mm256_add_epi64(d, w[1]);
+		short_mix_x4(&na, &nb, &nc, &nd);
+		na = _mm256_add_epi64(na, w[2]);
+		nb = _mm256_add_epi64(nb, w[3]);
+
+		KEEP(a, na, active); KEEP(b, nb, active);
+		KEEP(c, nc, active); KEEP(d, nd, active);
+	}
+
+	/* What is left of each message after its whole blocks: 16 bytes or more
+	   of it are mixed in as half a block, and the rest is added in at the 
+	   end with the length (or a constant if there is nothing left). */
+	for (i = 0; i < 4; i++)
+		r[i] = load_partial(msg[i] + (len[i] & ~(size_t) 31), len[i] & 31);
+	transpose(r, w);
+
+	halves = _mm256_cmpgt_epi64(left, _mm256_set1_epi64x(15));
+	na = a; nb = b;
+	nc = _mm256_add_epi64(c, w[0]);
+	nd = _mm256_add_epi64(d, w[1]);
+	short_mix_x4(&na, &nb, &nc, &nd);
+	KEEP(a, na, halves); KEEP(b, nb, halves);
+	KEEP(c, nc, halves); KEEP(d, nd, halves);
+
+	KEEP(w[0], w[2], halves);
+	KEEP(w[1], w[3], halves);
+	empty = _mm256_cmpeq_epi64(_mm256_setzero_si256(),
+		_mm256_and_si256(left, _mm256_set1_epi64x(15)));
+	KEEP(w[0], _mm256_set1_epi64x(sc_const), empty);
+	KEEP(w[1], _mm256_set1_epi64x(sc_const), empty);
+
+	c = _mm256_add_epi64(c, w[0]);
+	d = _mm256_add_epi64(d, _mm256_add_epi64(w[1], _mm256_slli_epi64(lens, 56)));
+	short_end_x4(&a, &b, &c, &d);
+
+	_mm256_storeu_si256((__m256i*) hash, a);
+}
+
+#endif /* SPOOKY_X4_AVX2 */
+
+int spooky_Hash64_x4_supported(void)
+{
+#ifdef SPOOKY_X4_AVX2
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+
+void spooky_Hash64_x4(const void* const message[4], const size_t length[4],
+	uint64 seed, uint64 hash[4])
+{
+	int i;
+
+#ifdef SPOOKY_X4_AVX2
+	if (length[0] < sc_bufSize && length[1] < sc_bufSize &&
+		length[2] < sc_bufSize && length[3] < sc_bufSize &&
+		spooky_Hash64_x4_supported())
+	{
+		short_x4((const uint8* const*) message, length, seed, hash);
+		return;
+	}
+#endif
+
+	for (i = 0; i < 4; i++)
+		hash[i] = spooky_Hash64(message[i], length[i], seed);
+}
@@ -0,0 +1,430 @@
+/* An open addressing hash table in the style of Google's Swiss tables and
+   Facebook's F14, shared by the kernel and userland builds.
+
+   Items live in groups which are each exactly one cache line: seven one byte
+   tags, a count of items which overflowed past the group, and seven pointers
+   to entries. A tag is the top seven bits of the key's hash with the high bit
+   set, and zero marks an empty slot. A lookup compares its tag against all
+   seven at once as a single 64 bit word, and only looks at the entries (and
+   their keys) whose tags match, so a typical hit touches the group's line and
+   then the entry. Probing for a key goes on to the next group only while the
+   overflow count says something went past, so there are no tombstones and a
+   miss usually stops at the first group.
+
+   Groups of seven fit a 64 bit word exactly, which does the tag matching with
+   a few ALU operations and needs no SSE/AVX registers (which the kernel may
+   only use between kernel_fpu_begin() and kernel_fpu_end()).
+
+   The table is split into independent partitions, each with its own lock on
+   its own cache line, picked by the low bits of the hash. Each partition 
+   grows on its own, so no one ever waits for more than a small fraction of 
+   the table to be moved: the writer about to fill it allocates the new 
+   groups before taking its lock (see ub_hashtbl_reserve), and only the 
+   rehash into them is done under the lock. */
+
+#include <abstract.h>
+#include <db/hashtable.h>
+#include <entry.h>
+#include <uberrors.h>
+
+#ifdef __KERNEL__
+#include <kernel/compat.h>
+
+#include <linux/errno.h>
+#include <linux/prefetch.h>
+#include <linux/mm.h>
+#include <linux/skbuff.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/vmalloc.h>
+#else
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <user/sync.h>
+#endif
+
+#define SWISS_GROUP_SLOTS 7
+#define SWISS_OVERFLOW_MAX 255 /* sticks here rather than ever being counted down */
+
+/* groups per partition to start with */
+#define SWISS_MIN_GROUPS 8
+
+#define SWISS_PART_BITS HASHTABLE_SHARD_BITS
+
+/* tags[SWISS_GROUP_SLOTS] doubles as the overflow count, so that the whole
+   control word can be read at once */
+struct swiss_group {
+	uint8_t tags[SWISS_GROUP_SLOTS + 1];
+	struct ub_entry* slots[SWISS_GROUP_SLOTS];
+} __attribute__((aligned(64)));
+
+struct swiss_part {
+	struct swiss_group* groups;
+	unsigned int mask; /* number of groups - 1 */
+	unsigned int items;
+	spinlock_t lock;
+} ____cacheline_aligned_in_smp;
+
+static struct swiss_part parts[1 << SWISS_PART_BITS];
+
+#define SWAR_ONES  0x0101010101010101ULL
+#define SWAR_HIGHS 0x8080808080808080ULL
+/* the high bit of every byte which is a tag rather than the overflow count */
+#define SWAR_SLOTS (SWAR_HIGHS & ~(0xFFULL << (8 * SWISS_GROUP_SLOTS)))
+
+static inline struct swiss_part* part_of(uint64_t key_hash)
+{
+	return &parts[key_hash & ((1 << SWISS_PART_BITS) - 1)];
+}
+
+static inline uint8_t tag_of(uint64_t key_hash)
+{
+	return 0x80 | (key_hash >> 57);
+}
+
+static inline unsigned int home_of(struct swiss_part* p, uint64_t key_hash)
+{
+	return (key_hash >> SWISS_PART_BITS) & p->mask;
+}
+
+/* groups are probed at triangular number offsets from the home group, which
+   visits every one of a power of two of them */
+static inline unsigned int probe_next(struct swiss_part* p, unsigned int g,
+	unsigned int probe)
+{
+	return (g + probe + 1) & p->mask;
+}
+
+static inline uint64_t group_ctrl(struct swiss_group* grp)
+{
+	uint64_t ctrl;
+	memcpy(&ctrl, grp->tags, sizeof(ctrl));
+	return ctrl;
+}
+
+/* The high bit of each tag byte equal to tag (may give false positives in the
+   bytes after a true one, which the key comparison weeds out). */
+static inline uint64_t group_match(uint64_t ctrl, uint8_t tag)
+{
+	uint64_t x = ctrl ^ (SWAR_ONES * tag);
+	return (x - SWAR_ONES) & ~x & SWAR_SLOTS;
+}
+
+/* the high bit of each empty slot's tag byte */
+static inline uint64_t group_empty(uint64_t ctrl)
+{
+	return ~ctrl & SWAR_SLOTS;
+}
+
+static inline unsigned int match_slot(uint64_t match)
+{
+	return __builtin_ctzll(match) / 8;
+}
+
+static inline uint8_t group_overflow(struct swiss_group* grp)
+{
+	return grp->tags[SWISS_GROUP_SLOTS];
+}
+
+/* Groups are never allocated with a partition's lock held, so in the kernel
+   may sleep. kmalloc aligns blocks of a power of two size to their size, so
+   groups line up with cache lines; if memory is too fragmented for a large
+   partition's groups to be found in one piece, they come from vmalloc (which
+   is page aligned) instead, as the kernel hash table's segments do. */
+static struct swiss_group* groups_alloc(unsigned int ngroups)
+{
+	size_t size = ngroups * sizeof(struct swiss_group);
+	struct swiss_group* groups;
+
+#ifdef __KERNEL__
+	groups = kmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	if (!groups)
+		groups = vmalloc(size);
+#else
+	groups = ALLOCMEM(size, GFP_KERNEL);
+#endif
+	if (groups)
+		memset(groups, 0, size);
+	return groups;
+}
+
+static void groups_free(struct swiss_group* groups)
+{
+#ifdef __KERNEL__
+	if (is_vmalloc_addr(groups))
+	{
+		vfree(groups);
+		return;
+	}
+#endif
+	FREEMEM(groups);
+}
+
+/* a partition is grown once it is seven eighths full */
+static inline int part_full(struct swiss_part* p, unsigned int items,
+	unsigned int mask)
+{
+	return (items + 1) * 8 > (mask + 1) * SWISS_GROUP_SLOTS * 7;
+}
+
+/* put e in the first empty slot on its probe sequence, counting it as having
+   overflowed each full group it passes. Returns -ENOMEM if every slot is
+   full. */
+static int part_insert(struct swiss_part* p, struct ub_entry* e,
+	uint64_t key_hash)
+{
+	unsigned int g = home_of(p, key_hash);
+	unsigned int probe;
+
+	for (probe = 0; probe <= p->mask; probe++)
+	{
+		struct swiss_group* grp = &p->groups[g];
+		uint64_t empty = group_empty(group_ctrl(grp));
+
+		if (empty)
+		{
+			unsigned int i = match_slot(empty);
+
+			grp->tags[i] = tag_of(key_hash);
+			grp->slots[i] = e;
+			p->items++;
+			return 0;
+		}
+
+		if (group_overflow(grp) < SWISS_OVERFLOW_MAX)
+			grp->tags[SWISS_GROUP_SLOTS]++;
+		g = probe_next(p, g, probe);
+	}
+
+	return -ENOMEM;
+}
+
+/* Rehash everything in a partition into twice as many groups, allocated 
+   beforehand, with the partition's lock held. Returns the old groups, for 
+   the caller to free once the lock has been let go. */
+static struct swiss_group* part_grow(struct swiss_part* p,
+	struct swiss_group* groups)
+{
+	struct swiss_group* old = p->groups;
+	unsigned int old_groups = p->mask + 1;
+	unsigned int g, i;
+
+	p->groups = groups;
+	p->mask = old_groups * 2 - 1;
+	p->items = 0;
+
+	for (g = 0; g < old_groups; g++)
+	{
+		for (i = 0; i < SWISS_GROUP_SLOTS; i++)
+		{
+			struct ub_entry* e = old[g].slots[i];
+
+			if (e)
+				part_insert(p, e, e->key_hash);
+		}
+	}
+
+	return old;
+}
+
+spinlock_t* ub_hashtbl_lock(char* key, size_t len_key)
+{
+	spinlock_t* lock = &part_of(ub_hashtbl_hash(key, len_key))->lock;
+
+	spin_lock(lock);
+	return lock;
+}
+
+int ub_hashtbl_init(size_t max_items)
+{
+	int i;
+
+	for (i = 0; i < (1 << SWISS_PART_BITS); i++)
+	{
+		struct swiss_part* p = &parts[i];
+
+		p->groups = groups_alloc(SWISS_MIN_GROUPS);
+		if (!p->groups)
+		{
+			while (i--)
+				groups_free(parts[i].groups);
+			return -ENOMEM;
+		}
+
+		p->mask = SWISS_MIN_GROUPS - 1;
+		p->items = 0;
+		spin_lock_init(&p->lock);
+	}
+
+	return 0;
+}
+
+void ub_hashtbl_exit(void)
+{
+	int i;
+
+	for (i = 0; i < (1 << SWISS_PART_BITS); i++)
+	{
+#ifdef __KERNEL__
+		unsigned int g, s;
+
+		for (g = 0; g <= parts[i].mask; g++)
+			for (s = 0; s < SWISS_GROUP_SLOTS; s++)
+				if (parts[i].groups[g].slots[s])
+					kfree_skb(parts[i].groups[g].slots[s]->skb);
+#endif
+		groups_free(parts[i].groups);
+		parts[i].groups = NULL;
+	}
+}
+
+struct ub_entry* ub_hashtbl_find(char* key, size_t len_key)
+{
+	return ub_hashtbl_find_hashed(key, len_key, ub_hashtbl_hash(key, len_key));
+}
+
+struct ub_entry* ub_hashtbl_find_hashed(char* key, size_t len_key, 
+	uint64_t key_hash)
+{
+	struct swiss_part* p = part_of(key_hash);
+	uint8_t tag = tag_of(key_hash);
+	unsigned int g = home_of(p, key_hash);
+	unsigned int probe;
+
+	for (probe = 0; probe <= p->mask; probe++)
+	{
+		struct swiss_group* grp = &p->groups[g];
+		uint64_t match = group_match(group_ctrl(grp), tag);
+
+		while (match)
+		{
+			struct ub_entry* e = grp->slots[match_slot(match)];
+
+			if (e && e->key_hash == key_hash && e->len_key == len_key &&
+				!memcmp(key, ub_entry_loc_key(e), len_key))
+				return e;
+
+			match &= match - 1;
+		}
+
+		if (!group_overflow(grp))
+			break;
+		g = probe_next(p, g, probe);
+	}
+
+	return NULL;
+}
+
+/* the key's home group, which is the only one most lookups read before the
+   entry itself. This is done without the partition's lock, so the partition 
+   may be growing and the line fetched one which is about to be freed, but a 
+   prefetch never faults and the lookup proper takes the lock. */
+void ub_hashtbl_prefetch(uint64_t key_hash)
+{
+	struct swiss_part* p = part_of(key_hash);
+
+	PREFETCH(&p->groups[home_of(p, key_hash)]);
+}
+
+/* Grow the partition a key is about to be added to if it is full enough, 
+   before the caller takes its lock. The partition is looked at without the
+   lock, so may be grown by someone else meanwhile, in which case the new 
+   groups are given back. */
+void ub_hashtbl_reserve(uint64_t key_hash)
+{
+	struct swiss_part* p = part_of(key_hash);
+	unsigned int mask = READ_ONCE(p->mask);
+	struct swiss_group* groups;
+
+	if (!part_full(p, READ_ONCE(p->items), mask))
+		return;
+
+	groups = groups_alloc((mask + 1) * 2);
+	if (!groups)
+		return;
+
+	spin_lock(&p->lock);
+	if (p->mask == mask)
+		groups = part_grow(p, groups);
+	spin_unlock(&p->lock);
+
+	groups_free(groups);
+}
+
+/* if ub_hashtbl_reserve couldn't grow the partition, it just gets fuller */
+int ub_hashtbl_add(struct ub_entry* e)
+{
+	return part_insert(part_of(e->key_hash), e, e->key_hash);
+}
+
+/* follow e's probe sequence to its slot, taking back the overflow counts its
+   insertion added to the groups on the way */
+void ub_hashtbl_del(struct ub_entry* e)
+{
+	uint64_t key_hash = e->key_hash;
+	struct swiss_part* p = part_of(key_hash);
+	uint8_t tag = tag_of(key_hash);
+	unsigned int g = home_of(p, key_hash);
+	unsigned int probe;
+
+	for (probe = 0; probe <= p->mask; probe++)
+	{
+		struct swiss_group* grp = &p->groups[g];
+		uint64_t match = group_match(group_ctrl(grp), tag);
+
+		while (match)
+		{
+			unsigned int i = match_slot(match);
+
+			if (grp->slots[i] == e)
+			{
+				grp->tags[i] = 0;
+				grp->slots[i] = NULL;
+				p->items--;
+				return;
+			}
+
+			match &= match - 1;
+		}
+
+		if (group_overflow(grp) < SWISS_OVERFLOW_MAX)
+			grp->tags[SWISS_GROUP_SLOTS]--;
+		g = probe_next(p, g, probe);
+	}
+}
+
+/* the new entry has the same key, so the same tag and probe sequence, and 
+   takes the old one's slot */
+void ub_hashtbl_replace(struct ub_entry* old, struct ub_entry* e)
+{
+	uint64_t key_hash = e->key_hash;
+	struct swiss_part* p = part_of(key_hash);
+	uint8_t tag = tag_of(key_hash);
+	unsigned int g = home_of(p, key_hash);
+	unsigned int probe;
+
+	for (probe = 0; probe <= p->mask; probe++)
+	{
+		struct swiss_group* grp = &p->groups[g];
+		uint64_t match = group_match(group_ctrl(grp), tag);
+
+		while (match)
+		{
+			unsigned int i = match_slot(match);
+
+			if (grp->slots[i] == old)
+			{
+				grp->slots[i] = e;
+				return;
+			}
+
+			match &= match - 1;
+		}
+
+		g = probe_next(p, g, probe);
+	}
+}
@@ -1,16 +1,34 @@
 #ifndef UNBUCKLE_ENTRY_H
 #define UNBUCKLE_ENTRY_H
 
+#include <db/keyhash.h>
+
+/* uthash buckets keys by the same hash as every other hash table engine */
+#define HASH_FUNCTION(keyptr, keylen, num_bkts, hashv, bkt)                      \
+do {                                                                             \
+	(hashv) = (unsigned) ub_keyhash((const char*) (keyptr), (keylen));           \
+	(bkt) = (hashv) & ((num_bkts) - 1);                                          \
+} while (0)
+
 #ifdef __KERNEL__
+#include <linux/rcupdate.h>
 #include <linux/skbuff.h>
+#include <linux/stddef.h>
 #include <linux/types.h>
 #include <kernel/db/uthash.h>
 #else
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include <user/db/uthash.h>
+#include <user/epoch.h>
 #endif
 
+#include <buckets.h>
+#include <prot/memcached.h>
+
 /* item entries -- used for storing metadata and actual cached data - the idea 
    is to allocate enough memory for the entry header + the key and value to be
    stored in the cache, unless you're in the kernel, when struct ub_entry is a
@@ -23,17 +41,27 @@ struct ub_entry {
 #ifdef HASHTABLE_KHASH
 	struct hlist_node hlist;
 #endif
+	struct ub_lru_link lru;
+	uint64_t key_hash; /* ub_hashtbl_hash of the key */
 	size_t len_key;
 	size_t len_val;
+	struct rcu_head rcu; /* for freeing once lookups can no longer find it */
 #ifdef __KERNEL__
 	unsigned char* loc_key;
 	unsigned char* loc_val;
-	struct sk_buff* skb;
+	struct sk_buff* skb;    /* the reply, ready to go, if it fits one datagram */
+	struct ub_chunk* chain; /* otherwise the value, with skb NULL */
+#else
+	struct ub_chunk* chain; /* the rest of a value too large for one chunk */
 #endif
 };
 
 #define UB_ENTRY_SIZE sizeof(struct ub_entry)
 
+/* recover the entry from its embedded LRU link */
+#define ub_entry_from_lru(link) \
+	((struct ub_entry*) (((char*) (link)) - offsetof(struct ub_entry, lru)))
+
 /* inlined here so that each compilation unit gets its own copy, which might be
    wasteful but avoids the overhead of a branch for what is a very simple ALU
    calculation. Note that since the change to storing skbuffs directly in the k-v
@@ -41,9 +69,24 @@ struct ub_entry {
    the userspace versions. */
 
 #ifdef __KERNEL__
+/* most a GET's reply adds to the key and value ("VALUE ", " 0 ", the length
+   and the line ends), and the most of it which goes in one datagram */
+#define UB_REPLY_OVERHEAD 28
+#define UB_REPLY_DATAGRAM (MEMCACHED_UDP_MAX_PAYLOAD - MEMCACHED_UDP_HDR_LEN)
+
+/* A value whose reply won't fit in one datagram isn't kept in a ready made 
+   reply, but in a chain of chunks from the bucket allocator, with the key 
+   after the entry in its own chunk. The reply is built from the chain, a 
+   datagram at a time, when it is asked for. */
+static inline int ub_entry_chained(size_t len_key, size_t len_val)
+{
+	return len_key + len_val + UB_REPLY_OVERHEAD > UB_REPLY_DATAGRAM;
+}
 static inline size_t ub_entry_size(size_t len_key, size_t len_val)
 {
-	/* the key and value are stored in the skb instead in the kernel */
+	/* the key and value are otherwise stored in the skb */
+	if (ub_entry_chained(len_key, len_val))
+		return UB_ENTRY_SIZE + len_key;
 	return UB_ENTRY_SIZE;
 }
 static inline char* ub_entry_loc_key(struct ub_entry* e)
@@ -55,8 +98,17 @@ static inline char* ub_entry_loc_val(struct ub_entry* e)
 	return e->loc_val;
 }
 #else
+/* An item too large for the biggest bucket takes a whole chunk of that size 
+   for the entry, the key and as much of the value as will fit, and the rest 
+   of the value goes in a chain of chunks hanging off e->chain. */
+static inline int ub_entry_chained(size_t len_key, size_t len_val)
+{
+	return UB_ENTRY_SIZE + len_key + len_val > ub_buckets_max_item();
+}
 static inline size_t ub_entry_size(size_t len_key, size_t len_val)
 {
+	if (ub_entry_chained(len_key, len_val))
+		return ub_buckets_max_item();
 	return UB_ENTRY_SIZE + len_key + len_val;
 }
 static inline char* ub_entry_loc_key(struct ub_entry* e)
@@ -72,6 +124,21 @@ static inline char* ub_entry_loc_val(struct ub_entry* e)
 /* replacement will replace an item which already exists by another, and add a 
    new entry (possibly with a different value) for an item if it already exists. */
 int ub_cache_replace(char* key, size_t len_key, char* val, size_t len_val);
-struct ub_entry* ub_cache_find(char* key, size_t len_key);
+/* key_hash is ub_hashtbl_hash of the key, which the caller has already had 
+   to work out (to prefetch its part of the hash table, say) */
+struct ub_entry* ub_cache_find(char* key, size_t len_key, uint64_t key_hash);
+/* removes an item from the cache, returning its memory to the bucket allocator.
+   Returns -EUBKEYNOTFOUND if there was no such item. */
+int ub_cache_delete(char* key, size_t len_key);
+/* eviction callback handed to the bucket allocator with ub_buckets_set_evictor */
+void* ub_cache_evict(struct ub_lru_link* link);
+/* and the release callback, which frees the skb or the chain of a chained 
+   value once lookups are done with it */
+void ub_cache_release(struct ub_lru_link* link);
+#ifndef __KERNEL__
+/* point iov at the pieces of an entry's value in order, without copying. 
+   Returns how many were filled in, or -E2BIG if there are more than max_iov. */
+int ub_entry_val_iov(struct ub_entry* e, struct iovec* iov, int max_iov);
+#endif
 
 #endif
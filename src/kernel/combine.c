@@ -0,0 +1,124 @@
+/* Flat combining for SETs, after Hendler, Incze, Shavit and Tzafrir, "Flat
+   combining and the synchronization-parallelism tradeoff" (SPAA 2010).
+
+   When every worker applies its own SETs, each one drags the locks they take
+   (the key's, the bucket's LRU list's and, for uthash, the whole table's)
+   and the lines of the table behind them over to its own core, and a storm
+   of SETs (a cache being warmed up after a deploy, say) spends its time
+   bouncing those between cores. Instead, a worker posts its SETs in its own
+   slot and carries on with the rest of its batch. Whichever worker next
+   waits for its SETs and finds no one else combining takes the combiner's
+   lock and applies everything posted in every slot in one go, with the
+   update semaphore taken once for the lot, so the locks and the table stay
+   in its cache for the whole batch; the others go back to their GETs, and
+   only answer their SETs once the combiner has done them.
+
+   Each slot is a ring of requests with two counters which only go up: the
+   worker alone moves posted on, once a request is in place, and the
+   combiner (there is only ever one) moves done on after applying them. */
+
+#include <entry.h>
+#include <kernel/combine.h>
+#include <kernel/compat.h>
+#include <kernel/net/udpserver_rx.h>
+#include <request.h>
+#include <unbuckle.h>
+
+#include <linux/cache.h>
+#include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+struct combine_slot {
+	/* written by the worker */
+	struct request_state* reqs[UB_RX_BATCH];
+	unsigned int posted;
+	/* and by the combiner */
+	unsigned int done ____cacheline_aligned_in_smp;
+} ____cacheline_aligned_in_smp;
+
+static struct combine_slot slots[MAX_WORKERS];
+
+/* A mutex rather than a spinlock, since a SET may sleep (allocating the
+   memory for it may have to wait for evicted entries to be freed). Nobody
+   waits on it: a worker which can't take it just looks again for its SETs
+   being done. */
+static DEFINE_MUTEX(combine_lock);
+
+/* Apply every SET posted so far, each worker's in the order it posted them,
+   with combine_lock held. */
+static void combine(void)
+{
+	int w;
+
+	percpu_down_read(&ub_update_sem);
+	for (w = 0; w < ub_num_rx_workers; w++)
+	{
+		struct combine_slot* s = &slots[w];
+		unsigned int posted = smp_load_acquire(&s->posted);
+		unsigned int i;
+
+		if (s->done == posted)
+			continue;
+
+		for (i = s->done; i != posted; i++)
+		{
+			struct request_state* req = s->reqs[i % UB_RX_BATCH];
+
+			req->err = ub_cache_replace(req->key, req->len_key, req->data,
+				req->len_data);
+			req->set_combined = 1;
+		}
+		smp_store_release(&s->done, posted);
+	}
+	percpu_up_read(&ub_update_sem);
+}
+
+void ub_combine_post(int worker, struct request_state* req)
+{
+	struct combine_slot* s = &slots[worker];
+
+	s->reqs[s->posted % UB_RX_BATCH] = req;
+	smp_store_release(&s->posted, s->posted + 1);
+}
+
+/* Only the worker's own requests are looked at, and a SET which the combiner
+   has just done is harmlessly counted as still to do. */
+int ub_combine_pending(int worker, const unsigned char* key, int len_key)
+{
+	struct combine_slot* s = &slots[worker];
+	unsigned int i;
+
+	for (i = READ_ONCE(s->done); i != s->posted; i++)
+	{
+		struct request_state* req = s->reqs[i % UB_RX_BATCH];
+
+		if (req->len_key == len_key && !memcmp(req->key, key, len_key))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* The combiner may sleep with the lock held, so rather than spinning hard
+   the other workers let anything else due to run (and RCU see them pass
+   through a quiescent state, which the combiner may itself be waiting for). */
+void ub_combine_wait(int worker)
+{
+	struct combine_slot* s = &slots[worker];
+
+	while (smp_load_acquire(&s->done) != s->posted)
+	{
+		if (mutex_trylock(&combine_lock))
+		{
+			combine();
+			mutex_unlock(&combine_lock);
+		}
+		else
+		{
+			cpu_relax();
+			cond_resched();
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef UB_KERNEL_COMBINE_H
+#define UB_KERNEL_COMBINE_H
+
+#include <request.h>
+
+/* Flat combining for SETs (see kernel/combine.c). worker is the RX worker's
+   index, and a worker may have no more than UB_RX_BATCH SETs posted and not
+   yet waited for. */
+
+/* hand a parsed SET over to be applied by whichever worker is combining */
+void ub_combine_post(int worker, struct request_state* req);
+/* whether a request for the key would overtake one of the worker's SETs
+   which hasn't been applied yet */
+int ub_combine_pending(int worker, const unsigned char* key, int len_key);
+/* return once every SET the worker has posted has been applied, combining
+   them (and everyone else's) itself if no other worker is */
+void ub_combine_wait(int worker);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef UB_KERNEL_COMPAT_H
+#define UB_KERNEL_COMPAT_H
+
+/* The module is written for 3.10 and later kernels. Interfaces which have
+   come (or changed) since then are used through here, each falling back on
+   its older form, so that the rest of the code needn't check the version. */
+
+#include <linux/compiler.h>
+#include <linux/completion.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/percpu_counter.h>
+#include <linux/skbuff.h>
+#include <linux/version.h>
+#include <net/net_namespace.h>
+#include <asm/barrier.h>
+
+/* 3.19 */
+#ifndef READ_ONCE
+#define READ_ONCE(x)     ACCESS_ONCE(x)
+#define WRITE_ONCE(x, v) (ACCESS_ONCE(x) = (v))
+#endif
+
+/* 3.14 */
+#ifndef smp_load_acquire
+#define smp_load_acquire(p) \
+	({ typeof(*(p)) ___v = ACCESS_ONCE(*(p)); smp_mb(); ___v; })
+#define smp_store_release(p, v) \
+	do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+#define skb_get_hash(skb) skb_get_rxhash(skb)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define write_seqcount_begin_nested(s, subclass) write_seqcount_begin(s)
+#define reinit_completion(x) INIT_COMPLETION(*(x))
+#endif
+
+/* 3.17 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+static inline u64 ktime_get_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+#endif
+
+/* 3.18, which also brought xmit_more: before it, the driver is told of each
+   packet as it is given it */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
+static inline u32 reciprocal_scale(u32 val, u32 ep_ro)
+{
+	return (u32) (((u64) val * ep_ro) >> 32);
+}
+
+#define ub_percpu_counter_init(fbc, value, gfp) percpu_counter_init(fbc, value)
+
+#define netif_xmit_frozen_or_drv_stopped(txq) netif_xmit_frozen_or_stopped(txq)
+
+static inline netdev_tx_t netdev_start_xmit(struct sk_buff* skb,
+	struct net_device* dev, struct netdev_queue* txq, bool more)
+{
+	netdev_tx_t rc = dev->netdev_ops->ndo_start_xmit(skb, dev);
+
+	if (rc == NETDEV_TX_OK)
+		txq_trans_update(txq);
+	return rc;
+}
+#else
+#define ub_percpu_counter_init(fbc, value, gfp) percpu_counter_init(fbc, value, gfp)
+#endif
+
+/* The netfilter hook has had four signatures; the skb is always the second
+   argument. Since 4.4 hooks are registered per network namespace, and the
+   module's hook is in the initial one. */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define UB_NF_HOOK_ARGS(skb) \
+	void* priv, struct sk_buff* skb, const struct nf_hook_state* state
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+#define UB_NF_HOOK_ARGS(skb) \
+	const struct nf_hook_ops* ops, struct sk_buff* skb, \
+	const struct nf_hook_state* state
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+#define UB_NF_HOOK_ARGS(skb) \
+	const struct nf_hook_ops* ops, struct sk_buff* skb, \
+	const struct net_device* in, const struct net_device* out, \
+	int (*okfn)(struct sk_buff*)
+#else
+#define UB_NF_HOOK_ARGS(skb) \
+	unsigned int hooknum, struct sk_buff* skb, \
+	const struct net_device* in, const struct net_device* out, \
+	int (*okfn)(struct sk_buff*)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0)
+#define UB_NF_HOOK_OWNER
+#define ub_nf_register_hook(ops)   nf_register_net_hook(&init_net, ops)
+#define ub_nf_unregister_hook(ops) nf_unregister_net_hook(&init_net, ops)
+#else
+#define UB_NF_HOOK_OWNER           .owner = THIS_MODULE,
+#define ub_nf_register_hook(ops)   nf_register_hook(ops)
+#define ub_nf_unregister_hook(ops) nf_unregister_hook(ops)
+#endif
+
+#endif
@@ -3,17 +3,114 @@
 #include <kernel/locks.h>
 #include <kernel/net/skbs.h>
 #include <kernel/net/udpserver_rx.h>
+#include <net/udpserver.h>
 #include <request.h>
 #include <uberrors.h>
 
-#include <linux/rwlock.h>
-#include <linux/rwsem.h>
+#include <db/hashtable.h>
+#include <unbuckle.h>
+
+#include <linux/kernel.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
 
 /* leave this here for now even though it's not used (stop compiler complaining) */
 DEFINE_SPINLOCK(ub_kernlock);
 
-//static DEFINE_RWLOCK(ub_kernrwlock);
-struct rw_semaphore rwlock;
+struct percpu_rw_semaphore ub_update_sem;
+
+/* Lookups in a hash table which is safe for RCU readers take no lock at all, 
+   and entries are only freed once they have finished (see kernel/entry.c). 
+   Otherwise the key's lock has to be held. */
+#ifdef HASHTABLE_RCU_LOOKUP
+#define GET_LOCK(req) rcu_read_lock()
+#define GET_UNLOCK()  rcu_read_unlock()
+#else
+#define GET_LOCK(req) \
+	spinlock_t* get_lock = ub_hashtbl_lock((req)->key, (req)->len_key)
+#define GET_UNLOCK()  ub_hashtbl_unlock(get_lock)
+#endif
+
+/* Build the reply for a chained entry (see entry.h) as a list of datagrams 
+   linked through skb->next, each with the most UB_REPLY_DATAGRAM bytes of the
+   reply, and frame headers to number them added in udpserver_sendall. The 
+   value is copied straight out of its chunks into the datagrams. Called with 
+   the entry found, under the same lock or read section. */
+static struct sk_buff* get_reply_chained(struct ub_entry* e)
+{
+	static const char trailer[] = "\r\nEND\r\n";
+	char len_valbuf[24];
+	int len_len_valbuf = 
+		snprintf(len_valbuf, sizeof(len_valbuf), " 0 %zu\r\n", e->len_val);
+	size_t len_head = strlen("VALUE ") + e->len_key + len_len_valbuf;
+	size_t left = len_head + e->len_val + strlen(trailer);
+	struct ub_chunk* c = e->chain;
+	size_t c_off = 0;
+	size_t t_off = 0;
+	struct sk_buff* head = NULL;
+	struct sk_buff** tail = &head;
+
+	/* the head goes in the first datagram, which a key memcached allows 
+	   (up to 250 bytes) always leaves room for */
+	if (unlikely(len_head > UB_REPLY_DATAGRAM))
+		return NULL;
+
+	while (left > 0)
+	{
+		size_t len = min_t(size_t, left, UB_REPLY_DATAGRAM);
+		struct sk_buff* skb = ub_skb_set_up(len);
+		unsigned char* p;
+
+		if (unlikely(!skb))
+			goto nomem;
+		*tail = skb;
+		tail = &skb->next;
+
+		p = skb_put(skb, len);
+		left -= len;
+
+		if (skb == head)
+		{
+			memcpy(p, "VALUE ", strlen("VALUE "));
+			p += strlen("VALUE ");
+			memcpy(p, e->loc_key, e->len_key);
+			p += e->len_key;
+			memcpy(p, len_valbuf, len_len_valbuf);
+			p += len_len_valbuf;
+			len -= len_head;
+		}
+
+		for (; len > 0 && c; c_off = 0, c = c->next)
+		{
+			size_t n = min_t(size_t, len, c->len - c_off);
+
+			memcpy(p, ub_chunk_data(c) + c_off, n);
+			p += n;
+			len -= n;
+			c_off += n;
+			if (c_off < c->len)
+				break;
+		}
+
+		memcpy(p, trailer + t_off, len);
+		t_off += len;
+	}
+
+	return head;
+
+nomem:
+	while (head)
+	{
+		struct sk_buff* next = head->next;
+		head->next = NULL;
+		kfree_skb(head);
+		head = next;
+	}
+	return NULL;
+}
 
 static int
 process_get(struct request_state* req)
@@ -21,30 +118,35 @@ process_get(struct request_state* req)
 	struct ub_entry* e;
 	struct sk_buff* skb;
 	
-	while (!down_read_trylock(&rwlock))
-		continue;
-	e = ub_cache_find(req->key, req->len_key);
+	GET_LOCK(req);
+	e = ub_cache_find(req->key, req->len_key, req->key_hash);
 
 	if (!e)
 	{
 		req->err = -EUBKEYNOTFOUND;
-		up_read(&rwlock);
+		GET_UNLOCK();
 		return req->err;
 	}
 
+	ub_buckets_lru_touch(&e->lru);
+	ub_buckets_note_access(e);
+
 	/* If we found a suitable ub_entry* e,
 	   it will contain the skb to be emitted on the wire.
 	   Clone the copy from the hash table under the lock so that headers can be added
 	   and responsibility for it can be handed over to the NIC during the send process.
-	   This keeps the critical region under the read lock as short and contained as possible. */
-	skb = skb_clone(e->skb, GFP_ATOMIC);
+	   This keeps the read-side critical region as short and contained as possible. */
+	if (e->chain)
+		skb = get_reply_chained(e);
+	else
+		skb = skb_clone(e->skb, GFP_ATOMIC);
 	if (unlikely(!skb))
 	{
 		req->err = -EUBKEYNOTFOUND;
-		up_read(&rwlock);
+		GET_UNLOCK();
 		return req->err;
 	}
-	up_read(&rwlock);
+	GET_UNLOCK();
 
 	/* We should have found an entry, and this means we have a pointer to an skb
 	   within the ub_entry struct which we can now use to send directly on the 
@@ -53,14 +155,18 @@ process_get(struct request_state* req)
 	return 0;
 }
 
+/* A SET which went through the combiner (see kernel/combine.c) has already
+   been done, and only needs answering. */
 static int
 process_set(struct request_state* req)
 {
-	
-	while (!down_write_trylock(&rwlock))
-		continue;
-	req->err = ub_cache_replace(req->key, req->len_key, req->data, req->len_data);
-	up_write(&rwlock);
+	if (!req->set_combined)
+	{
+		percpu_down_read(&ub_update_sem);
+		req->err = ub_cache_replace(req->key, req->len_key, req->data, 
+			req->len_data);
+		percpu_up_read(&ub_update_sem);
+	}
 
 	/* TODO: this need not generate a new skb on every run, but for now it's simpler
 	         to do it this way */
@@ -80,6 +186,22 @@ process_set(struct request_state* req)
 	return 0;
 }
 
+static int
+process_delete(struct request_state* req)
+{
+	percpu_down_read(&ub_update_sem);
+	req->err = ub_cache_delete(req->key, req->len_key);
+	percpu_up_read(&ub_update_sem);
+
+	req->skb_tx = ub_skb_set_up(32);
+	if (req->err == 0)
+		ub_push_data_to_skb(req->skb_tx, "DELETED\r\n", strlen("DELETED\r\n"));
+	else
+		ub_push_data_to_skb(req->skb_tx, "NOT_FOUND\r\n", strlen("NOT_FOUND\r\n"));
+
+	return 0;
+}
+
 int process_request(struct request_state* req)
 {
 	switch (req->cmd)
@@ -92,6 +214,10 @@ int process_request(struct request_state* req)
 		if (process_set(req))
 			return -1;
 		break;
+	case cmd_delete:
+		if (process_delete(req))
+			return -1;
+		break;
 	}
 
 	req->state = conn_send;
@@ -99,42 +225,39 @@ int process_request(struct request_state* req)
 	return 0;
 }
 
+/* Each worker has a batch of request states (see do_kernel_rx_worker), each
+   with a receive buffer of its own. */
 int ub_core_run(void)
 {
-	int res;
+	struct request_state* reqs;
+	int i, res = 0;
 
-	struct request_state* req = kmalloc(sizeof(struct request_state), 
-		GFP_KERNEL);
+	reqs = kcalloc(UB_RX_BATCH, sizeof(struct request_state), GFP_KERNEL);
 	allow_signal(SIGKILL | SIGSTOP);
 
-	if (!req
-#ifdef __KERNEL__
-		|| ksize(req) < sizeof(struct request_state)
-#endif
-		)
+	if (!reqs)
 		return -ENOMEM;
-	memset(req, 0, sizeof(struct request_state));
-	
-	req->len_recvbuf = 4096;
-	req->recvbuf = (char*) kmalloc(req->len_recvbuf, GFP_KERNEL);
-	if (ksize(req->recvbuf) < req->len_recvbuf)
+
+	for (i = 0; i < UB_RX_BATCH; i++)
 	{
-		printk(KERN_WARNING 
-			"[Unbuckle] Asked for a receive buffer of %lu, but got %lu.\n",
-			req->len_recvbuf, ksize(req->recvbuf)
-		);
-		req->len_recvbuf = ksize(req->recvbuf);
+		struct request_state* req = &reqs[i];
+
+		/* big enough for the largest datagram, which a SET of a large value 
+		   reassembled from its fragments is copied into */
+		req->len_recvbuf = UDP_RECV_BUFFER;
+		req->recvbuf = (char*) vmalloc(req->len_recvbuf);
+		if (!req->recvbuf)
+		{
+			res = -ENOMEM;
+			goto out;
+		}
 	}
 
-	do_kernel_rx_worker(req);
+	do_kernel_rx_worker(reqs, UB_RX_BATCH);
 
-	if (req)
-	{
-		if (req->recvbuf)
-			kfree(req->recvbuf);
-		kfree(req);
-		req = NULL;
-	}
-	res = 0;
+out:
+	for (i = 0; i < UB_RX_BATCH; i++)
+		vfree(reqs[i].recvbuf);
+	kfree(reqs);
 	return res;
 }
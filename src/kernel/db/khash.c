@@ -1,48 +1,285 @@
-
-
 #include <db/hashtable.h>
-#include <db/spooky/spooky_hash.h>
 #include <entry.h>
+#include <kernel/compat.h>
 #include <uberrors.h>
 
-#include <linux/hashtable.h>
-#include <linux/list.h>
+#include <linux/bitops.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/percpu_counter.h>
+#include <linux/prefetch.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
+#include <linux/seqlock.h>
 #include <linux/skbuff.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #include <linux/types.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+/* The table starts at 2^HASHTABLE_MIN_BITS list heads and is resized in the
+   background to keep the number of items between a quarter and one times
+   the number of heads. While it is resized there are two tables: lookups try
+   the new one and then the old, new items go in the new one, and a worker
+   moves the old table's chains across one at a time. No request ever waits
+   for more than one chain to be moved.
+
+   A table too large for a huge page is split into segments the size of one,
+   each allocated from the buddy allocator and hence covered by a single TLB
+   entry in the direct map (a static array would land in the module's vmalloc
+   space, mapped with 4 KiB pages). If memory is too fragmented for that, a
+   segment falls back to vmalloc. */
+#define HASHTABLE_SEGMENT_SIZE (2 * 1024 * 1024)
+#define HASHTABLE_SEGMENT_HEADS \
+	(HASHTABLE_SEGMENT_SIZE / sizeof(struct hlist_head))
+
+struct hashtbl {
+	unsigned int bits;
+	unsigned int nsegments;
+	struct hlist_head* segments[];
+};
+
+/* where new items go and lookups start, and while resizing, the table whose
+   chains are still being moved into it */
+static struct hashtbl __rcu* table;
+static struct hashtbl __rcu* table_old;
+
+/* how many items there are, to decide when to resize */
+static struct percpu_counter items;
+
+static void hashtbl_resize(struct work_struct* work);
+static DECLARE_WORK(resize_work, hashtbl_resize);
+static unsigned long resizing;
+static int stopping;
+
+/* A fixed number of locks, each on a cache line of its own, stripe the table:
+   a key is covered by the lock picked out by the low bits of its hash. As the
+   tables are never smaller than the number of locks, these bits also pick
+   out the head in either table, so one lock covers everything a chain move
+   touches. Each lock comes with a sequence count which is bumped while chains
+   are moved, so that a lookup which misses because its entry was moving
+   underneath it knows to look again. */
+#define HASHTABLE_LOCK_BITS HASHTABLE_SHARD_BITS
+
+struct hashtbl_stripe {
+	spinlock_t lock;
+	seqcount_t seq;
+} ____cacheline_aligned_in_smp;
+
+static struct hashtbl_stripe stripes[1 << HASHTABLE_LOCK_BITS];
+
+static inline struct hashtbl_stripe* stripe_of(uint64_t key_hash)
+{
+	return &stripes[key_hash & ((1 << HASHTABLE_LOCK_BITS) - 1)];
+}
+
+static inline struct hlist_head* table_bucket(struct hashtbl* t,
+	unsigned long bkt)
+{
+	return &t->segments[bkt / HASHTABLE_SEGMENT_HEADS]
+		[bkt % HASHTABLE_SEGMENT_HEADS];
+}
+
+/* the list head a hashed key lives on */
+static inline struct hlist_head* table_head(struct hashtbl* t, uint64_t key_hash)
+{
+	return table_bucket(t, key_hash & ((1UL << t->bits) - 1));
+}
+
+spinlock_t* ub_hashtbl_lock(char* key, size_t len_key)
+{
+	spinlock_t* lock = &stripe_of(ub_hashtbl_hash(key, len_key))->lock;
+
+	spin_lock(lock);
+	return lock;
+}
+
+static inline size_t table_segment_size(unsigned int bits)
+{
+	size_t size = (1UL << bits) * sizeof(struct hlist_head);
+	return min_t(size_t, size, HASHTABLE_SEGMENT_SIZE);
+}
+
+static void table_free(struct hashtbl* t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->nsegments; i++)
+	{
+		struct hlist_head* seg = t->segments[i];
+
+		if (!seg)
+			continue;
+		if (is_vmalloc_addr(seg))
+			vfree(seg);
+		else
+			free_pages((unsigned long) seg,
+				get_order(table_segment_size(t->bits)));
+	}
+
+	kfree(t);
+}
+
+/* All bits zero is an empty struct hlist_head, so the segments need no
+   further initialisation once zeroed. */
+static struct hashtbl* table_alloc(unsigned int bits)
+{
+	size_t seg_size = table_segment_size(bits);
+	unsigned int nsegments =
+		((1UL << bits) * sizeof(struct hlist_head)) / seg_size;
+	struct hashtbl* t;
+	unsigned int i;
+
+	t = kzalloc(sizeof(struct hashtbl) +
+		nsegments * sizeof(struct hlist_head*), GFP_KERNEL);
+	if (!t)
+		return NULL;
+
+	t->bits = bits;
+	t->nsegments = nsegments;
+
+	for (i = 0; i < nsegments; i++)
+	{
+		t->segments[i] = (struct hlist_head*) __get_free_pages(GFP_KERNEL |
+			__GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY, get_order(seg_size));
+		if (!t->segments[i])
+			t->segments[i] = vzalloc(seg_size);
+
+		if (!t->segments[i])
+		{
+			table_free(t);
+			return NULL;
+		}
+	}
+
+	return t;
+}
+
+/* how large the table should be for n items: somewhere between two and four
+   heads for each */
+static inline unsigned int table_bits_for(s64 n)
+{
+	unsigned int bits = fls64(n) + 1;
+	return clamp_t(unsigned int, bits, HASHTABLE_MIN_BITS, HASHTABLE_MAX_BITS);
+}
+
+/* start a resize if the table has got too full or too empty */
+static void resize_check(void)
+{
+	s64 n = percpu_counter_read_positive(&items);
+	unsigned int bits;
+
+	rcu_read_lock();
+	bits = rcu_dereference(table)->bits;
+	rcu_read_unlock();
+
+	if ((n > (1LL << bits) && bits < HASHTABLE_MAX_BITS) ||
+		(n < (1LL << bits) / 4 && bits > HASHTABLE_MIN_BITS))
+	{
+		if (!READ_ONCE(stopping) && !test_and_set_bit(0, &resizing))
+			queue_work(system_long_wq, &resize_work);
+	}
+}
 
-#define HASHTABLE_SIZE_BITS 24
-#define SPOOKY_SEED 0xDEADBEEFFEEDCAFELL
+/* move every entry on one of the old table's chains to the new table */
+static void chain_move(struct hashtbl* old, struct hashtbl* new,
+	unsigned long bkt)
+{
+	struct hashtbl_stripe* s = &stripes[bkt & ((1 << HASHTABLE_LOCK_BITS) - 1)];
+	struct ub_entry* e;
+	struct hlist_node* tmp;
 
-DECLARE_HASHTABLE(hashtable, HASHTABLE_SIZE_BITS);
+	spin_lock(&s->lock);
+	write_seqcount_begin(&s->seq);
+	hlist_for_each_entry_safe(e, tmp, table_bucket(old, bkt), hlist)
+	{
+		hlist_del_rcu(&e->hlist);
+		hlist_add_head_rcu(&e->hlist, table_head(new, e->key_hash));
+	}
+	write_seqcount_end(&s->seq);
+	spin_unlock(&s->lock);
+}
 
-/* use spooky hash to get variable length char* arrays used as keys down into a
-   constant bit length which is compatible with the kernel hash table (the kernel
-   doesn't have a variable length hashing function as far as I can see */
-static inline uint64 get_spooky64_hash(char* key, int len_key)
+/* Runs from a workqueue to resize the table. Whatever happens, the old table
+   must be empty before it can go, so once started the move is finished even
+   if the module is being unloaded. */
+static void hashtbl_resize(struct work_struct* work)
 {
-	return spooky_Hash64(key, len_key, SPOOKY_SEED);
+	struct hashtbl* old = rcu_dereference_protected(table, 1);
+	struct hashtbl* new;
+	unsigned int bits = table_bits_for(percpu_counter_sum_positive(&items));
+	unsigned long bkt;
+
+	if (bits == old->bits || READ_ONCE(stopping))
+		goto out;
+
+	new = table_alloc(bits);
+	if (!new)
+		goto out;
+
+	/* lookups see the old table as the old one before they see the new one as
+	   the place to start */
+	rcu_assign_pointer(table_old, old);
+	rcu_assign_pointer(table, new);
+
+	for (bkt = 0; bkt < (1UL << old->bits); bkt++)
+	{
+		chain_move(old, new, bkt);
+		if ((bkt & 255) == 255)
+			cond_resched();
+	}
+
+	rcu_assign_pointer(table_old, NULL);
+	synchronize_rcu();
+	table_free(old);
+
+out:
+	clear_bit(0, &resizing);
+	resize_check();
 }
 
-int ub_hashtbl_init(void)
+int ub_hashtbl_init(size_t max_items)
 {
-	hash_init(hashtable);
+	struct hashtbl* t;
+	int i;
+
+	for (i = 0; i < (1 << HASHTABLE_LOCK_BITS); i++)
+	{
+		spin_lock_init(&stripes[i].lock);
+		seqcount_init(&stripes[i].seq);
+	}
+
+	if (ub_percpu_counter_init(&items, 0, GFP_KERNEL))
+		return -ENOMEM;
+
+	t = table_alloc(HASHTABLE_MIN_BITS);
+	if (!t)
+	{
+		percpu_counter_destroy(&items);
+		return -ENOMEM;
+	}
+
+	stopping = 0;
+	RCU_INIT_POINTER(table, t);
+	RCU_INIT_POINTER(table_old, NULL);
 	return 0;
 }
 
-static void hashtbl_empty_all(void)
+static void table_empty(struct hashtbl* t)
 {
-	int bkt;
+	unsigned long bkt;
 	struct ub_entry* e;
+	struct hlist_node* tmp;
 
-	if (hash_empty(hashtable))
-		return;
-	
 	// Need to walk the hash table to unset every struct hlist_node structure
-	hash_for_each_rcu(hashtable, bkt, e, hlist)
+	for (bkt = 0; bkt < (1UL << t->bits); bkt++)
 	{
-		kfree_skb(e->skb);
-		hash_del_rcu(&e->hlist);
+		hlist_for_each_entry_safe(e, tmp, table_bucket(t, bkt), hlist)
+		{
+			kfree_skb(e->skb);
+			hlist_del_rcu(&e->hlist);
+		}
 	}
 
 	return;
@@ -50,49 +287,107 @@ static void hashtbl_empty_all(void)
 
 void ub_hashtbl_exit(void)
 {
-	hashtbl_empty_all();
+	struct hashtbl* t;
+
+	WRITE_ONCE(stopping, 1);
+	cancel_work_sync(&resize_work);
+
+	t = rcu_dereference_protected(table, 1);
+	table_empty(t);
+	table_free(t);
+	RCU_INIT_POINTER(table, NULL);
+
+	percpu_counter_destroy(&items);
 	return;
 }
 
 int ub_hashtbl_add(struct ub_entry* e)
 {
 	struct hlist_node* node = &e->hlist;
-	char* key = ub_entry_loc_key(e);
-	size_t len_key = e->len_key;
 
 	// the kernel hash table doesn't give any feedback as to success or failure
 
-	// Hash the key down to a form which the kernel hash table can use
-	uint64 key_hash = get_spooky64_hash(key, len_key);
-	hash_add_rcu(hashtable, node, key_hash);	
+	rcu_read_lock();
+	hlist_add_head_rcu(node, table_head(rcu_dereference(table), e->key_hash));
+	rcu_read_unlock();
+
+	percpu_counter_inc(&items);
+	resize_check();
 	return 0;
 }
 
-struct ub_entry* ub_hashtbl_find(char* key, size_t len_key)
+/* only entries whose whole hash matches need their keys compared */
+static inline struct ub_entry* chain_find(struct hlist_head* head,
+	uint64_t key_hash, char* key, size_t len_key)
 {
 	struct ub_entry* e;
-	uint64 key_hash;
 
-	// Hash the key down to a form which the kernel hash table can use
-	key_hash = get_spooky64_hash(key, len_key);
-	
-	hash_for_each_possible_rcu(hashtable, e, hlist, key_hash)
+	hlist_for_each_entry_rcu(e, head, hlist)
 	{
-		if (e->len_key != len_key)
+		if (e->key_hash != key_hash || e->len_key != len_key)
 			continue;
 
-		if (!strncmp(key, ub_entry_loc_key(e), len_key))
-		{
+		if (!memcmp(key, ub_entry_loc_key(e), len_key))
 			return e;
-			break;
-		}
 	}
-	
-	// key not found
+
 	return NULL;
 }
 
+struct ub_entry* ub_hashtbl_find(char* key, size_t len_key)
+{
+	return ub_hashtbl_find_hashed(key, len_key, ub_hashtbl_hash(key, len_key));
+}
+
+struct ub_entry* ub_hashtbl_find_hashed(char* key, size_t len_key, 
+	uint64_t key_hash)
+{
+	struct hashtbl_stripe* s = stripe_of(key_hash);
+	struct hashtbl* old;
+	struct ub_entry* e;
+	unsigned int seq;
+
+	/* a hit is always right, but a miss might be because the entry was being
+	   moved between chains, so is only believed if nothing moved meanwhile
+	   (which is always the case if the caller holds the key's lock) */
+	rcu_read_lock();
+	do
+	{
+		seq = read_seqcount_begin(&s->seq);
+
+		e = chain_find(table_head(rcu_dereference(table), key_hash),
+			key_hash, key, len_key);
+		if (e)
+			break;
+
+		old = rcu_dereference(table_old);
+		if (old)
+			e = chain_find(table_head(old, key_hash), key_hash, key, len_key);
+	} while (!e && read_seqcount_retry(&s->seq, seq));
+	rcu_read_unlock();
+
+	return e;
+}
+
+/* only the head of the chain in the current table: the first entry on it
+   can't be found until the head has arrived anyway */
+void ub_hashtbl_prefetch(uint64_t key_hash)
+{
+	rcu_read_lock();
+	prefetch(table_head(rcu_dereference(table), key_hash));
+	rcu_read_unlock();
+}
+
 void ub_hashtbl_del(struct ub_entry* e)
 {
-	hash_del_rcu(&e->hlist);
+	hlist_del_rcu(&e->hlist);
+	percpu_counter_dec(&items);
+	resize_check();
+}
+
+/* the new entry has the same key, so goes on the same chain, in the old 
+   one's place */
+void ub_hashtbl_replace(struct ub_entry* old, struct ub_entry* e)
+{
+	hlist_replace_rcu(&old->hlist, &e->hlist);
 }
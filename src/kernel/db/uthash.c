@@ -1,11 +1,21 @@
 #include <db/hashtable.h>
 #include <entry.h>
 #include <kernel/db/uthash.h>
+#include <linux/prefetch.h>
 #include <linux/slab.h>
 
 static struct ub_entry* hashtable = NULL;
 
-int ub_hashtbl_init(void)
+/* uthash can't be split up, so there is just the one lock for all of it */
+static DEFINE_SPINLOCK(hashtable_lock);
+
+spinlock_t* ub_hashtbl_lock(char* key, size_t len_key)
+{
+	spin_lock(&hashtable_lock);
+	return &hashtable_lock;
+}
+
+int ub_hashtbl_init(size_t max_items)
 {
 	return 0;
 }
@@ -22,6 +32,34 @@ struct ub_entry* ub_hashtbl_find(char* key, size_t len_key)
 	return e;
 }
 
+/* uthash buckets by the low bits of the same hash, so HASH_FIND can be done
+   without it being worked out again */
+struct ub_entry* ub_hashtbl_find_hashed(char* key, size_t len_key, 
+	uint64_t key_hash)
+{
+	struct ub_entry* e = NULL;
+	unsigned bkt;
+
+	if (!hashtable)
+		return NULL;
+
+	HASH_TO_BKT((unsigned) key_hash, hashtable->hh.tbl->num_buckets, bkt);
+	HASH_FIND_IN_BKT(hashtable->hh.tbl, hh, hashtable->hh.tbl->buckets[bkt],
+		key, len_key, e);
+	return e;
+}
+
+void ub_hashtbl_prefetch(uint64_t key_hash)
+{
+	unsigned bkt;
+
+	if (!hashtable)
+		return;
+
+	HASH_TO_BKT((unsigned) key_hash, hashtable->hh.tbl->num_buckets, bkt);
+	prefetch(&hashtable->hh.tbl->buckets[bkt]);
+}
+
 int ub_hashtbl_add(struct ub_entry* e)
 {
 	HASH_ADD_KEYPTR(hh, hashtable, ub_entry_loc_key(e), e->len_key, e);
@@ -34,3 +72,10 @@ void ub_hashtbl_del(struct ub_entry* e)
 	return;
 }
 
+/* lookups hold the same lock as this, so needn't see the change happen at
+   once */
+void ub_hashtbl_replace(struct ub_entry* old, struct ub_entry* e)
+{
+	HASH_DELETE(hh, hashtable, old);
+	HASH_ADD_KEYPTR(hh, hashtable, ub_entry_loc_key(e), e->len_key, e);
+}
@@ -3,35 +3,146 @@
 #include <db/hashtable.h>
 #include <entry.h>
 #include <kernel/net/skbs.h>
+#include <uberrors.h>
 
+#include <linux/rcupdate.h>
 #include <linux/skbuff.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/types.h>
 
-static void ub_cache_del(char* key, size_t len_key)
+/* Unlink a key's entry from the hash table and the LRU, with the key's lock 
+   held. Returns the entry if it should now be freed by the caller, or NULL if 
+   there was none or it is being evicted (the evictor frees it then). */
+static struct ub_entry* entry_unlink(char* key, size_t len_key, int* found)
 {
 	struct ub_entry* e = ub_hashtbl_find(key, len_key);
+
+	*found = (e != NULL);
+	if (!e)
+		return NULL;
+
+	ub_hashtbl_del(e);
+	return ub_buckets_lru_del(&e->lru) ? e : NULL;
+}
+
+static void entry_free_rcu(struct rcu_head* head)
+{
+	struct ub_entry* e = container_of(head, struct ub_entry, rcu);
+
+	kfree_skb(e->skb);
+	ub_buckets_free_chain(e->chain);
+	ub_buckets_free(ub_entry_size(e->len_key, e->len_val), e);
+}
+
+/* Give an unreachable entry's memory back; no locks need be held. Lookups 
+   don't lock at all, so one may still be looking at the entry, and it is only
+   freed once they all must have finished. */
+static void entry_free(struct ub_entry* e)
+{
+	call_rcu(&e->rcu, entry_free_rcu);
+}
+
+/* unlink an entry from the hash table and hand its chunk back to the bucket 
+   allocator so the memory can be reused by the next SET */
+int ub_cache_delete(char* key, size_t len_key)
+{
+	spinlock_t* lock = ub_hashtbl_lock(key, len_key);
+	struct ub_entry* e;
+	int found;
+
+	e = entry_unlink(key, len_key, &found);
+	ub_hashtbl_unlock(lock);
+
 	if (e)
-	{
-		kfree_skb(e->skb);
+		entry_free(e);
+
+	return found ? 0 : -EUBKEYNOTFOUND;
+}
+
+/* The bucket allocator has already taken the entry off its LRU list, so only
+   the hash table needs to be dealt with here; the skb or chain goes in 
+   ub_cache_release. The entry may have been deleted from the hash table in 
+   the meantime, in which case the deleter has left the rest to us. */
+void* ub_cache_evict(struct ub_lru_link* link)
+{
+	struct ub_entry* e = ub_entry_from_lru(link);
+	char* key = ub_entry_loc_key(e);
+	spinlock_t* lock = ub_hashtbl_lock(key, e->len_key);
+
+	if (ub_hashtbl_find_hashed(key, e->len_key, e->key_hash) == e)
 		ub_hashtbl_del(e);
+	ub_hashtbl_unlock(lock);
+
+	return e;
+}
+
+void ub_cache_release(struct ub_lru_link* link)
+{
+	struct ub_entry* e = ub_entry_from_lru(link);
+
+	kfree_skb(e->skb);
+	e->skb = NULL;
+	ub_buckets_free_chain(e->chain);
+	e->chain = NULL;
+}
+
+/* Keep a value whose reply won't fit in one datagram in a chain of chunks. */
+static int entry_set_up_chained(struct ub_entry* e, char* key, size_t len_key,
+	char* val, size_t len_val)
+{
+	struct ub_chunk* c;
+	int err;
+
+	err = ub_buckets_alloc_chain(len_val, &e->chain);
+	if (err)
+		return err;
+
+	e->skb = NULL;
+	e->loc_key = (unsigned char*) (e + 1);
+	e->loc_val = NULL;
+	memcpy(e->loc_key, key, len_key);
+
+	for (c = e->chain; c; c = c->next)
+	{
+		memcpy(ub_chunk_data(c), val, c->len);
+		val += c->len;
 	}
+
+	return 0;
 }
 
+/* The new entry is allocated and filled in before the key is locked, as this
+   may sleep and may evict other entries (which takes their keys' locks). The
+   old entry is only swapped for the new under the lock. */
 int ub_cache_replace(char* key, size_t len_key, char* val, size_t len_val)
 {
 	int err = 0;
 	struct ub_entry* e;
+	struct ub_entry* old;
+	spinlock_t* lock;
 	
-	/* check whether the given key exists already and delete if so */
-	ub_cache_del(key, len_key);
-
 	// TODO: this function should receive a struct entry* not allocate memory here
 	err = ub_buckets_alloc(ub_entry_size(len_key, len_val), (void**) &e);
 	
 	if (err)
 		return err;
+
+	e->key_hash = ub_hashtbl_hash(key, len_key);
+	e->len_key = len_key;
+	e->len_val = len_val;
+	e->chain = NULL;
+
+	if (ub_entry_chained(len_key, len_val))
+	{
+		err = entry_set_up_chained(e, key, len_key, val, len_val);
+		if (err)
+		{
+			ub_buckets_free(ub_entry_size(len_key, len_val), e);
+			return err;
+		}
+		goto add;
+	}
 	
 	/* in the kernel, so need to set up the skb which will store the key and value.
 	   The skb will contain the ASCII header EXACTLY as it will be played back in 
@@ -57,10 +168,10 @@ int ub_cache_replace(char* key, size_t len_key, char* val, size_t len_val)
 		e->skb = ub_skb_set_up(len_key + len_val + len_strlen_valbuf + 18);
 
 		if (unlikely(!e->skb))
+		{
+			ub_buckets_free(ub_entry_size(len_key, len_val), e);
 			return -1;
-		
-		e->len_key = len_key;
-		e->len_val = len_val;
+		}
 		
 		ub_push_data_to_skb(e->skb, "VALUE ", strlen("VALUE "));
 		e->loc_key = ub_push_data_to_skb(e->skb, key, len_key);
@@ -69,11 +180,40 @@ int ub_cache_replace(char* key, size_t len_key, char* val, size_t len_val)
 		ub_push_data_to_skb(e->skb, "\r\nEND\r\n", strlen("\r\nEND\r\n"));
 	}
 
-	/* add the embedded list header into the hash table */
-	return ub_hashtbl_add(e);
+add:
+	ub_hashtbl_reserve(e->key_hash);
+	lock = ub_hashtbl_lock(key, len_key);
+
+	/* An entry already there for the key is swapped for the new one, which 
+	   needs no more room in the table. Otherwise the new entry is added, and
+	   if the table is full, it is dropped and the SET fails. */
+	old = ub_hashtbl_find_hashed(key, len_key, e->key_hash);
+	if (old)
+	{
+		ub_hashtbl_replace(old, e);
+		err = 0;
+		if (!ub_buckets_lru_del(&old->lru))
+			old = NULL; /* being evicted, and the evictor frees it */
+	}
+	else
+		err = ub_hashtbl_add(e);
+
+	if (!err)
+		ub_buckets_lru_add(ub_entry_size(len_key, len_val), &e->lru);
+	ub_hashtbl_unlock(lock);
+
+	if (err)
+		entry_free(e);
+	if (old)
+		entry_free(old);
+
+	return err;
 }
 
-struct ub_entry* ub_cache_find(char* key, size_t len_key)
+/* the caller must hold the key's lock from ub_hashtbl_lock, or be in an RCU 
+   read-side critical section if the hash table allows that, for as long as it
+   uses the entry */
+struct ub_entry* ub_cache_find(char* key, size_t len_key, uint64_t key_hash)
 {
-	return ub_hashtbl_find(key, len_key);
+	return ub_hashtbl_find_hashed(key, len_key, key_hash);
 }
@@ -1,7 +1,11 @@
 #include <abstract.h>
+#include <core.h>
+#include <db/hashtable.h>
+#include <kernel/combine.h>
 #include <net/udpserver.h>
 #include <request.h>
 #include <kernel/net/udpserver_low.h>
+#include <kernel/net/udpserver_rx.h>
 #include <kernel/net/udpserver_send.h>
 #include <unbuckle.h>
 
@@ -249,9 +253,15 @@ struct sk_buff* set_up_skb(struct request_state* req)
 	return skb;
 }
 
+/* The reply is usually one datagram, but may be a list of them linked 
+   through skb->next (see get_reply_chained), numbered in their frame headers
+   as memcached numbers the datagrams of a long reply. */
 int udpserver_sendall(struct request_state* req)
 {
 	struct sk_buff *skb;
+	struct sk_buff *next;
+	int count = 0;
+	int seq;
 
 	if (unlikely(!req)) 
 	{
@@ -284,85 +294,195 @@ int udpserver_sendall(struct request_state* req)
 		}
 	}
 	
-	/* Set up the pointer to the UDP headers before adding them */
-	req->udpheaders = (struct memcache_udp_header*) 
-		skb_push(skb, sizeof(struct memcache_udp_header));
-	add_udp_headers(req);
-	
-	skb->csum = csum_partial(skb->data, skb->len, 0x0);
-	
-	set_up_udp_header(req, skb);
-	set_up_ip_header(req, skb);
-	set_up_eth_header(req, skb);
+	if (unlikely(!skb))
+		return -1;
+	req->skb_tx = NULL;
 
-	if (skb)
+	for (next = skb; next; next = next->next)
+		count++;
+
+	for (seq = 0; skb; seq++, skb = next)
 	{
-		struct sk_buff_head* q = &ub_tx_queues[smp_processor_id()];
-		skb_queue_tail(q, skb);
-		return 0;
+		next = skb->next;
+		skb->next = NULL;
+
+		/* Set up the pointer to the UDP headers before adding them */
+		req->udpheaders = (struct memcache_udp_header*) 
+			skb_push(skb, sizeof(struct memcache_udp_header));
+		add_udp_headers(req);
+		req->udpheaders->seq = htons(seq);
+		req->udpheaders->count = htons(count);
+		
+		skb->csum = csum_partial(skb->data, skb->len, 0x0);
+		
+		set_up_udp_header(req, skb);
+		set_up_ip_header(req, skb);
+		set_up_eth_header(req, skb);
+
+		ub_udpserver_tx_queue(skb);
 	}
-	else
+
+	return 0;
+}
+
+/* Set req up for the request in skb, returning nonzero if it is to be 
+   dropped. The request is parsed (and a SET's value copied into the cache) 
+   straight out of the packet, which is left untouched and kept until the
+   request is done with. Only a request which isn't all in the skb's linear
+   data is copied into recvbuf first: rare for one which fits in a single 
+   frame, but always so for a large SET which arrived in IP fragments. */
+static int rx_set_up_request(struct request_state* req, struct sk_buff* skb)
+{
+	struct ethhdr  *eth;
+	struct iphdr*   iph;
+	struct udphdr*  udph;
+	int offset;
+
+	iph = ip_hdr(skb);
+	udph = (struct udphdr*) ((char*) iph + iph->ihl * 4);
+	offset = (unsigned char*) (udph + 1) - skb->data;
+
+	req->skb_rx = skb;
+	req->udph = udph;
+	req->iph = iph;
+	
+	if (unlikely(ntohs(udph->len) < sizeof(struct udphdr)))
+		return -1;
+	req->len_rdata = ntohs(udph->len) - sizeof(struct udphdr);
+
+	if (unlikely(offset + req->len_rdata > skb->len))
 	{
-		kfree_skb(skb);
+		printk(KERN_WARNING "UDP length seems to be more than SKB length?\n");
 		return -1;
 	}
+	if (unlikely(req->len_rdata > req->len_recvbuf && 
+		offset + req->len_rdata > skb_headlen(skb)))
+		return -1;
+
+	req->recvbuf_cur = skb_header_pointer(skb, offset, req->len_rdata, 
+		req->recvbuf);
+	if (unlikely(!req->recvbuf_cur))
+		return -1;
+	
+	req->saddr = iph->saddr;
+	req->daddr = iph->daddr;
+	
+	eth = (struct ethhdr*) (((char*)iph) - sizeof(struct ethhdr));
+	copy_mac(eth->h_source, req->mac_src, ETH_ALEN);		 
+	
+	req->devrcv = skb->dev;	
+	req->set_combined = 0;
+
+	return 0;
+}
+
+static int rx_ready(void* worker)
+{
+	return ub_udpserver_rx_pending((long) worker);
 }
 
-int do_kernel_rx_worker(struct request_state* req)
+/* Packets are taken off the rings in batches of however many are waiting (up
+   to nreqs), so a lightly loaded worker still handles each as it arrives. A 
+   batch goes through in two passes: the first parses every request and starts
+   the part of the hash table its key hashes to on its way into the cache, and
+   the second does the lookups, which by then should mostly find it there, so
+   that the cache misses of a batch overlap rather than come one after 
+   another. Requests are processed in the order they arrived, except that 
+   when combining, SETs are posted to be applied together with other 
+   workers' (see kernel/combine.c) and answered at the end of the batch. A 
+   request for the same key as a SET still waiting to be applied waits for it
+   first, so nothing overtakes a SET which came before it. The replies go to
+   the TX ring together at the end of the batch, or before waiting for SETs. */
+int do_kernel_rx_worker(struct request_state* reqs, int nreqs)
 {
-	struct sk_buff_head* q = &ub_rx_queues[smp_processor_id() - 2];
+	int worker = smp_processor_id() - UB_FIRST_WORKER_CPU;
+	struct sk_buff* skbs[UB_RX_BATCH];
+	int parsed[UB_RX_BATCH];
+#ifdef STORE_HASHTABLE
+	const char* keys[UB_RX_BATCH];
+	size_t lens[UB_RX_BATCH];
+	uint64_t hashes[UB_RX_BATCH];
+#endif
 	printk("In kernel_rx_worker, SMP id %d\n", smp_processor_id());
+
+	if (nreqs > UB_RX_BATCH)
+		nreqs = UB_RX_BATCH;
 	
 	/* loop waiting for something to do */
 	while (!kthread_should_stop() && ub_sys_running)
 	{
-		struct sk_buff* skb;
-		struct ethhdr  *eth;
-		struct iphdr*   iph;
-		struct udphdr*  udph;
+		int i, n, k, posted = 0;
 
-		if (skb_queue_empty(q))
+		n = ub_udpserver_rx_dequeue(worker, skbs, nreqs);
+		if (!n)
 		{
-			schedule();
+			ub_poller_wait(&ub_rx_pollers[worker], rx_ready, 
+				(void*) (long) worker);
 			continue;
 		}
 
-		/* got some work to do */
-		skb = skb_dequeue(q);
-
-		iph = ip_hdr(skb);
-		udph = (struct udphdr*) ((char*) iph + iph->ihl * 4);
+		for (i = 0, k = 0; i < n; i++)
+		{
+			parsed[i] = !rx_set_up_request(&reqs[i], skbs[i]) &&
+				!process_fastpath_parse(&reqs[i]);
+#ifdef STORE_HASHTABLE
+			if (parsed[i])
+			{
+				keys[k] = (const char*) reqs[i].key;
+				lens[k++] = reqs[i].len_key;
+			}
+#endif
+		}
 
-		skb_pull(skb, iph->ihl * 4);
+		/* the keys are hashed together, which is quicker than one by one
+		   for some hash functions (see ub_keyhash_many) */
+#ifdef STORE_HASHTABLE
+		ub_hashtbl_hash_many(keys, lens, hashes, k);
+		for (i = 0, k = 0; i < n; i++)
+		{
+			if (!parsed[i])
+				continue;
+			reqs[i].key_hash = hashes[k++];
+			ub_hashtbl_prefetch(reqs[i].key_hash);
+		}
+#endif
 
-		req->skb_rx = skb;
-		req->udph = udph;
-		req->iph = iph;
-		
-		req->recvbuf_cur = req->recvbuf;
-		req->len_rdata = ntohs(req->udph->len) - sizeof(struct udphdr);
+		for (i = 0; i < n; i++)
+		{
+			if (!parsed[i])
+				continue;
+
+			if (ub_combine_sets && reqs[i].cmd == cmd_set)
+			{
+				ub_combine_post(worker, &reqs[i]);
+				posted++;
+				continue;
+			}
+
+			if (posted && 
+				ub_combine_pending(worker, reqs[i].key, reqs[i].len_key))
+			{
+				ub_udpserver_tx_flush();
+				ub_combine_wait(worker);
+			}
+			process_fastpath_finish(&reqs[i]);
+		}
 
-		if (unlikely(req->len_rdata > skb->len))
+		if (posted)
 		{
-			printk(KERN_WARNING "UDP length seems to be more than SKB length?\n");
-			goto drop;
+			ub_udpserver_tx_flush();
+			ub_combine_wait(worker);
+			for (i = 0; i < n; i++)
+				if (parsed[i] && reqs[i].set_combined)
+					process_fastpath_finish(&reqs[i]);
 		}
-		skb_copy_bits(skb, sizeof(struct udphdr), req->recvbuf, req->len_rdata);
-		
-		req->saddr = iph->saddr;
-		req->daddr = iph->daddr;
-		
-		eth = (struct ethhdr*) (((char*)iph) - sizeof(struct ethhdr));
-		copy_mac(eth->h_source, req->mac_src, ETH_ALEN);		 
-		
-		req->devrcv = skb->dev;	
-		
-		process_fastpath(req);
-		
-		/* Fallthrough to make sure the SKB gets freed. We are done with it */
-drop:
-		kfree_skb(skb);
-		continue;
+
+		/* Dropped requests too, to make sure the SKB gets freed. The replies 
+		   have been built from their headers, so we are done with them */
+		for (i = 0; i < n; i++)
+			kfree_skb(skbs[i]);
+
+		ub_udpserver_tx_flush();
 	}
 
 	return 0;
@@ -1,16 +1,24 @@
+#include <db/hashtable.h>
+#include <kernel/compat.h>
 #include <kernel/locks.h>
 #include <kernel/net/udpserver_low.h>
+#include <kernel/ring.h>
 #include <net/udpserver.h>
+#include <prot/memcached.h>
 #include <unbuckle.h>
 
+#include <linux/bitops.h>
 #include <linux/cpumask.h>
 #include <linux/ip.h>
+#include <linux/kernel.h>
 #include <linux/netdevice.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
+#include <linux/percpu.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/socket.h>
-#include <linux/spinlock.h>
+#include <linux/topology.h>
 #include <linux/udp.h>
 #include <linux/workqueue.h>
 
@@ -23,9 +31,32 @@ struct ub_bh_work
 };
 
 //static struct workqueue_struct* wq;
-static volatile int thread_to_use = 0;
-struct sk_buff_head ub_rx_queues[MAX_WORKERS];
-static DEFINE_SPINLOCK(irq_lock);
+struct ub_poller ub_rx_pollers[MAX_WORKERS];
+
+/* Each worker has a ring for each CPU, which only the netfilter hook on that
+   CPU puts packets on, so that every ring has just the one producer and the
+   one consumer. In local mode only the worker's own CPU's ring is used. 
+   
+   So that the worker needn't look at every CPU's ring to find the few with
+   anything on them, the hook also sets the bit for its CPU in the worker's 
+   pending mask when it puts packets on the ring, if it isn't already set, 
+   and the worker clears it before taking from the ring (putting it back if
+   it leaves some behind). Each side has a full barrier between its write to
+   the ring and its look at the bit, or the other way round, so that either 
+   the hook sees the bit cleared and sets it again, or the worker sees the 
+   packet. The mask's line only moves between CPUs when a ring goes from 
+   empty to not. */
+struct rx_worker_rings {
+	struct ub_ring** rings; /* by the CPU the packets arrived on           */
+	unsigned long* pending; /* the CPUs whose rings may have packets on    */
+	int next;               /* the CPU to take packets from first next time */
+} ____cacheline_aligned_in_smp;
+
+static struct rx_worker_rings rx_rings[MAX_WORKERS];
+
+/* the next worker in turn for requests arriving on this CPU, in round robin
+   mode */
+static DEFINE_PER_CPU(unsigned int, rr_next);
 
 void
 ub_udp_rcv(struct work_struct* work)
@@ -69,18 +100,87 @@ drop:
 	return;
 }
 
+/* enough of a request to find any key memcached allows (250 bytes), after
+   the binary header and the extras a SET has */
+#define UB_STEER_PEEK 320
+
+/* In shard mode, each worker owns the keys which ub_hashtbl_shard gives it,
+   and every request for a key goes to its owner. The workers then don't take
+   each other's hash table locks (but for the cuckoo table's second buckets),
+   so the locks and the parts of the table behind them stay in their own 
+   caches, and a GET never waits on a SET to the same key on another core. 
+   Popular keys all land on one worker, though, which is why this isn't the
+   default. Only as much of the request as is needed to find the key is 
+   looked at here; the worker parses (and hashes) it properly. Returns the 
+   worker to use, or -1 if no key was found, in which case the request is 
+   steered like any other. */
+static int steer_by_key(struct sk_buff* skb, struct udphdr* udp)
+{
+	unsigned char buf[UB_STEER_PEEK];
+	const unsigned char* data;
+	const unsigned char* key;
+	int len_data = ntohs(udp->len) - sizeof(struct udphdr);
+	int len_key;
+
+	if (len_data > UB_STEER_PEEK)
+		len_data = UB_STEER_PEEK;
+	if (len_data <= 0)
+		return -1;
+
+	data = skb_header_pointer(skb, 
+		(unsigned char*) (udp + 1) - skb->data, len_data, buf);
+	if (!data)
+		return -1;
+
+	len_key = memcached_peek_key(data, len_data, &key);
+	if (len_key < 0)
+		return -1;
+
+	return ub_hashtbl_shard(ub_hashtbl_hash((char*) key, len_key),
+		ub_num_rx_workers);
+}
+
+/* The hook runs in the softirq of the CPU the packet arrived on, so in local
+   mode the request is handled on the same core as the packet was received, 
+   its data still in the cache and the ring it goes on never leaving it. A CPU
+   without a worker (such as the first few, or any past the last worker) 
+   hands its packets out by flow instead, which keeps each client's requests
+   with one worker and so in order. Nothing here is shared between CPUs but
+   the ring the request goes on. */
+static int steer_to_worker(struct sk_buff* skb)
+{
+	int worker;
+
+	switch (ub_rx_steer)
+	{
+	case UB_STEER_ROUND_ROBIN:
+		return this_cpu_inc_return(rr_next) % ub_num_rx_workers;
+
+	case UB_STEER_LOCAL:
+		worker = smp_processor_id() - UB_FIRST_WORKER_CPU;
+		if (worker >= 0 && worker < ub_num_rx_workers)
+			return worker;
+		break;
+
+	case UB_STEER_RX_QUEUE:
+		if (skb_rx_queue_recorded(skb))
+			return skb_get_rx_queue(skb) % ub_num_rx_workers;
+		break;
+	}
+
+	/* the NIC's RSS hash where it gave one, or else one worked out from the
+	   addresses and ports */
+	return reciprocal_scale(skb_get_hash(skb), ub_num_rx_workers);
+}
+
 unsigned int
-ub_udpserver_nethook_callback(
-	unsigned int hooknum,
-	struct sk_buff* skb,
-	const struct net_device* in,
-	const struct net_device* out,
-	int (*okfn)(struct sk_buff*))
+ub_udpserver_nethook_callback(UB_NF_HOOK_ARGS(skb))
 {
 	//struct ub_bh_work* wrk = kmalloc(sizeof(struct ub_bh_work), GFP_ATOMIC);
 	struct iphdr*  iph;
 	struct udphdr* udp;
-	unsigned long flags;
+	int worker;
+	int cpu;
 	
 	/* Check the packet is UDP */
 	iph = ip_hdr(skb);
@@ -99,10 +199,9 @@ ub_udpserver_nethook_callback(
 	
 	udp = (struct udphdr*) ((char*) ip_hdr(skb) + iph->ihl * 4);
 	
-	/* Catch packets not for us early and also don't process anything larger than 
-	   one MTU at the moment (might be able to at this level of the stack as we 
-	   are called after IP defragmentation occurs */
-	if (ntohs(udp->dest) != UDP_PORT || ntohs(udp->len) > 1400)
+	/* Catch packets not for us early. We are called after IP defragmentation,
+	   so a request larger than one MTU arrives here whole. */
+	if (ntohs(udp->dest) != UDP_PORT)
 		return NF_ACCEPT;
 	
 	//wrk->skb = skb;
@@ -112,25 +211,120 @@ ub_udpserver_nethook_callback(
 	//queue_work(wq, &wrk->work);	
 	//ub_udp_rcv(&wrk->work);
 
-	/* queue the work up for thread_to_use */
-	spin_lock_irqsave(&irq_lock, flags);
-	if (thread_to_use == ub_num_rx_workers - 1)
+	if (!ub_shard_by_key || (worker = steer_by_key(skb, udp)) < 0)
+		worker = steer_to_worker(skb);
+
+	/* the hook normally runs in a softirq, but makes sure nothing else on 
+	   this CPU can get at the ring at the same time should it not */
+	local_bh_disable();
+	cpu = smp_processor_id();
+	if (ub_ring_enqueue(rx_rings[worker].rings[cpu], (void**) &skb, 1))
 	{
-		/* wrap around */
-		thread_to_use = 0;
+		smp_mb();
+		if (!test_bit(cpu, rx_rings[worker].pending))
+			set_bit(cpu, rx_rings[worker].pending);
 	}
 	else
-		thread_to_use++;
-	skb_queue_tail(&ub_rx_queues[thread_to_use], skb);
-	spin_unlock_irqrestore(&irq_lock, flags);
+		kfree_skb(skb);
+	local_bh_enable();
 
+	ub_poller_wake(&ub_rx_pollers[worker]);
 	return NF_STOLEN;
 }
 
+/* take what there is on one CPU's ring, which its bit said there might be */
+static int rx_take(struct rx_worker_rings* w, int cpu, struct sk_buff** skbs,
+	int max)
+{
+	struct ub_ring* r = w->rings[cpu];
+	int n;
+
+	/* a full barrier, so that the ring is looked at after the bit clears */
+	test_and_clear_bit(cpu, w->pending);
+
+	n = ub_ring_dequeue(r, (void**) skbs, max);
+	if (!ub_ring_empty(r))
+		set_bit(cpu, w->pending);
+	return n;
+}
+
+/* Takes from each CPU's ring with packets on it in turn, starting after where
+   it left off last time, so that no CPU's packets wait behind a steady 
+   stream from another. Only the rings whose bits are set are looked at. */
+int ub_udpserver_rx_dequeue(int worker, struct sk_buff** skbs, int max)
+{
+	struct rx_worker_rings* w = &rx_rings[worker];
+	int start = w->next;
+	int cpu = start;
+	int n = 0;
+
+	for_each_set_bit_from(cpu, w->pending, nr_cpu_ids)
+	{
+		n += rx_take(w, cpu, skbs + n, max - n);
+		if (n == max)
+			goto full;
+	}
+	cpu = 0;
+	for_each_set_bit_from(cpu, w->pending, start)
+	{
+		n += rx_take(w, cpu, skbs + n, max - n);
+		if (n == max)
+			goto full;
+	}
+	return n;
+
+full:
+	w->next = cpu + 1 < nr_cpu_ids ? cpu + 1 : 0;
+	return n;
+}
+
+int ub_udpserver_rx_pending(int worker)
+{
+	return find_first_bit(rx_rings[worker].pending, nr_cpu_ids) < nr_cpu_ids;
+}
+
+/* Once the hook is gone and the workers have stopped, free whatever is still 
+   on the rings, and the rings. */
+void ub_udpserver_netstack_free(void)
+{
+	unsigned long drops = 0;
+	int worker, cpu;
+
+	for (worker = 0; worker < MAX_WORKERS; worker++)
+	{
+		struct ub_ring** rings = rx_rings[worker].rings;
+
+		kfree(rx_rings[worker].pending);
+		rx_rings[worker].pending = NULL;
+		if (!rings)
+			continue;
+
+		for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		{
+			struct sk_buff* skb;
+
+			if (!rings[cpu])
+				continue;
+
+			while (ub_ring_dequeue(rings[cpu], (void**) &skb, 1))
+				kfree_skb(skb);
+			drops += ub_ring_drops(rings[cpu]);
+			ub_ring_free(rings[cpu]);
+		}
+
+		kfree(rings);
+		rx_rings[worker].rings = NULL;
+	}
+
+	if (drops)
+		printk(KERN_INFO "[Unbuckle] %lu requests dropped for want of room on "
+			"the RX rings.\n", drops);
+}
+
 static struct nf_hook_ops hook = 
 {
-	.hook     = (nf_hookfn*) ub_udpserver_nethook_callback,
-	.owner    = THIS_MODULE,
+	.hook     = ub_udpserver_nethook_callback,
+	UB_NF_HOOK_OWNER
 	.pf       = PF_INET,
 	.hooknum  = NF_INET_LOCAL_IN, 
 	.priority = NF_IP_PRI_LAST, /* don't bypass firewall rules */
@@ -138,23 +332,46 @@ static struct nf_hook_ops hook =
 
 int ub_udpserver_netstack_register(void)
 {
-	/* set up the receive queue sk_buff structs */
-	int cpu;
-	for (cpu = 0; cpu < ub_num_rx_workers; cpu++)
-		skb_queue_head_init(&ub_rx_queues[cpu]);
+	/* set up the receive rings, on the node of the worker taking from them */
+	int worker, cpu;
+	for (worker = 0; worker < ub_num_rx_workers; worker++)
+	{
+		int node = cpu_to_node(UB_FIRST_WORKER_CPU + worker);
+
+		ub_poller_init(&ub_rx_pollers[worker]);
+		rx_rings[worker].next = 0;
+		rx_rings[worker].rings = kzalloc_node(
+			nr_cpu_ids * sizeof(struct ub_ring*), GFP_KERNEL, node);
+		rx_rings[worker].pending = kzalloc_node(
+			BITS_TO_LONGS(nr_cpu_ids) * sizeof(unsigned long), GFP_KERNEL, node);
+		if (!rx_rings[worker].rings || !rx_rings[worker].pending)
+			goto nomem;
+
+		for_each_possible_cpu(cpu)
+		{
+			rx_rings[worker].rings[cpu] = 
+				ub_ring_alloc(UB_RX_RING_SIZE, node);
+			if (!rx_rings[worker].rings[cpu])
+				goto nomem;
+		}
+	}
 
 	printk(KERN_ALERT "[Unbuckle] Registering the netfilter hooks.\n");
-	nf_register_hook(&hook);
+	ub_nf_register_hook(&hook);
 	
 	/* piggy back here for now and create the workqueue */
 	//wq = alloc_workqueue("unbuckle", WQ_UNBOUND, 0);
 	
 	return 0;
+
+nomem:
+	ub_udpserver_netstack_free();
+	return -ENOMEM;
 }
 int ub_udpserver_netstack_unregister(void)
 {
 	printk(KERN_ALERT "[Unbuckle] Unregistering the netfilter hooks.\n");
-	nf_unregister_hook(&hook);
+	ub_nf_unregister_hook(&hook);
 
 	return 0;
 }
@@ -5,12 +5,24 @@
 #include <linux/skbuff.h>
 #include <linux/udp.h>
 #include <linux/workqueue.h>
+#include <kernel/poll.h>
 #include <unbuckle.h>
 
-extern struct sk_buff_head ub_rx_queues[MAX_WORKERS];
+/* most requests waiting for a worker from any one CPU */
+#define UB_RX_RING_SIZE 256
+
+/* what each RX worker waits on when its rings are empty */
+extern struct ub_poller ub_rx_pollers[MAX_WORKERS];
 
 int ub_udpserver_netstack_register(void);
 int ub_udpserver_netstack_unregister(void);
+/* frees the RX rings, once the workers have stopped */
+void ub_udpserver_netstack_free(void);
+
+/* for RX worker number worker only: take up to max packets off its rings, 
+   returning how many, and whether there are any waiting */
+int ub_udpserver_rx_dequeue(int worker, struct sk_buff** skbs, int max);
+int ub_udpserver_rx_pending(int worker);
 
 void ub_udp_rcv(struct work_struct*);
 
@@ -3,6 +3,11 @@
 
 #include <request.h>
 
-int do_kernel_rx_worker(struct request_state* req);
+/* most packets a worker takes off its queue at once (see do_kernel_rx_worker) */
+#define UB_RX_BATCH 16
+
+/* reqs is an array of nreqs (no more than UB_RX_BATCH) request states, each 
+   with its own receive buffer */
+int do_kernel_rx_worker(struct request_state* reqs, int nreqs);
 
 #endif
@@ -1,86 +1,278 @@
+#include <kernel/compat.h>
 #include <kernel/net/udpserver_send.h>
+#include <kernel/poll.h>
+#include <kernel/ring.h>
 #include <unbuckle.h>
 
+#include <linux/bottom_half.h>
 #include <linux/kthread.h>
 #include <linux/netdevice.h>
+#include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/skbuff.h>
-#include <linux/spinlock.h>
+#include <linux/slab.h>
+#include <linux/topology.h>
 
-struct sk_buff_head ub_tx_queues[MAX_CPUS];
-static struct task_struct* txworker;
-static struct task_struct* txworker2;
+/* In UB_TX_THREADS mode, each CPU's replies go on a ring of its own, which
+   only the RX worker on that CPU puts replies on and only one of the TX
+   workers (the one for the CPU's parity) takes them off. There is a ring for
+   every CPU there could be. */
+static struct ub_ring** tx_rings;
+static struct task_struct* txworkers[UB_TX_WORKERS];
+/* one for each TX worker */
+static struct ub_poller tx_pollers[UB_TX_WORKERS];
 
-static int nictxworker_run(void)
+/* replies waiting to go on this CPU's ring, or out, so they go together */
+struct tx_batch {
+	struct sk_buff* skbs[UB_TX_BATCH];
+	int n;
+};
+static DEFINE_PER_CPU(struct tx_batch, tx_batches);
+
+static int tx_ready(void* data)
 {
+	int id = (struct ub_poller*) data - tx_pollers;
+	int cpu;
+
+	for (cpu = id; cpu < nr_cpu_ids; cpu += UB_TX_WORKERS)
+		if (tx_rings[cpu] && !ub_ring_empty(tx_rings[cpu]))
+			return 1;
+	return 0;
+}
+
+static int nictxworker_run(void* data)
+{
+	struct ub_poller* poller = data;
+	int id = poller - tx_pollers;
 	int err = 0;
 
 	while (!kthread_should_stop() && ub_sys_running)
 	{
 		int cpu;
 		int workdone = 0;
-		for (cpu = 0; cpu < MAX_CPUS; cpu++)
+		for (cpu = id; cpu < nr_cpu_ids; cpu += UB_TX_WORKERS)
 		{
-			struct sk_buff_head* q = &ub_tx_queues[cpu];
-			if (!skb_queue_empty(q))
-			{
-				/* data to be transmitted */
-				struct sk_buff* skb = skb_dequeue(q);
+			struct sk_buff* skbs[UB_TX_BATCH];
+			int i, n;
+
+			if (!tx_rings[cpu])
+				continue;
+
+			/* data to be transmitted */
+			n = ub_ring_dequeue(tx_rings[cpu], (void**) skbs, UB_TX_BATCH);
+			if (n)
 				workdone = 1;
-				if (skb)
-				{
-					err = dev_queue_xmit(skb);
-					err = net_xmit_eval(err);
-				}
+			for (i = 0; i < n; i++)
+			{
+				err = dev_queue_xmit(skbs[i]);
+				err = net_xmit_eval(err);
 			}
 		}
 		if (workdone == 0)
-			schedule();
+			ub_poller_wait(poller, tx_ready, poller);
 	}
 
 	return 0;
 }
 
-void ub_udpserver_nictxworker_init(void)
+/* Send a run of replies for the same device straight to the driver, on the
+   CPU's own queue of the device, taking its TX lock once for the lot and
+   telling the driver that more are coming (xmit_more) for all but the last,
+   so that it need only tell the NIC once. Like pktgen, this skips the qdisc
+   and the checks dev_queue_xmit makes on the way, which the replies (linear,
+   with their checksums already worked out) don't need. Whatever the queue
+   won't take goes through dev_queue_xmit instead.
+
+   If the queue stops taking replies part way through a run, the last one it
+   took was sent with xmit_more, so the NIC may not yet have been told about
+   it or those before it. A driver which stops its own queue tells the NIC as
+   it does so (drivers check netif_xmit_stopped alongside xmit_more for just
+   this), and the queue can't be frozen while its TX lock is held here. That
+   leaves a driver which turned a reply down (busy) with its queue running:
+   it is offered that reply again, on the same queue and marked as the last,
+   so that taking it tells the NIC about the lot. */
+static void xmit_bypass(struct net_device* dev, struct sk_buff** skbs, int n)
 {
-	/* initialise skbuff queue heads */
+	struct netdev_queue* txq;
 	int cpu;
-	for (cpu = 0; cpu < MAX_CPUS; cpu++)
-		skb_queue_head_init(&ub_tx_queues[cpu]);
+	u16 queue;
+	int i;
 
-	txworker = kthread_create((void*) nictxworker_run, NULL, "unbuckletx1");
+	local_bh_disable();
+	cpu = smp_processor_id();
+	queue = cpu % dev->real_num_tx_queues;
+	txq = netdev_get_tx_queue(dev, queue);
 
-	if (txworker)
+	HARD_TX_LOCK(dev, txq, cpu);
+	for (i = 0; i < n; i++)
 	{
-		/* the first CPU core is reserved for us */
-		kthread_bind(txworker, 0);
-		get_task_struct(txworker);
-		wake_up_process(txworker);
+		if (netif_xmit_frozen_or_drv_stopped(txq))
+			break;
+
+		skb_set_queue_mapping(skbs[i], queue);
+		if (!dev_xmit_complete(
+			netdev_start_xmit(skbs[i], dev, txq, i + 1 < n)))
+			break;
 	}
+	if (i > 0 && i < n && !netif_xmit_frozen_or_drv_stopped(txq) &&
+		dev_xmit_complete(netdev_start_xmit(skbs[i], dev, txq, false)))
+		i++;
+	HARD_TX_UNLOCK(dev, txq);
+	local_bh_enable();
 
-	txworker2 = kthread_create((void*) nictxworker_run, NULL, "unbuckletx2");
+	for (; i < n; i++)
+		dev_queue_xmit(skbs[i]);
+}
 
-	if (txworker2)
+static void xmit_batch(struct sk_buff** skbs, int n)
+{
+	int i, j;
+
+	if (ub_tx_mode == UB_TX_DIRECT)
 	{
-		/* the first CPU core is reserved for us */
-		kthread_bind(txworker2, 1);
-		get_task_struct(txworker2);
-		wake_up_process(txworker2);
+		for (i = 0; i < n; i++)
+			dev_queue_xmit(skbs[i]);
+		return;
+	}
+
+	/* replies all normally go out of the one device, but not necessarily */
+	for (i = 0; i < n; i = j)
+	{
+		for (j = i + 1; j < n; j++)
+			if (skbs[j]->dev != skbs[i]->dev)
+				break;
+		xmit_bypass(skbs[i]->dev, skbs + i, j - i);
 	}
-	return;
 }
-void ub_udpserver_nictxworker_exit(void)
+
+void ub_udpserver_tx_flush(void)
+{
+	int cpu = smp_processor_id();
+	struct tx_batch* b = this_cpu_ptr(&tx_batches);
+	int i, done;
+
+	if (!b->n)
+		return;
+
+	if (ub_tx_mode != UB_TX_THREADS)
+	{
+		xmit_batch(b->skbs, b->n);
+		b->n = 0;
+		return;
+	}
+
+	done = ub_ring_enqueue(tx_rings[cpu], (void**) b->skbs, b->n);
+	for (i = done; i < b->n; i++)
+		kfree_skb(b->skbs[i]);
+	b->n = 0;
+
+	ub_poller_wake(&tx_pollers[cpu % UB_TX_WORKERS]);
+}
+
+void ub_udpserver_tx_queue(struct sk_buff* skb)
+{
+	struct tx_batch* b = this_cpu_ptr(&tx_batches);
+
+	b->skbs[b->n++] = skb;
+	if (b->n == UB_TX_BATCH)
+		ub_udpserver_tx_flush();
+}
+
+static void tx_rings_free(void)
 {
-	if (txworker)
+	unsigned long drops = 0;
+	int cpu;
+
+	if (!tx_rings)
+		return;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
 	{
-		kthread_stop(txworker);
-		put_task_struct(txworker);
+		struct sk_buff* skb;
+
+		if (!tx_rings[cpu])
+			continue;
+
+		while (ub_ring_dequeue(tx_rings[cpu], (void**) &skb, 1))
+			kfree_skb(skb);
+		drops += ub_ring_drops(tx_rings[cpu]);
+		ub_ring_free(tx_rings[cpu]);
 	}
 
-	if (txworker2)
+	kfree(tx_rings);
+	tx_rings = NULL;
+
+	if (drops)
+		printk(KERN_INFO "[Unbuckle] %lu replies dropped for want of room on "
+			"the TX rings.\n", drops);
+}
+
+/* The TX workers and their rings are only needed in UB_TX_THREADS mode;
+   otherwise each RX worker sends its own replies. */
+int ub_udpserver_nictxworker_init(void)
+{
+	int cpu, i;
+
+	if (ub_tx_mode != UB_TX_THREADS)
+		return 0;
+
+	tx_rings = kcalloc(nr_cpu_ids, sizeof(struct ub_ring*), GFP_KERNEL);
+	if (!tx_rings)
+		return -ENOMEM;
+
+	/* each ring lives on the node of the CPU whose worker fills it */
+	for_each_possible_cpu(cpu)
 	{
-		kthread_stop(txworker2);
-		put_task_struct(txworker2);
+		tx_rings[cpu] = ub_ring_alloc(UB_TX_RING_SIZE, cpu_to_node(cpu));
+		if (!tx_rings[cpu])
+		{
+			tx_rings_free();
+			return -ENOMEM;
+		}
 	}
+
+	for (i = 0; i < UB_TX_WORKERS; i++)
+	{
+		char name[15];
+
+		ub_poller_init(&tx_pollers[i]);
+
+		snprintf(name, 15, "unbuckletx%d", i + 1);
+		txworkers[i] = kthread_create(nictxworker_run, &tx_pollers[i], name);
+		if (IS_ERR(txworkers[i]))
+		{
+			txworkers[i] = NULL;
+			continue;
+		}
+
+		/* the first CPU cores are reserved for us */
+		kthread_bind(txworkers[i], i);
+		get_task_struct(txworkers[i]);
+		wake_up_process(txworkers[i]);
+	}
+
+	return 0;
+}
+
+void ub_udpserver_nictxworker_exit(void)
+{
+	int i;
+
+	for (i = 0; i < UB_TX_WORKERS; i++)
+	{
+		char name[15];
+
+		if (!txworkers[i])
+			continue;
+
+		kthread_stop(txworkers[i]);
+		put_task_struct(txworkers[i]);
+		txworkers[i] = NULL;
+
+		snprintf(name, 15, "unbuckletx%d", i + 1);
+		ub_poller_report(&tx_pollers[i], name);
+	}
+
+	tx_rings_free();
 	return;
 }
@@ -1,21 +1,31 @@
 #ifndef UB_UDPSERVER_SEND
 #define UB_UDPSERVER_SEND
 
-/* This header defines a thread which will be the sole process which deals with 
-   sending packets into the NIC's send buffers, thereby avoiding lock contention
-   by having all the workers invoke TX themselves (dev_queue_xmit has to acquire
-   a TX lock when it invokes transmission which obviously delays more useful 
-   work being done) */
+/* How replies get to the NIC, by ub_tx_mode. By default each RX worker
+   sends its own replies, a batch at a time, so that a reply is sent from the
+   core which built it and there is no limit to how many can go out at once
+   but the number of workers; UB_TX_BYPASS goes further and hands them
+   straight to the driver on the CPU's own TX queue. UB_TX_THREADS keeps the
+   original design, in which two TX workers are the only threads sending
+   packets, so that the RX workers never wait on a TX lock (dev_queue_xmit
+   has to acquire one when it invokes transmission). */
 
 #include <linux/skbuff.h>
-#include <linux/spinlock.h>
 
-#define MAX_CPUS	32
+#define UB_TX_WORKERS    2
+#define UB_TX_RING_SIZE  1024 /* most replies waiting to go from any one CPU */
+#define UB_TX_BATCH      16   /* most replies put on or taken off at once    */
 
-extern struct sk_buff_head ub_tx_queues[MAX_CPUS];
-
-/* control functions for starting and stopping the TX worker thread */
-void ub_udpserver_nictxworker_init(void);
+/* control functions for starting and stopping the TX worker threads, which
+   do nothing unless in UB_TX_THREADS mode */
+int ub_udpserver_nictxworker_init(void);
 void ub_udpserver_nictxworker_exit(void);
 
+/* Hand a reply over to be sent. Replies are held back and sent (or put on
+   the CPU's ring) in batches, so the RX worker calls ub_udpserver_tx_flush
+   once it has nothing more to send for now. Both are for the CPU's RX worker
+   only. */
+void ub_udpserver_tx_queue(struct sk_buff* skb);
+void ub_udpserver_tx_flush(void);
+
 #endif
@@ -0,0 +1,76 @@
+#include <kernel/compat.h>
+#include <kernel/poll.h>
+#include <unbuckle.h>
+
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+void ub_poller_init(struct ub_poller* p)
+{
+	init_waitqueue_head(&p->wait);
+	p->start_ns = ktime_get_ns();
+	p->poll_ns = 0;
+	p->sleep_ns = 0;
+	p->sleeps = 0;
+}
+
+static inline int should_stop(void)
+{
+	return kthread_should_stop() || !ub_sys_running;
+}
+
+/* Polling gives the CPU up now and then (and so lets RCU see the worker pass
+   through a quiescent state); with UB_POLL_SPIN, polling is all it does,
+   much as the workers always used to. Going to sleep puts the worker on the
+   wait queue before it looks for work one last time, so that work given it
+   after that look always finds it there to be woken. */
+void ub_poller_wait(struct ub_poller* p, int (*ready)(void*), void* arg)
+{
+	u64 start = ktime_get_ns();
+	u64 now = start;
+	int found;
+
+	if (ub_poll_mode == UB_POLL_SPIN)
+	{
+		schedule();
+		p->poll_ns += ktime_get_ns() - start;
+		return;
+	}
+
+	if (ub_poll_mode == UB_POLL_HYBRID)
+	{
+		u64 deadline = start + (u64) ub_poll_usecs * NSEC_PER_USEC;
+
+		while (!(found = ready(arg)) && !should_stop())
+		{
+			now = ktime_get_ns();
+			if (now >= deadline)
+				break;
+			cpu_relax();
+			cond_resched();
+		}
+		p->poll_ns += now - start;
+
+		if (found || should_stop())
+			return;
+	}
+
+	wait_event_interruptible(p->wait, ready(arg) || should_stop());
+	p->sleep_ns += ktime_get_ns() - now;
+	p->sleeps++;
+}
+
+void ub_poller_report(struct ub_poller* p, const char* name)
+{
+	u64 total = ktime_get_ns() - p->start_ns;
+	u64 idle = p->poll_ns + p->sleep_ns;
+	u64 busy = total > idle ? total - idle : 0;
+
+	printk(KERN_INFO "[Unbuckle] %s was busy for %llu ms, polled for %llu ms "
+		"and slept for %llu ms (%lu times).\n", name,
+		busy / NSEC_PER_MSEC, p->poll_ns / NSEC_PER_MSEC,
+		p->sleep_ns / NSEC_PER_MSEC, p->sleeps);
+}
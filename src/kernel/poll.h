@@ -0,0 +1,43 @@
+#ifndef UB_KERNEL_POLL_H
+#define UB_KERNEL_POLL_H
+
+/* How the RX and TX workers wait for something to do: by polling, by going
+   to sleep until whoever gives them work wakes them, or by polling for a
+   while and then going to sleep (see the poll and pollus module parameters).
+   Each worker has a poller of its own, which also keeps count of how long
+   the worker spent in each state. */
+
+#include <unbuckle.h>
+
+#include <linux/types.h>
+#include <linux/wait.h>
+
+struct ub_poller {
+	wait_queue_head_t wait;
+	u64 start_ns;          /* when the worker started                  */
+	u64 poll_ns;           /* spent polling with nothing to do         */
+	u64 sleep_ns;          /* spent asleep                             */
+	unsigned long sleeps;
+};
+
+void ub_poller_init(struct ub_poller* p);
+/* Return once ready(arg) is true, or the worker is to stop, or (when only
+   polling) at the latest after giving up the CPU once. ready may be called
+   any number of times. */
+void ub_poller_wait(struct ub_poller* p, int (*ready)(void*), void* arg);
+/* log how the worker's time was spent, once it has stopped */
+void ub_poller_report(struct ub_poller* p, const char* name);
+
+/* Called after giving the worker work, which must be visible before looking
+   for it asleep, as it looks for work again after saying it is asleep. */
+static inline void ub_poller_wake(struct ub_poller* p)
+{
+	if (ub_poll_mode == UB_POLL_SPIN)
+		return;
+
+	smp_mb();
+	if (waitqueue_active(&p->wait))
+		wake_up(&p->wait);
+}
+
+#endif
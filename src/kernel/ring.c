@@ -0,0 +1,22 @@
+#include <kernel/ring.h>
+
+#include <linux/log2.h>
+#include <linux/slab.h>
+
+struct ub_ring* ub_ring_alloc(unsigned int size, int node)
+{
+	struct ub_ring* r;
+
+	size = roundup_pow_of_two(size);
+	r = kzalloc_node(sizeof(*r) + size * sizeof(void*), GFP_KERNEL, node);
+	if (!r)
+		return NULL;
+
+	r->mask = size - 1;
+	return r;
+}
+
+void ub_ring_free(struct ub_ring* r)
+{
+	kfree(r);
+}
@@ -0,0 +1,105 @@
+#ifndef UB_KERNEL_RING_H
+#define UB_KERNEL_RING_H
+
+/* A bounded ring of pointers with one producer and one consumer, which
+   hand things over without either taking a lock. Each end keeps its index
+   (and its last look at the other's) on a cache line of its own, so the
+   only lines which move between the two CPUs are the slots themselves and
+   the other end's index when the cached look at it runs out. Things are put
+   in and taken out in batches, with one publication of the index for the
+   lot. A producer which finds the ring full counts what it couldn't put in
+   as dropped, and it is up to the producer to free it. */
+
+#include <kernel/compat.h>
+
+#include <linux/cache.h>
+#include <linux/compiler.h>
+#include <linux/kernel.h>
+#include <asm/barrier.h>
+
+struct ub_ring {
+	/* the consumer's */
+	unsigned int head ____cacheline_aligned_in_smp;
+	unsigned int tail_seen;
+
+	/* the producer's */
+	unsigned int tail ____cacheline_aligned_in_smp;
+	unsigned int head_seen;
+	unsigned long drops;
+
+	/* neither changes once the ring is set up */
+	unsigned int mask ____cacheline_aligned_in_smp;
+	void* slots[];
+};
+
+/* size is rounded up to a power of two; returns NULL if out of memory */
+struct ub_ring* ub_ring_alloc(unsigned int size, int node);
+void ub_ring_free(struct ub_ring* r);
+
+/* May be called from anywhere, but only the consumer can rely on what it
+   says, and then only that the ring has something in it. */
+static inline int ub_ring_empty(const struct ub_ring* r)
+{
+	return READ_ONCE(r->head) == READ_ONCE(r->tail);
+}
+
+/* By the producer only. Returns how many of the n things were put in; the
+   rest are counted as dropped. */
+static inline unsigned int ub_ring_enqueue(struct ub_ring* r, void** things,
+	unsigned int n)
+{
+	unsigned int tail = r->tail;
+	unsigned int room = r->mask + 1 - (tail - r->head_seen);
+	unsigned int i;
+
+	if (room < n)
+	{
+		r->head_seen = smp_load_acquire(&r->head);
+		room = r->mask + 1 - (tail - r->head_seen);
+		if (room < n)
+		{
+			r->drops += n - room;
+			n = room;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		r->slots[(tail + i) & r->mask] = things[i];
+	smp_store_release(&r->tail, tail + n);
+
+	return n;
+}
+
+/* By the consumer only. Returns how many things (up to max) were taken out
+   into things. */
+static inline unsigned int ub_ring_dequeue(struct ub_ring* r, void** things,
+	unsigned int max)
+{
+	unsigned int head = r->head;
+	unsigned int n = r->tail_seen - head;
+	unsigned int i;
+
+	if (n == 0)
+	{
+		r->tail_seen = smp_load_acquire(&r->tail);
+		n = r->tail_seen - head;
+		if (n == 0)
+			return 0;
+	}
+
+	if (n > max)
+		n = max;
+	for (i = 0; i < n; i++)
+		things[i] = r->slots[(head + i) & r->mask];
+	smp_store_release(&r->head, head + n);
+
+	return n;
+}
+
+/* by the producer, or by anyone once it has stopped */
+static inline unsigned long ub_ring_drops(const struct ub_ring* r)
+{
+	return READ_ONCE(r->drops);
+}
+
+#endif
@@ -2,13 +2,16 @@
 #include <linux/moduleparam.h>
 #include <linux/kernel.h>
 #include <linux/cpumask.h>
+#include <linux/jiffies.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
-#include <linux/rwsem.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
 
 #include <core.h>
 #include <buckets.h>
 #include <db/hashtable.h>
+#include <entry.h>
 #include <kernel/db/linklist.h>
 #include <unbuckle.h>
 #include <kernel/net/udpserver_low.h>
@@ -22,10 +25,129 @@ module_param_named(memlim, ub_global_memory_limit, int, 0);
 static int ub_max_worker_threads = MAX_WORKERS;
 module_param_named(workers, ub_max_worker_threads, int, 0);
 
+/* NUMA placement of items: 0 = off, 1 = on the local node, 2 = interleaved */
+static int ub_numa_policy = UB_NUMA_LOCAL;
+module_param_named(numa, ub_numa_policy, int, 0);
+
+/* how often the bucket page rebalancer runs in milliseconds (0 disables it) */
+static unsigned int ub_rebalance_interval = 1000;
+module_param_named(rebalance, ub_rebalance_interval, uint, 0);
+
+/* bucket geometry: the smallest and largest item sizes in bytes, the growth
+   from one bucket to the next as a percentage, and the page size in bytes */
+static unsigned int ub_chunk_min = UB_CLASS_MIN_SIZE;
+module_param_named(chunkmin, ub_chunk_min, uint, 0);
+static unsigned int ub_item_max = UB_CLASS_MAX_SIZE;
+module_param_named(itemmax, ub_item_max, uint, 0);
+static unsigned int ub_growth = UB_CLASS_GROWTH;
+module_param_named(growth, ub_growth, uint, 0);
+static unsigned int ub_page_size = UB_PAGE_SIZE;
+module_param_named(pagesize, ub_page_size, uint, 0);
+
+/* carve bucket pages out of 2 MiB huge pages where possible */
+static int ub_hugepages = 1;
+module_param_named(hugepages, ub_hugepages, int, 0);
+
+/* allocate all of memlim up front when loading rather than on demand */
+static int ub_prealloc = 0;
+module_param_named(prealloc, ub_prealloc, int, 0);
+
+/* key hash function: 0 = the fastest the CPU has, 1 = SpookyHash, 2 = CRC32C,
+   3 = multiply and fold */
+static int ub_hash = UB_HASH_AUTO;
+module_param_named(hash, ub_hash, int, 0);
+
+/* steer each request to the worker owning its key (1) rather than spreading
+   them round robin (0) */
+int ub_shard_by_key = 0;
+module_param_named(shard, ub_shard_by_key, int, 0);
+
+/* which worker gets the rest: 0 = round robin, 1 = the one on the CPU the 
+   packet arrived on (by flow where there isn't one), 2 = by flow, 3 = by NIC 
+   RX queue */
+int ub_rx_steer = UB_STEER_LOCAL;
+module_param_named(steer, ub_rx_steer, int, 0);
+
+/* how the RX and TX workers wait for work: 0 = polling, 1 = asleep until
+   there is some, 2 = polling for pollus microseconds and then asleep */
+int ub_poll_mode = UB_POLL_HYBRID;
+module_param_named(poll, ub_poll_mode, int, 0);
+unsigned int ub_poll_usecs = 50;
+module_param_named(pollus, ub_poll_usecs, uint, 0);
+
+/* how replies are sent: 0 = by the two TX workers, 1 = by each RX worker 
+   through the qdisc, 2 = by each RX worker straight to the driver */
+int ub_tx_mode = UB_TX_DIRECT;
+module_param_named(tx, ub_tx_mode, int, 0);
+
+/* apply SETs in batches, one worker at a time doing everyone's (1), rather
+   than each worker doing its own (0). Ignored with shard=1, where each 
+   worker's SETs are already for keys no other worker touches. */
+int ub_combine_sets = 1;
+module_param_named(combine, ub_combine_sets, int, 0);
+
 volatile int ub_sys_running = 0;
 unsigned int ub_num_rx_workers = MAX_WORKERS;
 
 static struct task_struct* workers[MAX_WORKERS];
+static struct task_struct* rebalancer;
+
+/* periodically move pages between buckets as the item size mix changes */
+static int rebalancer_run(void* data)
+{
+	while (!kthread_should_stop() && ub_sys_running)
+	{
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_timeout(msecs_to_jiffies(ub_rebalance_interval));
+
+		if (kthread_should_stop())
+			break;
+
+		if (!ub_buckets_rebalance_due())
+			continue;
+
+		/* no update may be part way through allocating or freeing a chunk
+		   while pages are taken from their buckets */
+		percpu_down_write(&ub_update_sem);
+		ub_buckets_rebalance_take();
+		percpu_up_write(&ub_update_sem);
+
+		/* nor may anyone still be reading the items evicted from them, or a 
+		   chunk of theirs be on its way back from call_rcu, when they are 
+		   handed on; waiting for that holds up nobody */
+		synchronize_rcu();
+		rcu_barrier();
+		ub_buckets_rebalance_give();
+	}
+
+	return 0;
+}
+
+static void rebalancer_init(void)
+{
+	if (!ub_rebalance_interval)
+		return;
+
+	rebalancer = kthread_create(rebalancer_run, NULL, "unbucklerebal");
+	if (IS_ERR(rebalancer))
+	{
+		rebalancer = NULL;
+		return;
+	}
+
+	get_task_struct(rebalancer);
+	wake_up_process(rebalancer);
+}
+
+static void rebalancer_exit(void)
+{
+	if (rebalancer)
+	{
+		kthread_stop(rebalancer);
+		put_task_struct(rebalancer);
+		rebalancer = NULL;
+	}
+}
 
 /* start up worker threads */
 static int worker_init(void)
@@ -36,20 +158,22 @@ static int worker_init(void)
 
 	// Note that at this point the UDP server runs within the context of the worker.
 	int i;
-	/* don't use CPUid 0 (leave for the system) and don't use the last one 
-	   (for the NIC TX worker) */
+	/* don't use CPUid 0 (leave for the system) and don't use CPU 1 (for the
+	   NIC TX workers, if there are any): see UB_FIRST_WORKER_CPU */
 	for (i = 0; i < ub_num_rx_workers; i++)
 	{
 		char name[15];
 		snprintf(name, 15, "unbucklerx%d", i);
 		printk("Starting rxworker %s\n", name);
 
-		workers[i] = kthread_create((void*) ub_core_run, NULL, name);
+		/* keep the worker's stack and task_struct on the node it runs on */
+		workers[i] = kthread_create_on_node((void*) ub_core_run, NULL, 
+			cpu_to_node(UB_FIRST_WORKER_CPU + i), name);
 
 		if (workers[i])
 		{
 			printk("Binding and waking. %s\n", name);
-			kthread_bind(workers[i], i+2);
+			kthread_bind(workers[i], UB_FIRST_WORKER_CPU + i);
 			get_task_struct(workers[i]);
 			wake_up_process(workers[i]);
 		}
@@ -65,9 +189,14 @@ static void worker_exit(void)
 	{
 		if (workers[i])
 		{
+			char name[15];
+
 			kthread_stop(workers[i]);
 			// kernel will free task_struct when no one is using it anymore
 			put_task_struct(workers[i]);
+
+			snprintf(name, 15, "unbucklerx%d", i);
+			ub_poller_report(&ub_rx_pollers[i], name);
 		}
 	}
 	return;
@@ -85,23 +214,77 @@ static int __init unbuckle_init(void)
 	}
 
 	printk(KERN_ALERT "Limiting memory usage to %u MB.\n", ub_global_memory_limit);
+
+	/* one combiner would funnel every shard's SETs back through one core */
+	if (ub_shard_by_key && ub_combine_sets)
+	{
+		printk(KERN_INFO "[Unbuckle] Sharding keys, so not combining SETs.\n");
+		ub_combine_sets = 0;
+	}
 	
-	init_rwsem(&rwlock);	
+	if (percpu_init_rwsem(&ub_update_sem))
+		return -ENOMEM;
+
+	ub_buckets_set_numa(ub_numa_policy);
+	ub_buckets_set_hugepages(ub_hugepages);
+	if (ub_buckets_set_geometry(ub_chunk_min, ub_growth, ub_item_max, 
+		ub_page_size))
+		printk(KERN_WARNING "[Unbuckle] Invalid bucket geometry, using the "
+			"defaults.\n");
 
 #ifdef STORE_LINKLIST
 	memcached_db_linklist_init();
 #endif
 #ifdef STORE_HASHTABLE
-	ub_hashtbl_init();
+	if (ub_keyhash_select(ub_hash))
+	{
+		printk(KERN_WARNING "[Unbuckle] This CPU can't do the %s hash, "
+			"choosing another.\n", ub_keyhash_name(ub_hash));
+		ub_keyhash_select(UB_HASH_AUTO);
+	}
+	printk(KERN_INFO "[Unbuckle] Hashing keys with %s.\n", 
+		ub_keyhash_name(ub_keyhash_fn));
+
+	if (ub_hashtbl_init(ub_buckets_capacity(ub_global_memory_limit)))
+	{
+		printk(KERN_ALERT "[Unbuckle] Could not allocate the hash table.\n");
+		percpu_free_rwsem(&ub_update_sem);
+		return -ENOMEM;
+	}
 #endif
 	
-	ub_buckets_init(ub_global_memory_limit);
+	if (ub_buckets_init(ub_global_memory_limit))
+	{
+		printk(KERN_ALERT "[Unbuckle] Could not set up the buckets.\n");
+		ub_buckets_exit();
+#ifdef STORE_HASHTABLE
+		ub_hashtbl_exit();
+#endif
+		percpu_free_rwsem(&ub_update_sem);
+		return -ENOMEM;
+	}
+	ub_buckets_set_evictor(ub_cache_evict, ub_cache_release);
+
+	if (ub_prealloc && ub_buckets_prealloc())
+		printk(KERN_WARNING "[Unbuckle] Could only preallocate part of the "
+			"memory limit.\n");
 
 	ub_sys_running = 1;
 
-	ub_udpserver_nictxworker_init();
-	ub_udpserver_netstack_register();
+	if (ub_udpserver_nictxworker_init() || ub_udpserver_netstack_register())
+	{
+		printk(KERN_ALERT "[Unbuckle] Could not set up the packet rings.\n");
+		ub_sys_running = 0;
+		ub_udpserver_nictxworker_exit();
+		ub_buckets_exit();
+#ifdef STORE_HASHTABLE
+		ub_hashtbl_exit();
+#endif
+		percpu_free_rwsem(&ub_update_sem);
+		return -ENOMEM;
+	}
 	worker_init();
+	rebalancer_init();
 
 	return 0;
 }
@@ -112,9 +295,14 @@ static void __exit unbuckle_exit(void)
 	ub_sys_running = 0;
 	
 	ub_udpserver_netstack_unregister();
+	rebalancer_exit();
 	worker_exit();
+	ub_udpserver_netstack_free();
 	ub_udpserver_nictxworker_exit();
 
+	/* entries still waiting to be freed must be gone before the buckets */
+	rcu_barrier();
+
 #ifdef STORE_LINKLIST
 	memcached_db_linklist_exit();
 #endif
@@ -123,6 +311,7 @@ static void __exit unbuckle_exit(void)
 #endif
 
 	ub_buckets_exit();
+	percpu_free_rwsem(&ub_update_sem);
 }
 
 	
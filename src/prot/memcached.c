@@ -1,8 +1,11 @@
 #include <prot/memcached.h>
 
 #ifdef __KERNEL__
+#include <linux/byteorder/generic.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 #else
+#include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #endif	/* __KERNEL__ */
@@ -77,3 +80,47 @@ struct memcache_hdr_res * memcached_produce_response(int opcode, char* extras,
 
 	return packet;
 }
+
+// Find the key in a request: the second token of an ASCII request (which is
+// delimited as parse_ascii_request does) or the key section of a binary one
+int memcached_peek_key(const unsigned char* buf, size_t len_buf,
+	const unsigned char** key)
+{
+	const unsigned char* p;
+	const unsigned char* end = buf + len_buf;
+
+	if (len_buf <= MEMCACHED_UDP_HDR_LEN)
+		return -1;
+	p = buf + MEMCACHED_UDP_HDR_LEN;
+
+	if (p[0] == MEMCACHED_MAGIC_REQ)
+	{
+		const struct memcache_hdr_req* hdr = (const struct memcache_hdr_req*) p;
+		size_t len_key;
+
+		if (end - p < MEMCACHED_PKT_HDR_REQ_LEN)
+			return -1;
+		len_key = ntohs(hdr->len_key);
+		p = MEMCACHED_PKT_KEY(hdr, hdr->len_extras);
+		if (p + len_key > end)
+			return -1;
+
+		*key = p;
+		return len_key;
+	}
+
+	// skip the command and the delimiter after it
+	while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+		p++;
+	if (p == end || *p++ == '\n')
+		return -1;
+
+	*key = p;
+	while (p < end && *p != ' ' && *p != '\r' && *p != '\n')
+		p++;
+
+	// the key must have been followed by a delimiter for it to be complete
+	if (p == end || *p == '\n')
+		return -1;
+	return p - *key;
+}
@@ -20,6 +20,7 @@
 
 #define	MEMCACHED_OPCODE_GET	0x00
 #define	MEMCACHED_OPCODE_SET	0x01
+#define	MEMCACHED_OPCODE_DELETE	0x04
 
 #define MEMCACHED_STATUS_NOERROR        0x00
 #define MEMCACHED_STATUS_KEYNOTFOUND    0x01
@@ -98,6 +99,21 @@ struct memcache_udp_header {
 #define MEMCACHED_LEN_VAL(req)	req->len_body - (req->len_key + req->len_extras)
 #define MEMCACHED_LEN_BODY(extras, key, val)	extras + key + val
 
+/* The memcached UDP frame header at the front of every datagram, before the 
+   request itself */
+#define MEMCACHED_UDP_HDR_LEN 8
+
+/* most of a reply (frame header and all) sent in each datagram, as memcached
+   does; a longer reply goes in several, numbered by their frame headers */
+#define MEMCACHED_UDP_MAX_PAYLOAD 1400
+
+/* Find the key of the request in a datagram (from its memcached UDP frame 
+   header on) without parsing the rest of it, for steering requests by key. 
+   Returns the length of the key, with *key pointing at it in buf, or -1 if 
+   no key lies wholly within the len_buf bytes given. */
+int memcached_peek_key(const unsigned char* buf, size_t len_buf,
+	const unsigned char** key);
+
 struct memcache_hdr_req * memcached_produce_request(int opcode, char* extras, 
     int len_extra, char* key, int len_key, char* value, int len_value);
 struct memcache_hdr_res * memcached_produce_response(int opcode, char* extras, 
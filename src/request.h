@@ -9,11 +9,15 @@
 #else
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #endif
 
 #include <core.h>
 #include <prot/memcached.h>
 
+/* most pieces a value can be sent from without copying it into sendbuf */
+#define UB_VAL_IOV_MAX 8
+
 enum conn_states {
 	conn_wait,
 	conn_proc_udp,
@@ -26,7 +30,8 @@ enum conn_states {
 
 enum memcache_commands {
 	cmd_set,
-	cmd_get
+	cmd_get,
+	cmd_delete
 };
 
 enum memcache_protocol {
@@ -52,6 +57,7 @@ struct request_state {
 	// The input data from the initial request
 	unsigned char* key; // pointer to the key in the header
 	int len_key; // length of said key
+	uint64_t key_hash; // ub_hashtbl_hash of the key, set once it is parsed
 	unsigned char* data; // pointer to the data values in the request (i.e. value field)
 	int len_data; // length of the said data value
 
@@ -66,6 +72,14 @@ struct request_state {
 	
 	struct memcache_udp_header* udpheaders;  /* pointer to space for UDP headers */
 
+#ifndef __KERNEL__
+	// A value in the reply is sent straight from the cache's chunks rather than
+	// copied into sendbuf; it goes in at offset sendbuf_split.
+	struct iovec val_iov[UB_VAL_IOV_MAX];
+	int val_iovcnt;
+	size_t sendbuf_split;
+#endif
+
 #ifdef __KERNEL__
 	// For kernel use only, when sending by using an SKB
 	struct sk_buff* skb_tx;
@@ -76,6 +90,7 @@ struct request_state {
 	__be32 daddr;
 	unsigned char mac_src[ETH_ALEN];
 	struct net_device *devrcv;
+	int set_combined; // a SET already applied by the combiner (kernel/combine.c)
 #endif
 };
 
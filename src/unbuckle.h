@@ -1,7 +1,9 @@
 #ifndef UNBUCKLE_H
 #define UNBUCKLE_H
 
-#include <linux/rwsem.h>
+#ifdef __KERNEL__
+#include <linux/percpu-rwsem.h>
+#endif
 
 /* but we might spin up fewer if we don't have this many CPUs */
 #define MAX_WORKERS 10
@@ -12,6 +14,43 @@
 extern volatile int ub_sys_running;
 extern unsigned int ub_num_rx_workers;
 
-extern struct rw_semaphore rwlock;
+#ifdef __KERNEL__
+/* RX worker i runs on CPU UB_FIRST_WORKER_CPU + i, leaving the CPUs before 
+   it to the system and the TX workers */
+#define UB_FIRST_WORKER_CPU 2
+
+/* Whether the RX workers each own a shard of the keys (see 
+   kernel/net/udpserver_low.c) */
+extern int ub_shard_by_key;
+
+/* how the netfilter hook picks the worker for a request it doesn't steer by
+   key (see kernel/net/udpserver_low.c) */
+#define UB_STEER_ROUND_ROBIN 0 /* each in turn                                */
+#define UB_STEER_LOCAL       1 /* the one on the packet's CPU, else by flow   */
+#define UB_STEER_FLOW        2 /* by the hash of the addresses and ports      */
+#define UB_STEER_RX_QUEUE    3 /* by the NIC queue the packet came in on      */
+extern int ub_rx_steer;
+
+/* how the RX and TX workers wait for work (see kernel/poll.h) */
+#define UB_POLL_SPIN   0 /* poll, giving the CPU up to anyone else who wants it */
+#define UB_POLL_SLEEP  1 /* sleep until woken by whoever gives them work       */
+#define UB_POLL_HYBRID 2 /* poll for ub_poll_usecs, then sleep                 */
+extern int ub_poll_mode;
+extern unsigned int ub_poll_usecs;
+
+/* how replies are sent (see kernel/net/udpserver_send.h) */
+#define UB_TX_THREADS 0 /* handed to the TX workers on the first two CPUs  */
+#define UB_TX_DIRECT  1 /* by each RX worker, through the qdisc            */
+#define UB_TX_BYPASS  2 /* by each RX worker, straight to its own NIC queue */
+extern int ub_tx_mode;
+/* Whether the RX workers hand their SETs to one another to apply in batches 
+   (see kernel/combine.c) */
+extern int ub_combine_sets;
+
+/* Taken for reading around every update to the cache, so that the bucket 
+   rebalancer can take it for writing to shut them all out. Lookups and the 
+   hash table itself are protected by the hash table's striped locks. */
+extern struct percpu_rw_semaphore ub_update_sem;
+#endif
 
 #endif
@@ -2,42 +2,193 @@
 #include <buckets.h>
 #include <entry.h>
 #include <db/hashtable.h>
+#include <uberrors.h>
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+/* Unlink a key's entry from the hash table and the LRU, with the key's lock 
+   held. Returns the entry if it should now be freed by the caller, or NULL if 
+   there was none or it is being evicted (the evictor frees it then). */
+static struct ub_entry* entry_unlink(char* key, size_t len_key, int* found)
+{
+	struct ub_entry* e = ub_hashtbl_find(key, len_key);
+
+	*found = (e != NULL);
+	if (!e)
+		return NULL;
+
+	ub_hashtbl_del(e);
+	return ub_buckets_lru_del(&e->lru) ? e : NULL;
+}
+
+static void entry_free_rcu(struct rcu_head* head)
+{
+	struct ub_entry* e = container_of(head, struct ub_entry, rcu);
+
+	ub_buckets_free_chain(e->chain);
+	ub_buckets_free(ub_entry_size(e->len_key, e->len_val), e);
+}
+
+/* Give an unreachable entry's memory back; no locks need be held. Another 
+   thread may still be reading the entry (a GET sends the value straight out
+   of it), so it is only freed once the epoch has moved on. */
+static void entry_free(struct ub_entry* e)
+{
+	call_rcu(&e->rcu, entry_free_rcu);
+}
+
+/* unlink an entry from the hash table and hand its chunk back to the bucket 
+   allocator so the memory can be reused by the next SET */
+int ub_cache_delete(char* key, size_t len_key)
+{
+	spinlock_t* lock = ub_hashtbl_lock(key, len_key);
+	struct ub_entry* e;
+	int found;
+
+	e = entry_unlink(key, len_key, &found);
+	ub_hashtbl_unlock(lock);
+
+	if (e)
+		entry_free(e);
+
+	return found ? 0 : -EUBKEYNOTFOUND;
+}
+
+/* The bucket allocator has already taken the entry off its LRU list, so only
+   the hash table needs to be dealt with here; the rest of a chained value 
+   goes in ub_cache_release. The entry may have been deleted from the hash 
+   table in the meantime, in which case the deleter has left the rest to us. */
+void* ub_cache_evict(struct ub_lru_link* link)
+{
+	struct ub_entry* e = ub_entry_from_lru(link);
+	char* key = ub_entry_loc_key(e);
+	spinlock_t* lock = ub_hashtbl_lock(key, e->len_key);
+
+	if (ub_hashtbl_find_hashed(key, e->len_key, e->key_hash) == e)
+		ub_hashtbl_del(e);
+	ub_hashtbl_unlock(lock);
+
+	return e;
+}
+
+void ub_cache_release(struct ub_lru_link* link)
+{
+	struct ub_entry* e = ub_entry_from_lru(link);
+
+	ub_buckets_free_chain(e->chain);
+	e->chain = NULL;
+}
+
+/* how much of the value is kept in the entry's own chunk */
+static inline size_t entry_len_val_head(size_t len_key, size_t len_val)
+{
+	if (ub_entry_chained(len_key, len_val))
+		return ub_buckets_max_item() - UB_ENTRY_SIZE - len_key;
+	return len_val;
+}
+
+/* The new entry is allocated and filled in before the key is locked, as
+   allocating may evict other entries (which takes their keys' locks) and 
+   wait for readers. The old entry is only swapped for the new under the 
+   lock. */
 int ub_cache_replace(char* key, size_t len_key, char* val, size_t len_val)
 {
 	int err;
 	struct ub_entry* e;
+	struct ub_entry* old;
+	struct ub_chunk* c;
+	spinlock_t* lock;
+	size_t len_head = entry_len_val_head(len_key, len_val);
 	
-	/* check whether the given key exists already */
-	/*e = ub_hashtbl_find(key, len_key);
-	if (e)
-	{*/
-		/* the key already exists -- simplest thing to do at the moment is to delete
-		   the corresponding entry and add in a new one */
-	/*	ub_hashtbl_del(e);
-		kfree(e);
-	}*/
 	// TODO: this function should receive a struct entry* not allocate memory here
 	err = ub_buckets_alloc(ub_entry_size(len_key, len_val), (void**) &e);
 	
 	if (err)
 		return err;
 	
+	e->key_hash = ub_hashtbl_hash(key, len_key);
 	e->len_key = len_key;
 	e->len_val = len_val;
+	e->chain = NULL;
+
+	if (len_head < len_val)
+	{
+		err = ub_buckets_alloc_chain(len_val - len_head, &e->chain);
+		if (err)
+		{
+			ub_buckets_free(ub_entry_size(len_key, len_val), e);
+			return err;
+		}
+	}
 
 	memcpy(ub_entry_loc_key(e), key, len_key);
-	memcpy(ub_entry_loc_val(e), val, len_val);
+	memcpy(ub_entry_loc_val(e), val, len_head);
+
+	val += len_head;
+	for (c = e->chain; c; c = c->next)
+	{
+		memcpy(ub_chunk_data(c), val, c->len);
+		val += c->len;
+	}
+
+	ub_hashtbl_reserve(e->key_hash);
+	lock = ub_hashtbl_lock(key, len_key);
 
-	/* add the embedded list header into the hash table */
-	return ub_hashtbl_add(e);
+	/* An entry already there for the key is swapped for the new one, which 
+	   needs no more room in the table. Otherwise the new entry is added, and
+	   if the table is full, it is dropped and the SET fails. */
+	old = ub_hashtbl_find_hashed(key, len_key, e->key_hash);
+	if (old)
+	{
+		ub_hashtbl_replace(old, e);
+		err = 0;
+		if (!ub_buckets_lru_del(&old->lru))
+			old = NULL; /* being evicted, and the evictor frees it */
+	}
+	else
+		err = ub_hashtbl_add(e);
+
+	if (!err)
+		ub_buckets_lru_add(ub_entry_size(len_key, len_val), &e->lru);
+	ub_hashtbl_unlock(lock);
+
+	if (err)
+		entry_free(e);
+	if (old)
+		entry_free(old);
+
+	return err;
 }
 
-struct ub_entry* ub_cache_find(char* key, size_t len_key)
+/* the caller must hold the key's lock from ub_hashtbl_lock while finding the
+   entry, unless the hash table allows lookups under rcu_read_lock() alone, 
+   and must be under rcu_read_lock() for as long as it then uses the entry */
+struct ub_entry* ub_cache_find(char* key, size_t len_key, uint64_t key_hash)
 {
-	return ub_hashtbl_find(key, len_key);
+	return ub_hashtbl_find_hashed(key, len_key, key_hash);
+}
+
+int ub_entry_val_iov(struct ub_entry* e, struct iovec* iov, int max_iov)
+{
+	struct ub_chunk* c;
+	int n = 0;
+
+	if (max_iov < 1)
+		return -E2BIG;
+
+	iov[n].iov_base = ub_entry_loc_val(e);
+	iov[n++].iov_len = entry_len_val_head(e->len_key, e->len_val);
+
+	for (c = e->chain; c; c = c->next)
+	{
+		if (n == max_iov)
+			return -E2BIG;
+		iov[n].iov_base = ub_chunk_data(c);
+		iov[n++].iov_len = c->len;
+	}
+
+	return n;
 }
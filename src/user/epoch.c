@@ -0,0 +1,200 @@
+/* Epoch based reclamation for userland, after Fraser's "Practical lock
+   freedom" (Cambridge TR 579, 2004).
+
+   Every thread which touches the store has a record on a list which is only
+   ever added to. While it is reading, a record holds the global epoch the
+   thread started in; the epoch may only move on once every reading thread
+   has started in the current one, so once it has moved on twice since
+   something was retired no reader can still have hold of it. Each thread
+   keeps what it retires on one of three limbo lists by the epoch it was
+   retired in, and runs the callbacks on a list when it next finds the epoch
+   far enough along. Threads try to move the epoch on every EPOCH_BATCH
+   retirements, so reclamation costs nothing on the read side beyond noting
+   the epoch on the way in. */
+
+#include <user/epoch.h>
+#include <user/sync.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EPOCH_LIMBO 3
+#define EPOCH_BATCH 64
+
+struct epoch_thread {
+	/* the epoch the thread started reading in, shifted up a bit, with the
+	   bottom bit set while it is reading */
+	unsigned long state;
+	int nest;
+	int retired;        /* since the last attempt to move the epoch on */
+	int in_use;         /* by a thread which hasn't exited              */
+	struct rcu_head* limbo[EPOCH_LIMBO];
+	unsigned long limbo_epoch[EPOCH_LIMBO];
+	struct epoch_thread* next;
+} ____cacheline_aligned_in_smp;
+
+static unsigned long global_epoch = 0;
+static struct epoch_thread* threads = NULL;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct epoch_thread* self = NULL;
+
+/* the calling thread's record, taking over one left by a thread which has
+   exited if there is one */
+static struct epoch_thread* thread_get(void)
+{
+	struct epoch_thread* t = self;
+
+	if (t)
+		return t;
+
+	pthread_mutex_lock(&threads_lock);
+	for (t = threads; t; t = t->next)
+		if (!t->in_use)
+			break;
+
+	if (!t)
+	{
+		if (posix_memalign((void**) &t, 64, sizeof(*t)))
+		{
+			fprintf(stderr, "[Unbuckle] Out of memory for an epoch record.\n");
+			abort();
+		}
+		memset(t, 0, sizeof(*t));
+		t->next = threads;
+		__atomic_store_n(&threads, t, __ATOMIC_RELEASE);
+	}
+	t->in_use = 1;
+	pthread_mutex_unlock(&threads_lock);
+
+	self = t;
+	return t;
+}
+
+static inline unsigned long epoch_now(void)
+{
+	return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+/* Move the global epoch on if every reading thread started in it. Returns
+   zero if one is still reading in an older epoch. */
+static int epoch_try_advance(void)
+{
+	unsigned long epoch = epoch_now();
+	struct epoch_thread* t;
+
+	for (t = __atomic_load_n(&threads, __ATOMIC_ACQUIRE); t; t = t->next)
+	{
+		unsigned long state = __atomic_load_n(&t->state, __ATOMIC_SEQ_CST);
+
+		if ((state & 1) && (state >> 1) != epoch)
+			return 0;
+	}
+
+	/* someone else may have beaten us to it, which is just as good */
+	__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/* run the callbacks on any of a thread's limbo lists which are old enough */
+static void limbo_collect(struct epoch_thread* t, unsigned long epoch)
+{
+	int i;
+
+	for (i = 0; i < EPOCH_LIMBO; i++)
+	{
+		struct rcu_head* head = t->limbo[i];
+
+		if (!head || t->limbo_epoch[i] + 2 > epoch)
+			continue;
+
+		t->limbo[i] = NULL;
+		while (head)
+		{
+			struct rcu_head* next = head->next;
+
+			head->func(head);
+			head = next;
+		}
+	}
+}
+
+/* Readers may nest. The epoch is read again after it has been published in
+   case it moved on in between, as otherwise it could have moved on twice
+   without seeing this reader. */
+void ub_epoch_enter(void)
+{
+	struct epoch_thread* t = thread_get();
+	unsigned long epoch;
+
+	if (t->nest++)
+		return;
+
+	do
+	{
+		epoch = epoch_now();
+		__atomic_store_n(&t->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+	} while (epoch_now() != epoch);
+}
+
+void ub_epoch_exit(void)
+{
+	struct epoch_thread* t = self;
+
+	if (--t->nest == 0)
+		__atomic_store_n(&t->state, 0, __ATOMIC_RELEASE);
+}
+
+void ub_epoch_retire(struct rcu_head* head, void (*func)(struct rcu_head*))
+{
+	struct epoch_thread* t = thread_get();
+	unsigned long epoch = epoch_now();
+	int i = epoch % EPOCH_LIMBO;
+
+	/* anything on this epoch's list from three or more epochs ago goes now */
+	limbo_collect(t, epoch);
+
+	head->func = func;
+	head->next = t->limbo[i];
+	t->limbo[i] = head;
+	t->limbo_epoch[i] = epoch;
+
+	if (++t->retired >= EPOCH_BATCH)
+	{
+		t->retired = 0;
+		epoch_try_advance();
+	}
+}
+
+void ub_epoch_synchronize(void)
+{
+	unsigned long target = epoch_now() + 2;
+
+	while ((long) (epoch_now() - target) < 0)
+		if (!epoch_try_advance())
+			sched_yield();
+
+	if (self)
+		limbo_collect(self, epoch_now());
+}
+
+void ub_epoch_thread_exit(void)
+{
+	struct epoch_thread* t = self;
+
+	if (!t)
+		return;
+
+	/* everything on the limbo lists was retired before this, so all of it
+	   is collected on the way out */
+	ub_epoch_synchronize();
+
+	t->retired = 0;
+	pthread_mutex_lock(&threads_lock);
+	t->in_use = 0;
+	pthread_mutex_unlock(&threads_lock);
+	self = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef UB_USER_EPOCH_H
+#define UB_USER_EPOCH_H
+
+/* Epoch based reclamation, which stands in for RCU in userland (see
+   user/sync.h for the RCU names the shared code uses).
+
+   A thread reading shared data without locks does so between
+   ub_epoch_enter() and ub_epoch_exit(), which note the global epoch it
+   started in. Anything unlinked from view while readers may still be looking
+   at it is handed to ub_epoch_retire(), and its callback is run once the
+   global epoch has moved on twice since, by which time every reader which
+   could have found it has finished. The epoch only moves on when every
+   thread which is reading has seen the current one, so a reader holds up
+   reclamation (not other readers or writers) for as long as it reads. */
+
+struct rcu_head {
+	struct rcu_head* next;
+	void (*func)(struct rcu_head* head);
+};
+
+void ub_epoch_enter(void);
+void ub_epoch_exit(void);
+void ub_epoch_retire(struct rcu_head* head, void (*func)(struct rcu_head*));
+/* Wait until every reader which was reading when this was called has
+   finished. Must not be called between ub_epoch_enter and ub_epoch_exit. */
+void ub_epoch_synchronize(void);
+/* Run everything the calling thread has retired, waiting for readers first;
+   each thread which has used the store must call this before it exits. */
+void ub_epoch_thread_exit(void);
+
+#endif /* UB_USER_EPOCH_H */
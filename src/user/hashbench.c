@@ -0,0 +1,175 @@
+/* Microbenchmark for the userland hash tables: times adds, hits, misses and
+   deletes of a set of memcached-like keys through the ub_hashtbl interface.
+   Hits are timed one at a time and in batches prefetched ahead of time. It is
+   built once against each table (see "make hashbench" in Makefile.user),
+   and the kernel hash table, which only exists in the kernel, isn't covered.
+
+   Usage: hashbench_<table> [items] [hash function, as for unbuckle -H] */
+
+#include <db/hashtable.h>
+#include <entry.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(HASHTABLE_SWISS)
+#define TABLE_NAME "swiss"
+#elif defined(HASHTABLE_CUCKOO)
+#define TABLE_NAME "cuckoo"
+#else
+#define TABLE_NAME "uthash"
+#endif
+
+#define DEFAULT_ITEMS 1000000
+#define LOOKUP_ROUNDS 4
+#define BATCH 16 /* as UB_RX_BATCH in the kernel */
+#define KEY_MAX 32
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t make_key(char* buf, const char* prefix, long i)
+{
+	return snprintf(buf, KEY_MAX, "%s:%08lx", prefix, i);
+}
+
+static void report(const char* what, double start, long ops)
+{
+	printf("%-8s %-8s %8.1f ns/op\n", TABLE_NAME, what,
+		(now_ns() - start) / ops);
+}
+
+int main(int argc, char* argv[])
+{
+	long items = argc > 1 ? atol(argv[1]) : DEFAULT_ITEMS;
+	int hash = argc > 2 ? atoi(argv[2]) : UB_HASH_AUTO;
+	struct ub_entry** entries;
+	long* order;
+	char* misses;
+	char key[KEY_MAX];
+	long i, r, found = 0;
+	double start;
+
+	if (items <= 0 || ub_keyhash_select(hash) || ub_hashtbl_init(items))
+	{
+		fprintf(stderr, "Usage: %s [items] [hash]\n", argv[0]);
+		return 1;
+	}
+
+	entries = malloc(items * sizeof(*entries));
+	order = malloc(items * sizeof(*order));
+	misses = malloc(items * KEY_MAX);
+	if (!entries || !order || !misses)
+		return 1;
+
+	for (i = 0; i < items; i++)
+	{
+		size_t len = make_key(key, "user", i);
+
+		entries[i] = calloc(1, UB_ENTRY_SIZE + len);
+		if (!entries[i])
+			return 1;
+		entries[i]->key_hash = ub_hashtbl_hash(key, len);
+		entries[i]->len_key = len;
+		memcpy(ub_entry_loc_key(entries[i]), key, len);
+		order[i] = i;
+	}
+
+	/* look things up in a random order so the cache does no favours */
+	srand(1);
+	for (i = items - 1; i > 0; i--)
+	{
+		long j = rand() % (i + 1);
+		long t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	start = now_ns();
+	for (i = 0; i < items; i++)
+	{
+		ub_hashtbl_reserve(entries[order[i]]->key_hash);
+		ub_hashtbl_add(entries[order[i]]);
+	}
+	report("add", start, items);
+
+	start = now_ns();
+	for (r = 0; r < LOOKUP_ROUNDS; r++)
+	{
+		for (i = 0; i < items; i++)
+		{
+			struct ub_entry* e = entries[order[i]];
+			found += ub_hashtbl_find(ub_entry_loc_key(e), e->len_key) == e;
+		}
+	}
+	report("hit", start, items * LOOKUP_ROUNDS);
+
+	/* the same, a batch at a time as the kernel's RX workers do: hash and
+	   prefetch for the whole batch, then look them up */
+	start = now_ns();
+	for (r = 0; r < LOOKUP_ROUNDS; r++)
+	{
+		for (i = 0; i < items; i += BATCH)
+		{
+			const char* keys[BATCH];
+			size_t lens[BATCH];
+			uint64_t hashes[BATCH];
+			long b, n = items - i < BATCH ? items - i : BATCH;
+
+			for (b = 0; b < n; b++)
+			{
+				keys[b] = ub_entry_loc_key(entries[order[i + b]]);
+				lens[b] = entries[order[i + b]]->len_key;
+			}
+			ub_hashtbl_hash_many(keys, lens, hashes, n);
+			for (b = 0; b < n; b++)
+				ub_hashtbl_prefetch(hashes[b]);
+			for (b = 0; b < n; b++)
+			{
+				struct ub_entry* e = entries[order[i + b]];
+
+				found += ub_hashtbl_find_hashed(ub_entry_loc_key(e),
+					e->len_key, hashes[b]) == e;
+			}
+		}
+	}
+	report("batchhit", start, items * LOOKUP_ROUNDS);
+
+	/* keys which aren't there, made beforehand to keep them out of the time */
+	for (i = 0; i < items; i++)
+		make_key(misses + i * KEY_MAX, "miss", order[i]);
+
+	start = now_ns();
+	for (i = 0; i < items; i++)
+	{
+		char* miss = misses + i * KEY_MAX;
+		found += ub_hashtbl_find(miss, strlen(miss)) != NULL;
+	}
+	report("miss", start, items);
+
+	start = now_ns();
+	for (i = 0; i < items; i++)
+		ub_hashtbl_del(entries[order[i]]);
+	report("del", start, items);
+
+	if (found != items * LOOKUP_ROUNDS * 2)
+	{
+		fprintf(stderr, "%s: found %ld of %ld lookups correctly\n", TABLE_NAME,
+			found, items * LOOKUP_ROUNDS * 2);
+		return 1;
+	}
+
+	ub_hashtbl_exit();
+	for (i = 0; i < items; i++)
+		free(entries[i]);
+	free(entries);
+	free(order);
+	free(misses);
+	return 0;
+}
@@ -0,0 +1,237 @@
+/* Benchmark for the key hash functions in db/keyhash.c: for a few sets of
+   keys shaped like real ones, reports how long each function takes per key
+   and how evenly it spreads the keys over a table's worth of buckets (by the
+   low bits of the hash, as the hash tables index) and over tags (by the top
+   eight bits, which the Swiss and cuckoo tables keep as tags).
+
+   The spread is given as chi-squared over its degrees of freedom, which is
+   close to 1 for a hash as good as a random function, along with the fullest
+   bucket. Each function is also timed hashing keys a batch at a time with 
+   ub_keyhash_many, as the kernel's RX workers do, and those hashes are checked
+   against the ones from ub_keyhash.
+
+   Usage: hashfnbench [keys per set] */
+
+#include <db/keyhash.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_KEYS (1 << 20)
+#define KEY_MAX 48
+#define TIME_ROUNDS 8
+#define BATCH 16 /* as UB_RX_BATCH in the kernel */
+
+struct keyset {
+	const char* name;
+	char* keys;     /* KEY_MAX bytes apiece */
+	const char** ptrs; /* to each of them, for ub_keyhash_many */
+	size_t* lens;
+	long n;
+};
+
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+static unsigned long long rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+/* fill in key i of a set, returning its length */
+static size_t make_key(const char* set, char* buf, long i)
+{
+	if (!strcmp(set, "prefixed"))   /* memcached-style "object:id" keys */
+		return snprintf(buf, KEY_MAX, "user:%08lx", i);
+	if (!strcmp(set, "session"))    /* long hex session ids */
+		return snprintf(buf, KEY_MAX, "session:%016llx%016llx", rnd(), rnd());
+	if (!strcmp(set, "numeric"))    /* bare counters */
+		return snprintf(buf, KEY_MAX, "%ld", i);
+
+	{
+		/* random binary of 10 to 40 bytes */
+		size_t len = 10 + rnd() % 31, j;
+
+		for (j = 0; j < len; j++)
+			buf[j] = rnd();
+		return len;
+	}
+}
+
+static void keyset_make(struct keyset* ks, const char* name, long n)
+{
+	long i;
+
+	ks->name = name;
+	ks->n = n;
+	ks->keys = malloc(n * KEY_MAX);
+	ks->ptrs = malloc(n * sizeof(char*));
+	ks->lens = malloc(n * sizeof(size_t));
+	if (!ks->keys || !ks->ptrs || !ks->lens)
+		exit(1);
+
+	for (i = 0; i < n; i++)
+	{
+		ks->ptrs[i] = ks->keys + i * KEY_MAX;
+		ks->lens[i] = make_key(name, ks->keys + i * KEY_MAX, i);
+	}
+}
+
+static double ticks(void)
+{
+#ifdef __x86_64__
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+}
+
+/* chi-squared over degrees of freedom for counts in nbuckets buckets */
+static double spread(unsigned int* counts, long nbuckets, long n,
+	unsigned int* max)
+{
+	double mean = (double) n / nbuckets;
+	double chi2 = 0;
+	long b;
+
+	*max = 0;
+	for (b = 0; b < nbuckets; b++)
+	{
+		double d = counts[b] - mean;
+
+		chi2 += d * d / mean;
+		if (counts[b] > *max)
+			*max = counts[b];
+	}
+
+	return chi2 / (nbuckets - 1);
+}
+
+/* returns nonzero if ub_keyhash_many disagreed with ub_keyhash */
+static int bench(struct keyset* ks, int fn, uint64_t* hashes,
+	unsigned int* counts, long nbuckets)
+{
+	unsigned int tags[256];
+	unsigned int max, max_tag;
+	uint64_t batch[BATCH];
+	double start, per_key, per_key_batched, bucket_chi2, tag_chi2;
+	int wrong = 0;
+	volatile uint64_t sink = 0;
+	long i, r;
+
+	ub_keyhash_select(fn);
+
+	start = ticks();
+	for (r = 0; r < TIME_ROUNDS; r++)
+	{
+		uint64_t acc = 0;
+
+		for (i = 0; i < ks->n; i++)
+			acc += ub_keyhash(ks->keys + i * KEY_MAX, ks->lens[i]);
+		sink += acc;
+	}
+	per_key = (ticks() - start) / ((double) ks->n * TIME_ROUNDS);
+
+	for (i = 0; i < ks->n; i++)
+		hashes[i] = ub_keyhash(ks->keys + i * KEY_MAX, ks->lens[i]);
+
+	start = ticks();
+	for (r = 0; r < TIME_ROUNDS; r++)
+	{
+		uint64_t acc = 0;
+
+		for (i = 0; i + BATCH <= ks->n; i += BATCH)
+		{
+			ub_keyhash_many(ks->ptrs + i, ks->lens + i, batch, BATCH);
+			acc += batch[0] + batch[BATCH - 1];
+		}
+		sink += acc;
+	}
+	per_key_batched = (ticks() - start) / 
+		((double) (ks->n / BATCH) * BATCH * TIME_ROUNDS);
+
+	for (i = 0; i + BATCH <= ks->n; i += BATCH)
+	{
+		ub_keyhash_many(ks->ptrs + i, ks->lens + i, batch, BATCH);
+		wrong |= memcmp(batch, hashes + i, sizeof(batch)) != 0;
+	}
+
+	memset(counts, 0, nbuckets * sizeof(*counts));
+	memset(tags, 0, sizeof(tags));
+	for (i = 0; i < ks->n; i++)
+	{
+		counts[hashes[i] & (nbuckets - 1)]++;
+		tags[hashes[i] >> 56]++;
+	}
+
+	bucket_chi2 = spread(counts, nbuckets, ks->n, &max);
+	tag_chi2 = spread(tags, 256, ks->n, &max_tag);
+
+	printf("%-9s %-7s %9.1f %9.1f %12.3f %10u %10.3f%s\n", ks->name,
+		ub_keyhash_name(fn), per_key, per_key_batched, bucket_chi2, max,
+		tag_chi2, wrong ? "  batched hashes differ!" : "");
+
+	return wrong;
+}
+
+int main(int argc, char* argv[])
+{
+	static const char* sets[] = { "prefixed", "session", "numeric", "binary" };
+	static const int fns[] = { UB_HASH_SPOOKY, UB_HASH_CRC32C, UB_HASH_FOLD };
+	long n = argc > 1 ? atol(argv[1]) : DEFAULT_KEYS;
+	long nbuckets = 1;
+	uint64_t* hashes;
+	unsigned int* counts;
+	unsigned int s, f;
+	int wrong = 0;
+
+	if (n < 256)
+	{
+		fprintf(stderr, "Usage: %s [keys per set, at least 256]\n", argv[0]);
+		return 1;
+	}
+
+	/* as many buckets as keys, as a hash table at its fullest would have */
+	while (nbuckets < n)
+		nbuckets <<= 1;
+
+	hashes = malloc(n * sizeof(*hashes));
+	counts = malloc(nbuckets * sizeof(*counts));
+	if (!hashes || !counts)
+		return 1;
+
+	printf("%-9s %-7s %9s %9s %12s %10s %10s\n", "keys", "hash",
+#ifdef __x86_64__
+		"cycles", "batched",
+#else
+		"ns", "batched",
+#endif
+		"bucket chi2", "max bucket", "tag chi2");
+
+	for (s = 0; s < sizeof(sets) / sizeof(sets[0]); s++)
+	{
+		struct keyset ks;
+
+		keyset_make(&ks, sets[s], n);
+		for (f = 0; f < sizeof(fns) / sizeof(fns[0]); f++)
+			if (ub_keyhash_supported(fns[f]))
+				wrong |= bench(&ks, fns[f], hashes, counts, nbuckets);
+
+		free(ks.keys);
+		free(ks.ptrs);
+		free(ks.lens);
+	}
+
+	free(hashes);
+	free(counts);
+	return wrong;
+}
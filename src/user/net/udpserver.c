@@ -1,6 +1,7 @@
 #include <abstract.h>
 #include <net/udpserver.h>
 #include <request.h>
+#include <user/sync.h>
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -45,8 +46,7 @@ static int udpserver_sendmsg(struct request_state* req, struct msghdr* msg,
 	PRINT("[Unbuckle] Sending a message.\n");
 #endif
 
-	err = sendto(udpserver->sock, req->sendbuf, len_data, 0, 
-		(struct sockaddr*) &req->sockaddr, sizeof(struct sockaddr_in));
+	err = sendmsg(udpserver->sock, msg, 0);
 
 #ifdef DEBUG
 	if (err < 0)
@@ -61,20 +61,47 @@ static int udpserver_sendmsg(struct request_state* req, struct msghdr* msg,
 int udpserver_sendall(struct request_state* req)
 {
 	int err;
-	struct iovec iov;
+	int n = 0;
+	size_t len = req->len_sendbuf_cur;
+	struct iovec iov[UB_VAL_IOV_MAX + 2];
 	
 	add_udp_headers(req);
 
-	iov.iov_base = req->sendbuf;
-	iov.iov_len  = req->len_sendbuf_cur;
+	if (req->val_iovcnt > 0)
+	{
+		// everything up to the value, the value straight out of the cache, 
+		// and then whatever followed it in the send buffer
+		iov[n].iov_base = req->sendbuf;
+		iov[n++].iov_len = req->sendbuf_split;
+		memcpy(&iov[n], req->val_iov, req->val_iovcnt * sizeof(struct iovec));
+		n += req->val_iovcnt;
+		iov[n].iov_base = req->sendbuf + req->sendbuf_split;
+		iov[n++].iov_len = req->len_sendbuf_cur - req->sendbuf_split;
+		len += req->len_data;
+	}
+	else
+	{
+		iov[n].iov_base = req->sendbuf;
+		iov[n++].iov_len = req->len_sendbuf_cur;
+	}
 
-	req->msg.msg_iov = (struct iovec*) &iov;
-	req->msg.msg_iovlen = 1;
+	req->msg.msg_iov = iov;
+	req->msg.msg_iovlen = n;
 	req->msg.msg_name = &req->sockaddr;
 	req->msg.msg_namelen = sizeof(struct sockaddr_in);
+	req->msg.msg_control = NULL;
+	req->msg.msg_controllen = 0;
 	
 	// Send the message header
-	err = udpserver_sendmsg(req, &req->msg, req->len_sendbuf_cur);
+	err = udpserver_sendmsg(req, &req->msg, len);
+
+	/* the value has gone, so the entry it was in may be freed now (see 
+	   process_get) */
+	if (req->val_iovcnt > 0)
+	{
+		req->val_iovcnt = 0;
+		rcu_read_unlock();
+	}
 
 	if (err < 0)
 	{
@@ -1,13 +1,31 @@
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
 
 #include <abstract.h>
 #include <core.h>
 #include <entry.h>
 #include <request.h>
 #include <uberrors.h>
+#include <unbuckle.h>
 #include <net/udpserver.h>
+#ifdef STORE_HASHTABLE
+#include <db/hashtable.h>
+#endif
+
+/* As in the kernel, lookups in a hash table which is safe for RCU readers 
+   take no lock at all, and otherwise the key's lock is held. Either way the
+   entry found can't be freed until rcu_read_unlock(). */
+#ifdef HASHTABLE_RCU_LOOKUP
+#define GET_LOCK(req)
+#define GET_UNLOCK()
+#else
+#define GET_LOCK(req) \
+	spinlock_t* get_lock = ub_hashtbl_lock((char*) (req)->key, (req)->len_key)
+#define GET_UNLOCK()  ub_hashtbl_unlock(get_lock)
+#endif
 
 static void add_buffer_to_reply(struct request_state* req, void* buf, int len_buf)
 {
@@ -23,6 +41,16 @@ static void add_string_to_reply(struct request_state* req, char* str)
 	add_buffer_to_reply(req, str, strlen(str));
 	return;
 }
+/* the value found by a GET is sent from where it lies in the cache, in as many
+   pieces as it was stored in, rather than being copied into the send buffer */
+static void add_value_to_reply(struct request_state* req)
+{
+	if (req->val_iovcnt > 0)
+		req->sendbuf_split = req->len_sendbuf_cur;
+	else
+		add_buffer_to_reply(req, req->data, req->len_data);
+	return;
+}
 
 static void build_get_ascii_response(struct request_state* req)
 {
@@ -40,7 +68,7 @@ static void build_get_ascii_response(struct request_state* req)
 		add_string_to_reply(req, "VALUE ");
 		add_buffer_to_reply(req, req->key, req->len_key);
 		add_buffer_to_reply(req, &len_valbuf_formatted, len_len_valbuf);
-		add_buffer_to_reply(req, req->data, req->len_data);
+		add_value_to_reply(req);
 		add_string_to_reply(req, "\r\nEND\r\n");
 	}
 	else if (req->err == -EUBKEYNOTFOUND)
@@ -78,6 +106,8 @@ static void build_get_binary_response(struct request_state* req)
 		// Key was not found
 		req->bin_hdr_response->status = htons(MEMCACHED_STATUS_KEYNOTFOUND);
 	}
+	else if (req->err == -EFBIG)
+		req->bin_hdr_response->status = htons(MEMCACHED_STATUS_VALUETOOLARGE);
 
 	// Note: the key is not echoed back with the data in a binary request
 	req->bin_hdr_response->len_body = htonl(MEMCACHED_LEN_BODY(
@@ -88,7 +118,7 @@ static void build_get_binary_response(struct request_state* req)
 	if (req->len_data > 0)
 	{
 		// Found a result so add that data to the scatter-gather to be returned
-		add_buffer_to_reply(req, req->data, req->len_data);
+		add_value_to_reply(req);
 	}
 	
 	//iov_add(req, req->bin_hdr_response, MEMCACHED_PKT_HDR_RES_LEN);
@@ -110,18 +140,41 @@ static int process_get(struct request_state* req)
 	len_valbuf = memcached_db_linklist_findkey(req->key, req->len_key, &valbuf);
 #endif
 #ifdef STORE_HASHTABLE
-	e = ub_cache_find(req->key, req->len_key);
+	/* The value is sent straight out of the entry, so this stays in the RCU
+	   read section until the reply has gone (see udpserver_sendall), which 
+	   keeps the entry from being freed or reused however long that takes. */
+	rcu_read_lock();
+	{
+		GET_LOCK(req);
+		e = ub_cache_find(req->key, req->len_key, req->key_hash);
+		GET_UNLOCK();
+	}
 #endif
 	if (!e)
 	{
+		rcu_read_unlock();
 		req->err = -EUBKEYNOTFOUND;
 		return req->err;
 	}
 
+	ub_buckets_lru_touch(&e->lru);
+	ub_buckets_note_access(e);
+
 	req->data = ub_entry_loc_val(e);
 	req->len_data = e->len_val;
+	req->val_iovcnt = ub_entry_val_iov(e, req->val_iov, UB_VAL_IOV_MAX);
+	if (req->val_iovcnt < 0 || req->len_data > UDP_MAX_SEND_BYTES)
+	{
+		/* can't go in a single datagram */
+		req->data = NULL;
+		req->len_data = 0;
+		req->val_iovcnt = 0;
+		req->err = -EFBIG;
+	}
 
 	build_get_response(req);
+	if (req->val_iovcnt == 0)
+		rcu_read_unlock();
 		
 	req->state = conn_send;
 
@@ -190,6 +243,44 @@ static int process_set(struct request_state* req)
 	return 0;
 }
 
+static void build_delete_ascii_response(struct request_state* req)
+{
+	if (req->err == 0)
+		add_string_to_reply(req, "DELETED\r\n");
+	else
+		add_string_to_reply(req, "NOT_FOUND\r\n");
+	return;
+}
+
+static void build_delete_binary_response(struct request_state* req)
+{
+	build_common_binary_response_fields(req);
+
+	if (req->err == -EUBKEYNOTFOUND)
+		req->bin_hdr_response->status = htons(MEMCACHED_STATUS_KEYNOTFOUND);
+
+	return;
+}
+
+static void build_delete_response(struct request_state* req)
+{
+	if (req->prot == binary)
+		build_delete_binary_response(req);
+	else
+		build_delete_ascii_response(req);
+}
+
+static int process_delete(struct request_state* req)
+{
+#ifdef STORE_HASHTABLE
+	req->err = ub_cache_delete(req->key, req->len_key);
+#endif
+
+	build_delete_response(req);
+
+	return 0;
+}
+
 int process_request(struct request_state* req)
 {
 	switch (req->cmd)
@@ -202,6 +293,10 @@ int process_request(struct request_state* req)
 		if (process_set(req))
 			return -1;
 		break;
+	case cmd_delete:
+		if (process_delete(req))
+			return -1;
+		break;
 	}
 
 	req->state = conn_send;
@@ -209,9 +304,56 @@ int process_request(struct request_state* req)
 	return 0;
 }
 
+/* a request of its own for each extra server thread, set up as 
+   udpserver_start does the first */
+static struct request_state* request_new(void)
+{
+	struct request_state* req = (struct request_state*) 
+		ALLOCMEM(sizeof(struct request_state), GFP_KERNEL);
+
+	if (!req)
+		return NULL;
+	memset(req, 0, sizeof(struct request_state));
+
+	req->len_recvbuf = UDP_RECV_BUFFER;
+	req->recvbuf = (unsigned char*) ALLOCMEM(req->len_recvbuf, GFP_KERNEL);
+	if (!req->recvbuf || udpserver_init_sendbuffers(req))
+	{
+		FREEMEM(req->recvbuf);
+		FREEMEM(req);
+		return NULL;
+	}
+
+	return req;
+}
+
+static void request_free(struct request_state* req)
+{
+	FREEMEM(req->recvbuf);
+	FREEMEM(req->bin_hdr_response);
+	udpserver_free_sendbuffers(req);
+	FREEMEM(req);
+}
+
+/* Extra server threads all take requests off the one socket, and share the
+   store with the first thread as kernel RX workers do. */
+static void* server_thread(void* arg)
+{
+	struct request_state* req = arg;
+
+	process_slowpath(req);
+
+	ub_epoch_thread_exit();
+	ub_buckets_thread_exit();
+	return NULL;
+}
+
 int ub_core_run(void)
 {
 	int res;
+	pthread_t threads[MAX_WORKERS];
+	struct request_state* reqs[MAX_WORKERS];
+	unsigned int n, i;
 	
 	struct request_state* req = (struct request_state*) 
 		ALLOCMEM(sizeof(struct request_state), GFP_KERNEL);
@@ -238,8 +380,30 @@ int ub_core_run(void)
 		FREEMEM(req);
 		return res;
 	}
+
+	for (n = 0; n + 1 < ub_num_rx_workers && n + 1 < MAX_WORKERS; n++)
+	{
+		reqs[n] = request_new();
+		if (!reqs[n])
+			break;
+		if (pthread_create(&threads[n], NULL, server_thread, reqs[n]))
+		{
+			request_free(reqs[n]);
+			break;
+		}
+	}
+
 	res = process_slowpath(req);
 
+	/* wake the other threads out of recvmsg to find they should stop */
+	ub_sys_running = 0;
+	shutdown(udpserver->sock, SHUT_RDWR);
+	for (i = 0; i < n; i++)
+	{
+		pthread_join(threads[i], NULL);
+		request_free(reqs[i]);
+	}
+
 	udpserver_exit();
 
 	if (req)
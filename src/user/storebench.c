@@ -0,0 +1,345 @@
+/* Stress test and scaling benchmark for the userland store: runs a mix of
+   GETs, SETs and DELETEs through ub_cache_* from 1, 2, 4 ... up to N threads
+   at once, and reports the operations per second for each number of threads.
+   It is built once against each userland table (see "make storebench" in
+   Makefile.user).
+
+   Every value written says which key and which write it came from, and its
+   length and every byte of it follow from those, so a reader can tell if what
+   it copied out was torn, freed underneath it or belonged to another key. The
+   memory limit is kept small enough that the store is evicting all along, and
+   some values are large enough to be chained. Any bad value is counted and
+   makes the exit status nonzero. Now and then a reader gives up its CPU
+   between finding an entry and copying it, to give anything which shouldn't
+   happen to the entry meanwhile (on however few CPUs) the chance to.
+
+   Usage: storebench_<table> [max threads] [keys] [seconds per run]
+          [percent SETs]
+
+   Fewer keys (say 1000) and more SETs make it far likelier that the entry a
+   reader has hold of is replaced meanwhile, which is what to run it with to
+   look for races rather than to measure. */
+
+#include <buckets.h>
+#include <db/hashtable.h>
+#include <entry.h>
+#include <request.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(HASHTABLE_SWISS)
+#define TABLE_NAME "swiss"
+#elif defined(HASHTABLE_CUCKOO)
+#define TABLE_NAME "cuckoo"
+#else
+#define TABLE_NAME "uthash"
+#endif
+
+#define DEFAULT_KEYS 200000
+#define DEFAULT_SECONDS 1
+#define DEFAULT_SETS 10
+#define MEMORY_MB 64
+#define KEY_MAX 32
+#define VAL_MAX (UB_CLASS_MAX_SIZE * 3 / 2)
+#define OPS_PER_CHECK 256 /* between looks at the clock */
+#define DAWDLE_EVERY 64   /* GETs, on average, per yield in the middle of one */
+
+/* lookups as process_get does them, and how long the entry is kept */
+#ifdef HASHTABLE_RCU_LOOKUP
+#define GET_LOCK(key, len)
+#define GET_UNLOCK()
+#else
+#define GET_LOCK(key, len) spinlock_t* get_lock = ub_hashtbl_lock(key, len)
+#define GET_UNLOCK()  ub_hashtbl_unlock(get_lock)
+#endif
+
+struct val_header {
+	uint64_t key;
+	uint64_t version;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned long long rnd;
+	unsigned long ops;
+	unsigned long gets;
+	unsigned long hits;
+	unsigned long bad;
+	char* val;
+	char* copy;
+};
+
+static long nkeys = DEFAULT_KEYS;
+static int set_percent = DEFAULT_SETS;
+static volatile int running;
+
+static unsigned long long rnd(unsigned long long* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static uint64_t mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* one value in 64 is too big for a single chunk */
+static size_t val_len(uint64_t key, uint64_t version)
+{
+	uint64_t h = mix(key * 0x9e3779b97f4a7c15ULL ^ version);
+
+	if ((h & 63) == 0)
+		return UB_CLASS_MAX_SIZE + (h >> 8) % (VAL_MAX - UB_CLASS_MAX_SIZE);
+	return sizeof(struct val_header) + (h >> 8) % 240;
+}
+
+static void val_fill(char* val, uint64_t key, uint64_t version, size_t len)
+{
+	struct val_header hdr = { key, version };
+	uint64_t pattern = mix(key ^ (version << 1));
+	size_t i;
+
+	memcpy(val, &hdr, sizeof(hdr));
+	for (i = sizeof(hdr); i < len; i++)
+		val[i] = (char) ((pattern >> ((i & 7) * 8)) ^ i);
+}
+
+static int val_good(const char* val, size_t len, uint64_t key)
+{
+	struct val_header hdr;
+	uint64_t pattern;
+	size_t i;
+
+	if (len < sizeof(hdr))
+		return 0;
+	memcpy(&hdr, val, sizeof(hdr));
+	if (hdr.key != key || len != val_len(hdr.key, hdr.version))
+		return 0;
+
+	pattern = mix(key ^ (hdr.version << 1));
+	for (i = sizeof(hdr); i < len; i++)
+		if (val[i] != (char) ((pattern >> ((i & 7) * 8)) ^ i))
+			return 0;
+	return 1;
+}
+
+static size_t make_key(char* buf, long i)
+{
+	return snprintf(buf, KEY_MAX, "key:%08lx", i);
+}
+
+static void do_set(struct worker* w, long k, uint64_t version)
+{
+	char key[KEY_MAX];
+	size_t len_key = make_key(key, k);
+	size_t len = val_len(k, version);
+
+	val_fill(w->val, k, version, len);
+	ub_cache_replace(key, len_key, w->val, len);
+}
+
+/* Copy the value out, as a GET would send it, and check it afterwards. The
+   copy is taken with no lock held where the table allows, and the entry is
+   kept from being freed under it only by the read section. */
+static void do_get(struct worker* w, long k)
+{
+	char key[KEY_MAX];
+	size_t len_key = make_key(key, k);
+	uint64_t key_hash = ub_hashtbl_hash(key, len_key);
+	struct iovec iov[UB_VAL_IOV_MAX];
+	struct ub_entry* e;
+	size_t len = 0;
+	int n, i;
+
+	w->gets++;
+	rcu_read_lock();
+	{
+		GET_LOCK(key, len_key);
+		e = ub_cache_find(key, len_key, key_hash);
+		GET_UNLOCK();
+	}
+
+	if (!e)
+	{
+		rcu_read_unlock();
+		return;
+	}
+
+	ub_buckets_lru_touch(&e->lru);
+	if (rnd(&w->rnd) % DAWDLE_EVERY == 0)
+		sched_yield();
+	n = ub_entry_val_iov(e, iov, UB_VAL_IOV_MAX);
+	for (i = 0; i < n; i++)
+	{
+		if (len + iov[i].iov_len > VAL_MAX)
+			break;
+		memcpy(w->copy + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	rcu_read_unlock();
+
+	w->hits++;
+	if (n < 0 || i < n || !val_good(w->copy, len, k))
+		w->bad++;
+}
+
+static void do_delete(struct worker* w, long k)
+{
+	char key[KEY_MAX];
+	size_t len_key = make_key(key, k);
+
+	ub_cache_delete(key, len_key);
+}
+
+static void* worker_run(void* arg)
+{
+	struct worker* w = arg;
+	uint64_t version = (uint64_t) w->id << 48;
+
+	while (running)
+	{
+		int i;
+
+		for (i = 0; i < OPS_PER_CHECK; i++)
+		{
+			unsigned long long r = rnd(&w->rnd);
+			long k = (r >> 8) % nkeys;
+			int op = r % 100;
+
+			if (op < set_percent)
+				do_set(w, k, ++version);
+			else if (op == 99)
+				do_delete(w, k);
+			else
+				do_get(w, k);
+		}
+		w->ops += OPS_PER_CHECK;
+	}
+
+	ub_epoch_thread_exit();
+	ub_buckets_thread_exit();
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of bad values read. */
+static unsigned long run(int nthreads, int seconds, double* base)
+{
+	struct worker* workers = calloc(nthreads, sizeof(struct worker));
+	unsigned long ops = 0, gets = 0, hits = 0, bad = 0;
+	double start, elapsed, rate;
+	int i;
+
+	if (!workers)
+		exit(1);
+
+	running = 1;
+	start = now();
+	for (i = 0; i < nthreads; i++)
+	{
+		struct worker* w = &workers[i];
+
+		w->id = i + 1;
+		w->rnd = 88172645463325252ULL * (i + 1);
+		w->val = malloc(VAL_MAX);
+		w->copy = malloc(VAL_MAX);
+		if (!w->val || !w->copy ||
+			pthread_create(&w->thread, NULL, worker_run, w))
+			exit(1);
+	}
+
+	sleep(seconds);
+	running = 0;
+
+	for (i = 0; i < nthreads; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		ops += workers[i].ops;
+		gets += workers[i].gets;
+		hits += workers[i].hits;
+		bad += workers[i].bad;
+		free(workers[i].val);
+		free(workers[i].copy);
+	}
+	elapsed = now() - start;
+	free(workers);
+
+	rate = ops / elapsed;
+	if (nthreads == 1)
+		*base = rate;
+
+	printf("%-8s %7d %12.0f %12.0f %8.2fx %7.1f%% %8lu%s\n", TABLE_NAME,
+		nthreads, rate, rate / nthreads, rate / *base,
+		gets ? 100.0 * hits / gets : 0, bad, bad ? "  bad values!" : "");
+	return bad;
+}
+
+int main(int argc, char* argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = argc > 1 ? atoi(argv[1]) : (cpus > 0 ? cpus : 1);
+	int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+	unsigned long bad = 0;
+	double base = 1;
+	struct worker prefill = { .id = 0 };
+	int n;
+	long k;
+
+	if (argc > 2)
+		nkeys = atol(argv[2]);
+	if (argc > 4)
+		set_percent = atoi(argv[4]);
+
+	if (max_threads < 1 || nkeys < 1 || seconds < 1 || set_percent < 0 ||
+		set_percent > 99 || ub_keyhash_select(UB_HASH_AUTO) ||
+		ub_hashtbl_init(ub_buckets_capacity(MEMORY_MB)) || 
+		ub_buckets_init(MEMORY_MB))
+	{
+		fprintf(stderr, "Usage: %s [max threads] [keys] [seconds per run] "
+			"[percent SETs]\n", argv[0]);
+		return 1;
+	}
+	ub_buckets_set_evictor(ub_cache_evict, ub_cache_release);
+
+	prefill.val = malloc(VAL_MAX);
+	if (!prefill.val)
+		return 1;
+	for (k = 0; k < nkeys; k++)
+		do_set(&prefill, k, 0);
+	free(prefill.val);
+
+	printf("%-8s %7s %12s %12s %9s %8s %8s\n", "table", "threads", "ops/s",
+		"per thread", "scaling", "hit rate", "bad");
+
+	for (n = 1; n < max_threads; n *= 2)
+		bad += run(n, seconds, &base);
+	bad += run(max_threads, seconds, &base);
+
+	ub_epoch_thread_exit();
+	ub_buckets_thread_exit();
+	ub_hashtbl_exit();
+	ub_buckets_exit();
+
+	return bad != 0;
+}
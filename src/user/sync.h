@@ -0,0 +1,136 @@
+#ifndef UB_USER_SYNC_H
+#define UB_USER_SYNC_H
+
+/* Userland stand-ins for the kernel's spinlocks, mutexes, sequence counts and
+   RCU, so that the code shared by the two builds (the hash tables and the
+   bucket allocator) locks in the same way in both. Spinlocks spin for a
+   while and then yield, since unlike in the kernel whoever holds one may
+   have been descheduled. RCU is the epoch based reclamation in user/epoch.c,
+   whose read side is all but free. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+#include <user/epoch.h>
+
+#ifndef READ_ONCE
+#define READ_ONCE(x) (*(volatile __typeof__(x)*) &(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x)*) &(x) = (val))
+#endif
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(64)))
+#define SINGLE_DEPTH_NESTING 1
+
+#define swap(a, b) \
+	do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+	((type*) ((char*) (ptr) - offsetof(type, member)))
+#endif
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+/* spins before giving the CPU up to whoever holds the lock */
+#define UB_SPIN_TRIES 128
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+#define DEFINE_SPINLOCK(x) spinlock_t x = { 0 }
+
+static inline void spin_lock_init(spinlock_t* lock)
+{
+	lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock)
+{
+	int tries = 0;
+
+	while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+		{
+			if (++tries < UB_SPIN_TRIES)
+				cpu_relax();
+			else
+				sched_yield();
+		}
+	}
+}
+
+static inline void spin_unlock(spinlock_t* lock)
+{
+	__atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* there are no interrupts or lock dependency checker to tell about */
+#define spin_lock_nested(lock, subclass) spin_lock(lock)
+#define spin_lock_irqsave(lock, flags) ((flags) = 0, spin_lock(lock))
+#define spin_unlock_irqrestore(lock, flags) ((void) (flags), spin_unlock(lock))
+
+struct mutex {
+	pthread_mutex_t m;
+};
+
+#define mutex_init(x) pthread_mutex_init(&(x)->m, NULL)
+#define mutex_lock(x) pthread_mutex_lock(&(x)->m)
+#define mutex_unlock(x) pthread_mutex_unlock(&(x)->m)
+
+/* A writer makes the count odd for as long as it is changing things, and a
+   reader goes again if the count was odd or has changed by the time it is
+   done. The fences order what is read or written in between against the
+   count. */
+typedef struct {
+	unsigned int sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t* s)
+{
+	s->sequence = 0;
+}
+
+static inline unsigned int read_seqcount_begin(const seqcount_t* s)
+{
+	unsigned int seq;
+
+	while ((seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE)) & 1)
+		cpu_relax();
+	return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t* s, unsigned int start)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&s->sequence, __ATOMIC_RELAXED) != start;
+}
+
+/* with the writers' lock held */
+static inline void write_seqcount_begin(seqcount_t* s)
+{
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void write_seqcount_end(seqcount_t* s)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+}
+
+#define write_seqcount_begin_nested(s, subclass) write_seqcount_begin(s)
+
+#define rcu_read_lock() ub_epoch_enter()
+#define rcu_read_unlock() ub_epoch_exit()
+#define call_rcu(head, func) ub_epoch_retire(head, func)
+#define synchronize_rcu() ub_epoch_synchronize()
+
+#endif /* UB_USER_SYNC_H */
@@ -1,13 +1,17 @@
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <buckets.h>
 #include <core.h>
 #include <db/hashtable.h>
+#include <entry.h>
 #include <unbuckle.h>
 
 volatile int ub_sys_running = 0;
+unsigned int ub_num_rx_workers = 1;
 static unsigned int ub_global_memory_limit = 65535;
 
 static void unbuckle_exit(int sig)
@@ -16,19 +20,98 @@ static void unbuckle_exit(int sig)
 	return;
 }
 
-int main()
+static void usage(char* prog)
+{
+	fprintf(stderr, "Usage: %s [-m memlim MB] [-n min item size] "
+		"[-f growth factor] [-I max item size] [-p page size] "
+		"[-H hash: 0 auto, 1 spooky, 2 crc32c, 3 fold] "
+		"[-t threads, up to %d]\n", prog, MAX_WORKERS);
+}
+
+int main(int argc, char** argv)
 {	
+	size_t chunk_min = UB_CLASS_MIN_SIZE;
+	size_t item_max = UB_CLASS_MAX_SIZE;
+	size_t page_size = UB_PAGE_SIZE;
+	unsigned int growth = UB_CLASS_GROWTH;
+	int hash = UB_HASH_AUTO;
+	int opt;
+
+	/* the same knobs as memcached where there is an equivalent */
+	while ((opt = getopt(argc, argv, "m:n:f:I:p:H:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			ub_global_memory_limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			chunk_min = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			growth = (unsigned int) (strtod(optarg, NULL) * 100 + 0.5);
+			break;
+		case 'I':
+			item_max = strtoul(optarg, NULL, 10);
+			break;
+		case 'p':
+			page_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			hash = atoi(optarg);
+			break;
+		case 't':
+			ub_num_rx_workers = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (ub_num_rx_workers < 1 || ub_num_rx_workers > MAX_WORKERS)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (ub_buckets_set_geometry(chunk_min, growth, item_max, page_size))
+	{
+		fprintf(stderr, "Invalid bucket geometry.\n");
+		usage(argv[0]);
+		return 1;
+	}
+
 	signal(SIGINT | SIGTERM, unbuckle_exit);
 
 	printf("Unbuckle Key-Value Store starting up...\n");	
 
 	printf("Limiting memory usage to %u MB.\n", ub_global_memory_limit);
+	printf("Serving requests with %u thread%s.\n", ub_num_rx_workers,
+		ub_num_rx_workers > 1 ? "s" : "");
 
 #ifdef STORE_HASHTABLE
-	ub_hashtbl_init();
+	if (ub_keyhash_select(hash))
+	{
+		fprintf(stderr, "This CPU can't do the %s hash.\n", 
+			ub_keyhash_name(hash));
+		return 1;
+	}
+	printf("Hashing keys with %s.\n", ub_keyhash_name(ub_keyhash_fn));
+
+	if (ub_hashtbl_init(ub_buckets_capacity(ub_global_memory_limit)))
+	{
+		fprintf(stderr, "Could not allocate the hash table.\n");
+		return 1;
+	}
 #endif
 	
-	ub_buckets_init(ub_global_memory_limit);
+	if (ub_buckets_init(ub_global_memory_limit))
+	{
+		fprintf(stderr, "Could not set up the buckets.\n");
+		return 1;
+	}
+	ub_buckets_set_evictor(ub_cache_evict, ub_cache_release);
 
 	ub_sys_running = 1;
 
@@ -36,6 +119,9 @@ int main()
 
 	printf("Unloading Unbuckle...\n");
 	ub_sys_running = 0;
+
+	/* free whatever this thread deleted and readers may have been using */
+	ub_epoch_thread_exit();
 	
 #ifdef STORE_HASHTABLE
 	ub_hashtbl_exit();